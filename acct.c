@@ -0,0 +1,394 @@
+/*
+ * (C) 2021 by Rafael David Tinoco <rafael.tinoco@ibm.com>
+ * (C) 2021 by Rafael David Tinoco <rafaeldtinoco@ubuntu.com>
+ */
+
+#include "acct.h"
+#include "ctevent.h"
+#include "event.h"
+
+extern int logfd;
+
+int sortorder;
+int lifecycle;
+int lifesection;
+
+/*
+ * conntrack accounting (net.netfilter.nf_conntrack_acct=1) gives cumulative
+ * counters per connection, and each connection keeps sending them in every
+ * event. As many connections are aggregated into a single flow (source ports
+ * are folded), the flow can't simply sum what it receives: it would count the
+ * same packets over and over. A small table, keyed by the conntrack id, keeps
+ * the last counters seen for each live connection so only deltas are summed
+ * into the flows. Entries not touched for ACCT_IDLE seconds are pruned.
+ *
+ * With lifecycle tracking (DESTROY events) the same table also keeps when
+ * each live connection started, and entries are removed as soon as the
+ * connection is destroyed. DESTROY events can still be lost (ENOBUFS), so
+ * entries idle for longer than conntrack itself would keep a connection
+ * (the established TCP timeout) are pruned as well.
+ */
+
+#define ACCT_IDLE 600
+#define ACCT_PRUNE 60
+#define ACCT_ESTABLISHED 432000		// nf_conntrack_tcp_timeout_established default
+#define ACCT_ESTABLISHED_FILE "/proc/sys/net/netfilter/nf_conntrack_tcp_timeout_established"
+
+struct connacct {
+	uint64_t packets;
+	uint64_t bytes;
+	uint32_t seen;
+	uint32_t start;
+};
+
+GHashTable *conns;
+uint32_t acctidle = ACCT_IDLE;
+
+static uint32_t now(void)
+{
+	return (uint32_t) (g_get_real_time() / G_USEC_PER_SEC);
+}
+
+gint set_sortorder(char *order)
+{
+	if (g_ascii_strcasecmp("flow", order) == 0)
+		sortorder = SORT_FLOW;
+	else if (g_ascii_strcasecmp("volume", order) == 0)
+		sortorder = SORT_VOLUME;
+	else if (g_ascii_strcasecmp("recent", order) == 0)
+		sortorder = SORT_RECENT;
+	else
+		return ERROR;
+
+	return SUCCESS;
+}
+
+// ----
+
+static guint duration_bucket(uint32_t duration)
+{
+	guint bucket = duration ? g_bit_storage(duration) : 0;
+
+	return MIN(bucket, LIFE_BUCKETS - 1);
+}
+
+void get_flowstats(struct ctevent *ev, struct flowstats *st)
+{
+	uint32_t start = 0, stop = 0;
+	struct connacct *conn;
+	struct flowlife *life = NULL;
+
+	memset(st, 0, sizeof(struct flowstats));
+
+	st->last = now();
+	st->first = st->last;
+
+	// activity history (-H): the bucket of this event
+
+	if (activitysecs != 0) {
+		memset(&ev->act, 0, sizeof(struct activity));
+		st->act = &ev->act;
+		activity_mark(st->act, st->last);
+	}
+
+	// conntrack timestamps (net.netfilter.nf_conntrack_timestamp=1)
+
+	if (ev->tstart != 0) {
+		start = (uint32_t) (ev->tstart / 1000000000);
+		st->first = start;
+	}
+	if (ev->tstop != 0)
+		stop = (uint32_t) (ev->tstop / 1000000000);
+
+	// connection lifecycle: the event block, copied by new flows
+
+	if (lifecycle) {
+		life = &ev->life;
+		memset(life, 0, sizeof(struct flowlife));
+		st->life = life;
+
+		switch (ev->type) {
+		case NFCT_T_NEW:
+			life->active = 1;
+			break;
+		case NFCT_T_DESTROY:
+			life->ended = 1;
+			break;
+		default:
+			break;
+		}
+	}
+
+	// conntrack accounting (net.netfilter.nf_conntrack_acct=1)
+
+	if (!ev->hascounters && !lifecycle)
+		return;
+	if (!ev->hasid)
+		goto duration;
+
+	conn = g_hash_table_lookup(conns, GUINT_TO_POINTER(ev->id));
+
+	if (conn == NULL) {
+		conn = g_malloc0(sizeof(struct connacct));
+		// connections started before us have no known start
+		if (start != 0 || ev->type == NFCT_T_NEW)
+			conn->start = st->first;
+		g_hash_table_insert(conns, GUINT_TO_POINTER(ev->id), conn);
+	}
+
+	if (ev->hascounters) {
+
+		// counters going backwards means the conntrack id was reused
+
+		if (ev->packets < conn->packets || ev->bytes < conn->bytes) {
+			conn->packets = 0;
+			conn->bytes = 0;
+		}
+
+		st->packets = ev->packets - conn->packets;
+		st->bytes = ev->bytes - conn->bytes;
+
+		conn->packets = ev->packets;
+		conn->bytes = ev->bytes;
+	}
+
+	conn->seen = st->last;
+
+	if (start == 0)
+		start = conn->start;
+
+	// destroyed connections leave no state behind
+
+	if (ev->type == NFCT_T_DESTROY)
+		g_hash_table_remove(conns, GUINT_TO_POINTER(ev->id));
+
+duration:
+	if (life == NULL || life->ended == 0 || start == 0)
+		return;
+
+	if (stop == 0)
+		stop = st->last;
+
+	life->durations[duration_bucket(stop > start ? stop - start : 0)] = 1;
+}
+
+static void add_flowlife(struct flowstats *flow, struct flowlife *st)
+{
+	struct flowlife *life;
+	guint i;
+
+	if (flow->life == NULL)
+		flow->life = g_malloc0(sizeof(struct flowlife));
+
+	life = flow->life;
+
+	// lifecycle: connections started and ended
+
+	life->active += st->active;
+
+	if (life->active > life->peak)
+		life->peak = life->active;
+
+	if (st->ended == 0)
+		return;
+
+	// connections started before us were never accounted as active
+
+	life->active -= MIN(life->active, st->ended);
+	life->ended += st->ended;
+
+	for (i = 0; i < LIFE_BUCKETS; i++)
+		life->durations[i] += st->durations[i];
+}
+
+void add_flowstats(struct flowstats *flow, struct flowstats *st)
+{
+	// events without accounting (like trace ones) carry no stats
+
+	if (st->last == 0)
+		return;
+
+	flow->packets += st->packets;
+	flow->bytes += st->bytes;
+
+	if (flow->first == 0 || st->first < flow->first)
+		flow->first = st->first;
+	if (st->last > flow->last)
+		flow->last = st->last;
+
+	if (st->act != NULL) {
+		if (flow->act == NULL)
+			flow->act = g_malloc0(sizeof(struct activity));
+		activity_add(flow->act, st->act);
+	}
+
+	if (st->life != NULL)
+		add_flowlife(flow, st->life);
+}
+
+void keep_flowstats(struct flowstats *st)
+{
+	struct flowlife *life = st->life;
+	struct activity *act = st->act;
+
+	// new flows start from the event stats: the event blocks are not theirs
+
+	if (act != NULL) {
+		st->act = g_malloc(sizeof(struct activity));
+		memcpy(st->act, act, sizeof(struct activity));
+	}
+
+	if (life != NULL) {
+		st->life = g_malloc(sizeof(struct flowlife));
+		memcpy(st->life, life, sizeof(struct flowlife));
+		st->life->peak = st->life->active;
+	}
+}
+
+void free_flowstats(struct flowstats *st)
+{
+	g_free(st->act);
+	g_free(st->life);
+}
+
+gint cmp_flowstats(gconstpointer ptr_one, gconstpointer ptr_two, gpointer data)
+{
+	/*
+	 * used to sort arrays of flows: data is the offset of the flowstats
+	 * struct inside the flow struct (different for each flow type)
+	 */
+
+	gsize offset = GPOINTER_TO_SIZE(data);
+	const struct flowstats *one = (gpointer) (*(gchar **) ptr_one + offset);
+	const struct flowstats *two = (gpointer) (*(gchar **) ptr_two + offset);
+
+	switch (sortorder) {
+	case SORT_VOLUME:
+		if (one->bytes > two->bytes)
+			return LESS;
+		if (one->bytes < two->bytes)
+			return MORE;
+		if (one->packets > two->packets)
+			return LESS;
+		if (one->packets < two->packets)
+			return MORE;
+		break;
+	case SORT_RECENT:
+		if (one->last > two->last)
+			return LESS;
+		if (one->last < two->last)
+			return MORE;
+		break;
+	}
+
+	return EQUAL;
+}
+
+// ----
+
+gboolean skip_flowstats(struct flowstats *st)
+{
+	// ended flows (no active connections left) go to the history section
+
+	gboolean ended = (st->life != NULL && st->life->active == 0 && st->life->ended != 0);
+
+	switch (lifesection) {
+	case LIFE_ACTIVE:
+		return ended;
+	case LIFE_HISTORY:
+		return !ended;
+	}
+
+	return FALSE;
+}
+
+void out_flowstats(struct flowstats *st)
+{
+	time_t first = st->first, last = st->last;
+	gchar strfirst[32], strlast[32];
+	struct flowlife *life = st->life;
+	GString *durations;
+	guint i;
+
+	if (st->last == 0)
+		return;
+
+	strftime(strfirst, sizeof(strfirst), "%F %T", localtime(&first));
+	strftime(strlast, sizeof(strlast), "%F %T", localtime(&last));
+
+	dprintf(logfd, "\t\t\t\tpackets: %" PRIu64 ", bytes: %" PRIu64 ", first: %s, last: %s\n",
+			st->packets, st->bytes, strfirst, strlast);
+
+	if (st->act != NULL)
+		out_activity(st->act);
+
+	if (life == NULL)
+		return;
+
+	durations = g_string_new(NULL);
+
+	for (i = 0; i < LIFE_BUCKETS; i++) {
+		if (life->durations[i] == 0)
+			continue;
+		if (i < LIFE_BUCKETS - 1)
+			g_string_append_printf(durations, " <%us: %u", 1U << i, life->durations[i]);
+		else
+			g_string_append_printf(durations, " >=%us: %u", 1U << (i - 1), life->durations[i]);
+	}
+
+	dprintf(logfd, "\t\t\t\tactive: %u, peak: %u, ended: %u, durations:%s\n",
+			life->active, life->peak, life->ended, durations->len ? durations->str : " none");
+
+	g_string_free(durations, TRUE);
+}
+
+// ----
+
+static gboolean prune_connacct(gpointer key, gpointer value, gpointer data)
+{
+	struct connacct *conn = value;
+	uint32_t *limit = data;
+
+	return conn->seen < *limit;
+}
+
+static gint prune_acct(gpointer data)
+{
+	uint32_t limit = now() - acctidle;
+
+	g_hash_table_foreach_remove(conns, prune_connacct, &limit);
+
+	// keep the timeout callback
+
+	return TRUE;
+}
+
+static uint32_t established_timeout(void)
+{
+	gchar *contents = NULL;
+	uint32_t timeout = ACCT_ESTABLISHED;
+
+	if (g_file_get_contents(ACCT_ESTABLISHED_FILE, &contents, NULL, NULL))
+		timeout = (uint32_t) strtoul(contents, NULL, 10);
+
+	g_free(contents);
+
+	return timeout ? timeout : ACCT_ESTABLISHED;
+}
+
+void alloc_acct(void)
+{
+	conns = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_free);
+
+	// lifecycle: DESTROY events remove entries, pruning is only a fallback
+
+	if (lifecycle)
+		acctidle = established_timeout() + ACCT_IDLE;
+
+	ev_add_seconds(ACCT_PRUNE, prune_acct, NULL);
+}
+
+void free_acct(void)
+{
+	g_hash_table_destroy(conns);
+}
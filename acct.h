@@ -0,0 +1,77 @@
+/*
+ * (C) 2021 by Rafael David Tinoco <rafael.tinoco@ibm.com>
+ * (C) 2021 by Rafael David Tinoco <rafaeldtinoco@ubuntu.com>
+ */
+
+#ifndef ACCT_H_
+#define ACCT_H_
+
+#include "general.h"
+#include "activity.h"
+
+struct ctevent;
+
+/*
+ * per flow accounting (sum of all connections aggregated into a flow) and
+ * connection lifecycle (only with DESTROY events): connections started and
+ * ended per flow, the concurrency peak and a log2 histogram of connection
+ * durations (bucket N: less than 2^N seconds, last bucket: anything longer)
+ *
+ * the lifecycle block is only allocated with lifecycle tracking (-D), the
+ * activity ring with activity history (-H): without them flows carry NULL
+ * pointers instead of 76 and 32 bytes of zeros
+ */
+
+#define LIFE_BUCKETS 16
+
+struct flowlife {
+	uint32_t active;
+	uint32_t peak;
+	uint32_t ended;
+	uint32_t durations[LIFE_BUCKETS];
+};
+
+struct flowstats {
+	uint64_t packets;
+	uint64_t bytes;
+	uint32_t first;
+	uint32_t last;
+	struct flowlife *life;		// lifecycle (-D) only
+	struct activity *act;		// activity history (-H) only
+};
+
+/* report ordering */
+
+enum {
+	SORT_FLOW = 0,
+	SORT_VOLUME = 1,
+	SORT_RECENT = 2,
+};
+
+/* report sections (with lifecycle tracking) */
+
+enum {
+	LIFE_ALL = 0,
+	LIFE_ACTIVE = 1,
+	LIFE_HISTORY = 2,
+};
+
+extern int sortorder;
+extern int lifecycle;
+extern int lifesection;
+
+gint set_sortorder(char *);
+
+void get_flowstats(struct ctevent *, struct flowstats *);
+void add_flowstats(struct flowstats *, struct flowstats *);
+void keep_flowstats(struct flowstats *);
+void free_flowstats(struct flowstats *);
+gint cmp_flowstats(gconstpointer, gconstpointer, gpointer);
+
+gboolean skip_flowstats(struct flowstats *);
+void out_flowstats(struct flowstats *);
+
+void alloc_acct(void);
+void free_acct(void);
+
+#endif /* ACCT_H_ */
@@ -0,0 +1,131 @@
+/*
+ * (C) 2021 by Rafael David Tinoco <rafael.tinoco@ibm.com>
+ * (C) 2021 by Rafael David Tinoco <rafaeldtinoco@ubuntu.com>
+ */
+
+#include "activity.h"
+
+extern int logfd;
+
+/*
+ * Flow activity history (-H secs): time is cut in buckets of <secs> seconds
+ * (aligned to the epoch, so hourly buckets are clock hours) and each flow
+ * keeps 1 bit per bucket for the last ACTIVITY_BUCKETS buckets: whether any
+ * event of the flow happened in it. The ring is 32 bytes per flow (24 bytes
+ * of bits, the last bucket and padding), no matter how long conntracker runs,
+ * allocated with the first event of the flow (none at all without -H).
+ *
+ * - a bucket is the absolute bucket number modulo the ring size: marking is
+ *   setting a bit, plus clearing the buckets skipped since the flow was last
+ *   active (they are stale bits of a previous lap), O(1)
+ * - events carry a single marked bucket (their own time), merged into the
+ *   flow like the other flowstats
+ * - the report shows the ring oldest first, relative to the time of the
+ *   report, next to the last time the flow was seen
+ */
+
+guint activitysecs;
+
+gint set_activity(char *optarg)
+{
+	gchar *end;
+
+	activitysecs = (guint) strtoul(optarg, &end, 10);
+
+	if (activitysecs == 0 || *end != '\0')
+		return ERROR;
+
+	return SUCCESS;
+}
+
+// ----
+
+static gboolean activity_get(struct activity *act, uint32_t bucket)
+{
+	guint bit = bucket % ACTIVITY_BUCKETS;
+
+	// buckets not in the ring (too old or in the future) were never active
+
+	if (bucket > act->last || bucket + ACTIVITY_BUCKETS <= act->last)
+		return FALSE;
+
+	return (act->bits[bit / 64] & (1ULL << (bit % 64))) != 0;
+}
+
+static void activity_set(struct activity *act, uint32_t bucket)
+{
+	uint32_t i;
+	guint bit;
+
+	// events older than the ring are lost
+
+	if (bucket + ACTIVITY_BUCKETS <= act->last)
+		return;
+
+	// moving forward: buckets skipped since last time hold bits of a previous lap
+
+	if (bucket > act->last) {
+		if (bucket - act->last >= ACTIVITY_BUCKETS) {
+			memset(act->bits, 0, sizeof(act->bits));
+		} else {
+			for (i = act->last + 1; i <= bucket; i++) {
+				bit = i % ACTIVITY_BUCKETS;
+				act->bits[bit / 64] &= ~(1ULL << (bit % 64));
+			}
+		}
+		act->last = bucket;
+	}
+
+	bit = bucket % ACTIVITY_BUCKETS;
+	act->bits[bit / 64] |= 1ULL << (bit % 64);
+}
+
+void activity_mark(struct activity *act, uint32_t time)
+{
+	if (activitysecs == 0 || time == 0)
+		return;
+
+	activity_set(act, time / activitysecs);
+}
+
+void activity_add(struct activity *flow, struct activity *st)
+{
+	// events only have their own bucket marked
+
+	if (activitysecs == 0 || st->last == 0)
+		return;
+
+	activity_set(flow, st->last);
+}
+
+void out_activity(struct activity *act)
+{
+	guint i;
+	uint32_t bucket, active = 0;
+	GString *ring;
+
+	if (activitysecs == 0 || act->last == 0)
+		return;
+
+	ring = g_string_sized_new(ACTIVITY_BUCKETS + ACTIVITY_BUCKETS / ACTIVITY_GROUP);
+
+	// oldest bucket first, the current one last
+
+	bucket = (uint32_t) (time(NULL) / activitysecs) - (ACTIVITY_BUCKETS - 1);
+
+	for (i = 0; i < ACTIVITY_BUCKETS; i++, bucket++) {
+		if (i != 0 && i % ACTIVITY_GROUP == 0)
+			g_string_append_c(ring, ' ');
+		if (activity_get(act, bucket)) {
+			g_string_append_c(ring, '#');
+			active++;
+		} else {
+			g_string_append_c(ring, '.');
+		}
+	}
+
+	dprintf(logfd, "\t\t\t\tactivity: %u of %u buckets of %us (oldest first): %s\n",
+			active, ACTIVITY_BUCKETS, activitysecs, ring->str);
+
+	g_string_free(ring, TRUE);
+}
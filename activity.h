@@ -0,0 +1,30 @@
+/*
+ * (C) 2021 by Rafael David Tinoco <rafael.tinoco@ibm.com>
+ * (C) 2021 by Rafael David Tinoco <rafaeldtinoco@ubuntu.com>
+ */
+
+#ifndef ACTIVITY_H_
+#define ACTIVITY_H_
+
+#include "general.h"
+
+/* per flow activity history: 1 bit per time bucket, in a fixed size ring */
+
+#define ACTIVITY_BUCKETS 168		// a week of hours, a day of 10 min...
+#define ACTIVITY_WORDS ((ACTIVITY_BUCKETS + 63) / 64)
+#define ACTIVITY_GROUP 24		// buckets per group in the report
+
+struct activity {
+	uint32_t last;			// last bucket marked (time / activitysecs)
+	uint64_t bits[ACTIVITY_WORDS];
+};
+
+extern guint activitysecs;
+
+gint set_activity(char *);
+
+void activity_mark(struct activity *, uint32_t);
+void activity_add(struct activity *, struct activity *);
+void out_activity(struct activity *);
+
+#endif /* ACTIVITY_H_ */
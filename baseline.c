@@ -0,0 +1,487 @@
+/*
+ * (C) 2021 by Rafael David Tinoco <rafael.tinoco@ibm.com>
+ * (C) 2021 by Rafael David Tinoco <rafaeldtinoco@ubuntu.com>
+ */
+
+#include "baseline.h"
+#include "snapshot.h"
+#include "fppath.h"
+#include "netns.h"
+
+/* seqs stored in memory */
+
+extern GSequence *tcpv4flows;
+extern GSequence *udpv4flows;
+extern GSequence *icmpv4flows;
+extern GSequence *tcpv6flows;
+extern GSequence *udpv6flows;
+extern GSequence *icmpv6flows;
+
+/*
+ * Snapshots and baseline diff.
+ *
+ * -o <file>: when finished, the flows are also written into a binary snapshot
+ * (snapshot.c), sorted by flow key.
+ *
+ * -B <file>: a snapshot taken before (last week, before a change window...)
+ * is loaded as the baseline, keeping only the flow and footprints keys of
+ * each record (16 bytes per flow, in a sorted array):
+ *
+ * - every flow not in the baseline is logged the moment it is first seen
+ *   (a binary search per new flow, flows already known cost nothing)
+ * - when finished, the flows (sorted the same way) and the baseline are
+ *   walked side by side: flows not in the baseline and flows that went
+ *   through different rules (footprints key) are listed in the log file,
+ *   followed by how many baseline flows were not seen at all
+ *
+ * A footprints key of 0 (flow not traced) is unknown, not an empty path: it
+ * is never reported as a change, on either side. Records sharing a flow key
+ * are compared as a group (see out_basegroup).
+ *
+ * Like rulesets, snapshots, new flows and the final diff cover the initial
+ * namespace.
+ */
+
+char *snapfile;
+char *basefile;
+
+struct basekey {
+	uint64_t key;
+	uint64_t pathkey;
+};
+
+struct snapitem {
+	struct snaprec rec;		// first: items sort with cmp_snaprec()
+	struct fppath *path;
+};
+
+GArray *baseline;
+
+struct basestats {
+	uint64_t fresh;
+} basestats;
+
+struct basediff {
+	uint64_t fresh;
+	uint64_t changed;
+	uint64_t gone;
+};
+
+// ----
+
+static void add_snapfp(gpointer data, gpointer user_data)
+{
+	struct snapfp sfp;
+	struct footprint *fp = data;
+	GArray *fps = user_data;
+
+	memset(&sfp, 0, sizeof(struct snapfp));
+
+	sfp.table = fp->table;
+	sfp.type = fp->type;
+	sfp.position = fp->position;
+	g_strlcpy(sfp.chain, fp->chain, sizeof(sfp.chain));
+
+	g_array_append_val(fps, sfp);
+}
+
+static GArray *snap_fps(struct fppath *path)
+{
+	GArray *fps = g_array_sized_new(FALSE, FALSE, sizeof(struct snapfp), fppath_length(path));
+
+	fppath_foreach(path, add_snapfp, fps);
+
+	// the same place seen with different rules there (-i generations) counts once
+
+	snap_uniqfps(fps);
+
+	return fps;
+}
+
+static void snap_flow(GArray *items, uint8_t family, uint8_t proto, void *src, void *dst,
+		      uint16_t sport, uint16_t dport, struct footprints *foots, struct flowstats *st)
+{
+	GArray *fps;
+	struct snapitem item;
+	struct footprints *from = foots;
+
+	memset(&item, 0, sizeof(struct snapitem));
+
+	snap_tuple(&item.rec, family, proto, src, dst, sport, dport);
+
+	// flows not traced (sampled or inherited) have the footprints of a sibling
+
+	while (from->path == NULL && from->sibling != NULL)
+		from = from->sibling;
+
+	fps = snap_fps(from->path);
+
+	item.path = from->path;
+	item.rec.nfps = fps->len;
+	item.rec.pathkey = snap_pathkey((struct snapfp *) fps->data, fps->len);
+	item.rec.packets = st->packets;
+	item.rec.bytes = st->bytes;
+	item.rec.first = st->first;
+	item.rec.last = st->last;
+	item.rec.reply = foots->reply;
+
+	g_array_free(fps, TRUE);
+
+	g_array_append_val(items, item);
+}
+
+void snap_tcpv4flows(gpointer data, gpointer user_data)
+{
+	struct tcpv4flow *flow = data;
+
+	snap_flow(user_data, AF_INET, IPPROTO_TCP, &flow->addrs.src, &flow->addrs.dst,
+		  flow->base.src, flow->base.dst, &flow->foots, &flow->stats);
+}
+
+void snap_udpv4flows(gpointer data, gpointer user_data)
+{
+	struct udpv4flow *flow = data;
+
+	snap_flow(user_data, AF_INET, IPPROTO_UDP, &flow->addrs.src, &flow->addrs.dst,
+		  flow->base.src, flow->base.dst, &flow->foots, &flow->stats);
+}
+
+void snap_icmpv4flows(gpointer data, gpointer user_data)
+{
+	struct icmpv4flow *flow = data;
+
+	snap_flow(user_data, AF_INET, IPPROTO_ICMP, &flow->addrs.src, &flow->addrs.dst,
+		  flow->base.type, flow->base.code, &flow->foots, &flow->stats);
+}
+
+void snap_tcpv6flows(gpointer data, gpointer user_data)
+{
+	struct tcpv6flow *flow = data;
+
+	snap_flow(user_data, AF_INET6, IPPROTO_TCP, &flow->addrs.src, &flow->addrs.dst,
+		  flow->base.src, flow->base.dst, &flow->foots, &flow->stats);
+}
+
+void snap_udpv6flows(gpointer data, gpointer user_data)
+{
+	struct udpv6flow *flow = data;
+
+	snap_flow(user_data, AF_INET6, IPPROTO_UDP, &flow->addrs.src, &flow->addrs.dst,
+		  flow->base.src, flow->base.dst, &flow->foots, &flow->stats);
+}
+
+void snap_icmpv6flows(gpointer data, gpointer user_data)
+{
+	struct icmpv6flow *flow = data;
+
+	snap_flow(user_data, AF_INET6, IPPROTO_ICMPV6, &flow->addrs.src, &flow->addrs.dst,
+		  flow->base.type, flow->base.code, &flow->foots, &flow->stats);
+}
+
+static GArray *snap_collect(void)
+{
+	GArray *items = g_array_new(FALSE, FALSE, sizeof(struct snapitem));
+
+	g_sequence_foreach(tcpv4flows, snap_tcpv4flows, items);
+	g_sequence_foreach(udpv4flows, snap_udpv4flows, items);
+	g_sequence_foreach(icmpv4flows, snap_icmpv4flows, items);
+	g_sequence_foreach(tcpv6flows, snap_tcpv6flows, items);
+	g_sequence_foreach(udpv6flows, snap_udpv6flows, items);
+	g_sequence_foreach(icmpv6flows, snap_icmpv6flows, items);
+
+	g_array_sort(items, cmp_snaprec);
+
+	return items;
+}
+
+// ----
+
+static gint cmp_basekey(gconstpointer ptr_one, gconstpointer ptr_two)
+{
+	const struct basekey *one = ptr_one, *two = ptr_two;
+
+	if (one->key < two->key)
+		return LESS;
+	if (one->key > two->key)
+		return MORE;
+
+	return EQUAL;
+}
+
+static void baseline_flow(uint8_t family, uint8_t proto, void *src, void *dst,
+			  uint16_t sport, uint16_t dport)
+{
+	gchar *str;
+	struct snaprec rec;
+	struct basekey key;
+	struct netns *ns = netns_current();
+
+	// the baseline covers the initial namespace only: other ones aren't new
+
+	if (baseline == NULL || (ns != NULL && ns->name != NULL))
+		return;
+
+	snap_tuple(&rec, family, proto, src, dst, sport, dport);
+
+	key.key = rec.key;
+
+	if (bsearch(&key, baseline->data, baseline->len, sizeof(struct basekey), cmp_basekey) != NULL)
+		return;
+
+	basestats.fresh++;
+
+	str = snap_str(&rec.tuple);
+	syslogwrap("Baseline: new flow %s", str);
+	g_free(str);
+}
+
+void baseline_tcpv4flow(struct tcpv4flow *flow)
+{
+	baseline_flow(AF_INET, IPPROTO_TCP, &flow->addrs.src, &flow->addrs.dst,
+		      flow->base.src, flow->base.dst);
+}
+
+void baseline_udpv4flow(struct udpv4flow *flow)
+{
+	baseline_flow(AF_INET, IPPROTO_UDP, &flow->addrs.src, &flow->addrs.dst,
+		      flow->base.src, flow->base.dst);
+}
+
+void baseline_icmpv4flow(struct icmpv4flow *flow)
+{
+	baseline_flow(AF_INET, IPPROTO_ICMP, &flow->addrs.src, &flow->addrs.dst,
+		      flow->base.type, flow->base.code);
+}
+
+void baseline_tcpv6flow(struct tcpv6flow *flow)
+{
+	baseline_flow(AF_INET6, IPPROTO_TCP, &flow->addrs.src, &flow->addrs.dst,
+		      flow->base.src, flow->base.dst);
+}
+
+void baseline_udpv6flow(struct udpv6flow *flow)
+{
+	baseline_flow(AF_INET6, IPPROTO_UDP, &flow->addrs.src, &flow->addrs.dst,
+		      flow->base.src, flow->base.dst);
+}
+
+void baseline_icmpv6flow(struct icmpv6flow *flow)
+{
+	baseline_flow(AF_INET6, IPPROTO_ICMPV6, &flow->addrs.src, &flow->addrs.dst,
+		      flow->base.type, flow->base.code);
+}
+
+// ----
+
+gint alloc_baseline(void)
+{
+	FILE *in;
+	GArray *fps;
+	uint8_t *hostmap;
+	uint32_t hosts;
+	uint64_t i, count;
+	gboolean sorted = TRUE;
+	struct snaprec rec;
+	struct basekey key, last = { 0, 0 };
+
+	if (basefile == NULL)
+		return SUCCESS;
+
+	in = fopen(basefile, "r");
+
+	if (in == NULL)
+		return ERROR;
+
+	if (snap_read_header(in, &count, &hosts) == ERROR) {
+		fclose(in);
+		return ERROR;
+	}
+
+	fps = g_array_new(FALSE, FALSE, sizeof(struct snapfp));
+	hostmap = g_malloc0(SNAP_HOSTBYTES(hosts));
+	baseline = g_array_sized_new(FALSE, FALSE, sizeof(struct basekey), (guint) MIN(count, 1 << 20));
+
+	for (i = 0; i < count; i++) {
+		if (snap_read_rec(in, &rec, fps, hostmap, hosts) == ERROR)
+			break;
+
+		key.key = rec.key;
+		key.pathkey = rec.pathkey;
+
+		if (key.key < last.key)
+			sorted = FALSE;
+
+		g_array_append_val(baseline, key);
+		last = key;
+	}
+
+	g_array_free(fps, TRUE);
+	g_free(hostmap);
+	fclose(in);
+
+	if (i != count) {
+		g_array_free(baseline, TRUE);
+		baseline = NULL;
+		return ERROR;
+	}
+
+	// snapshots come sorted, only a foreign one would need this
+
+	if (!sorted)
+		g_array_sort(baseline, cmp_basekey);
+
+	syslogwrap("Baseline: %u flows loaded from: %s", baseline->len, basefile);
+
+	return SUCCESS;
+}
+
+void free_baseline(void)
+{
+	if (baseline != NULL)
+		g_array_free(baseline, TRUE);
+
+	baseline = NULL;
+}
+
+void out_snapshot(void)
+{
+	guint i;
+	FILE *out;
+	GArray *items, *fps;
+	struct snapitem *item;
+	uint8_t hostmap = 1;		// a single host: this one
+	gint ret = SUCCESS;
+
+	if (snapfile == NULL)
+		return;
+
+	items = snap_collect();
+
+	out = fopen(snapfile, "w");
+
+	if (out == NULL) {
+		syslogwrap("Could not write snapshot into: %s", snapfile);
+		g_array_free(items, TRUE);
+		return;
+	}
+
+	ret |= snap_write_header(out, items->len, 1);
+
+	for (i = 0; i < items->len && ret == SUCCESS; i++) {
+		item = &g_array_index(items, struct snapitem, i);
+		fps = snap_fps(item->path);
+		ret |= snap_write_rec(out, &item->rec, (struct snapfp *) fps->data, &hostmap, 1);
+		g_array_free(fps, TRUE);
+	}
+
+	if (fclose(out) != 0)
+		ret = ERROR;
+
+	if (ret == SUCCESS) {
+		syslogwrap("Snapshot (%u flows) written into: %s", items->len, snapfile);
+	} else {
+		syslogwrap("Could not write snapshot into: %s", snapfile);
+	}
+
+	g_array_free(items, TRUE);
+}
+
+static void out_basediff(const gchar *what, struct snapitem *item)
+{
+	gchar *str = snap_str(&item->rec.tuple);
+
+	dprintf(logfd, " %s %s%s\n", what, str, item->rec.reply ? " (confirmed)" : "");
+	fppath_foreach(item->path, out_footprint, GUINT_TO_POINTER(item->rec.tuple.family));
+
+	g_free(str);
+}
+
+/*
+ * records sharing a key (unconfirmed and confirmed entries of a flow, its NAT
+ * variants with -X) are a group on each side, in no particular order:
+ *
+ * - a flow is changed only if no baseline record of its group went through
+ *   the same rules (or is unknown)
+ * - each flow seen accounts for one baseline record of its group, the ones
+ *   left over were not seen
+ */
+
+static void out_basegroup(struct snapitem *items, guint nitems, struct basekey *bases, guint nbases,
+			  struct basediff *diff)
+{
+	guint i, j;
+	gboolean known;
+
+	for (i = 0; i < nitems; i++) {
+		if (nbases == 0) {
+			out_basediff("NEW", &items[i]);
+			diff->fresh++;
+			continue;
+		}
+
+		// not traced (yet), now or in the baseline, is not a change
+
+		known = (items[i].rec.pathkey == 0);
+
+		for (j = 0; j < nbases && !known; j++)
+			known = (bases[j].pathkey == 0 || bases[j].pathkey == items[i].rec.pathkey);
+
+		if (!known) {
+			out_basediff("CHANGED", &items[i]);
+			diff->changed++;
+		}
+	}
+
+	if (nbases > nitems)
+		diff->gone += nbases - nitems;
+}
+
+void out_baseline(void)
+{
+	guint i = 0, j = 0, nitems, nbases;
+	uint64_t key;
+	GArray *items;
+	struct snapitem *item;
+	struct basekey *base;
+	struct basediff diff;
+
+	if (baseline == NULL)
+		return;
+
+	memset(&diff, 0, sizeof(struct basediff));
+
+	items = snap_collect();
+
+	dprintf(logfd, "Baseline: %s (%u flows)\n", basefile, baseline->len);
+
+	// both sorted by key: a single walk over each, a key group at a time
+
+	while (i < items->len || j < baseline->len) {
+		item = i < items->len ? &g_array_index(items, struct snapitem, i) : NULL;
+		base = j < baseline->len ? &g_array_index(baseline, struct basekey, j) : NULL;
+
+		if (item == NULL || (base != NULL && base->key < item->rec.key))
+			key = base->key;
+		else
+			key = item->rec.key;
+
+		nitems = 0;
+		while (i + nitems < items->len && g_array_index(items, struct snapitem, i + nitems).rec.key == key)
+			nitems++;
+
+		nbases = 0;
+		while (j + nbases < baseline->len && g_array_index(baseline, struct basekey, j + nbases).key == key)
+			nbases++;
+
+		out_basegroup(item, nitems, base, nbases, &diff);
+
+		i += nitems;
+		j += nbases;
+	}
+
+	syslogwrap("Baseline: %" PRIu64 " new flows (%" PRIu64 " flagged while running), "
+		   "%" PRIu64 " with different footprints, %" PRIu64 " not seen",
+		   diff.fresh, basestats.fresh, diff.changed, diff.gone);
+
+	g_array_free(items, TRUE);
+}
@@ -0,0 +1,27 @@
+/*
+ * (C) 2021 by Rafael David Tinoco <rafael.tinoco@ibm.com>
+ * (C) 2021 by Rafael David Tinoco <rafaeldtinoco@ubuntu.com>
+ */
+
+#ifndef BASELINE_H_
+#define BASELINE_H_
+
+#include "general.h"
+#include "flows.h"
+
+extern char *snapfile;
+extern char *basefile;
+
+void baseline_tcpv4flow(struct tcpv4flow *);
+void baseline_udpv4flow(struct udpv4flow *);
+void baseline_icmpv4flow(struct icmpv4flow *);
+void baseline_tcpv6flow(struct tcpv6flow *);
+void baseline_udpv6flow(struct udpv6flow *);
+void baseline_icmpv6flow(struct icmpv6flow *);
+
+gint alloc_baseline(void);
+void free_baseline(void);
+void out_snapshot(void);
+void out_baseline(void);
+
+#endif /* BASELINE_H_ */
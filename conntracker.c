@@ -6,256 +6,245 @@
 #include "conntracker.h"
 #include "general.h"
 #include "flows.h"
+#include "acct.h"
+#include "ports.h"
+#include "ruleset.h"
+#include "query.h"
 #include "footprint.h"
 #include "nlmsg.h"
 #include "iptables.h"
-
-GMainLoop *loop;
-
-static gint ulognlctiocbio_event_cb(const struct nlmsghdr *nlh, void *data)
+#include "ipset.h"
+#include "ctevent.h"
+#include "workers.h"
+#include "netns.h"
+#include "event.h"
+#include "nlbuf.h"
+#include "sample.h"
+#include "tracesched.h"
+#include "fppath.h"
+#include "ctpoll.h"
+#include "seen.h"
+#include "baseline.h"
+#include "ruleidx.h"
+#include "hitters.h"
+#include "nat.h"
+
+static void ctevent_fold(struct ctevent *ev, uint16_t *sport, uint16_t *dport, uint8_t *folded)
 {
-	int ret;
-	uint32_t mark = 0;
-	const char *prefix = NULL;
+	*sport = ev->sport;
+	*dport = ev->dport;
+	*folded = 0;
 
-	struct nfgenmsg *nfg;
-	struct nlattr *attrs[NFULA_MAX + 1] = { NULL };
-	struct nfulnl_msg_packet_hdr *ph = NULL;
+	// NOTE: client side ports (source or destination) logged as 1024
 
-	struct nf_conntrack *ct = NULL;
-	struct footprint fp;
+	if (ev->proto == IPPROTO_TCP || ev->proto == IPPROTO_UDP)
+		*folded = fold_ports(ev->family, ev->proto, &ev->src, &ev->dst, sport, dport);
+}
 
-	// raw netlink msgs related to ulog (trace match)
+static void ctevent_merge(struct ctevent *ev, uint16_t sport, uint16_t dport, uint8_t folded, gboolean settled)
+{
+	struct footprint *fp = ev->hasfp ? &ev->fp : NULL;
+	struct in_addr ipv4src = ev->src.ipv4, ipv4dst = ev->dst.ipv4;
+	struct in6_addr *ipv6src = &ev->src.ipv6, *ipv6dst = &ev->dst.ipv6;
+	struct natbase nat;
 
-	ret = nflog_nlmsg_parse(nlh, attrs);
-	if (ret != MNL_CB_OK)
-		return ret;
+	// post-NAT endpoints (-X): translated addresses interned, ports folded
 
-	nfg = mnl_nlmsg_get_payload(nlh);
+	nat_base(ev, sport, dport, &nat);
 
-	if (attrs[NFULA_PREFIX])
-		prefix = mnl_attr_get_str(attrs[NFULA_PREFIX]);
+	// rule attribution (-i): footprints carry the generation of their rule
 
-	if (attrs[NFULA_CT] == NULL)
-		return MNL_CB_OK;
+	if (fp != NULL)
+		ruleidx_stamp(ev->family, fp);
 
 	/*
-	 * when receiving ulog netlink msgs from kernel (for TRACE) we have:
-	 *
-	 * TRACE: table:chain:type:position
-	 *        [0]   [1]   [2]  [3]
+	 * store the flows in memory for further processing. trace messages go
+	 * to the flow they belong to, if there is one already: a packet not
+	 * translated yet (-X) belongs to a NAT variant of its tuple, it must
+	 * not become a flow of its own
 	 */
 
-	gchar **vector = g_strsplit_set((prefix+strlen("TRACE: ")), ":", -1);
-
-	memset(&fp, 0, sizeof(struct footprint));
-
-	// chain name
-
-	g_strlcpy(fp.chain, vector[1], strlen(vector[1])+1);
-
-	// table name
-
-	if (g_ascii_strcasecmp("raw", vector[0]) == 0)
-		fp.table = FOOTPRINT_TABLE_RAW;
-	if (g_ascii_strcasecmp("mangle", vector[0]) == 0)
-		fp.table = FOOTPRINT_TABLE_MANGLE;
-	if (g_ascii_strcasecmp("nat", vector[0]) == 0)
-		fp.table = FOOTPRINT_TABLE_NAT;
-	if (g_ascii_strcasecmp("filter", vector[0]) == 0)
-		fp.table = FOOTPRINT_TABLE_FILTER;
-	if (fp.table == 0)
-		fp.table = FOOTPRINT_TABLE_UNKNOWN;
-
-	// rule type
-
-	if (g_ascii_strcasecmp("policy", vector[2]) == 0)
-		fp.type = FOOTPRINT_TYPE_POLICY;
-	if (g_ascii_strcasecmp("rule", vector[2]) == 0)
-		fp.type = FOOTPRINT_TYPE_RULE;
-	if (g_ascii_strcasecmp("return", vector[2]) == 0)
-		fp.type = FOOTPRINT_TYPE_RETURN;
-	if (fp.type == 0)
-		fp.type = FOOTPRINT_TYPE_UNKNOWN;
-
-	// position of the rule
-
-	fp.position = (uint32_t) ((long int) strtol(vector[3], NULL, 0));
-
-	g_strfreev(vector);
-
-	// conntrack data related, extracted from the netlink communication
-
-	ct = nfct_new();
+	switch (ev->family) {
+	case AF_INET:
+		switch (ev->proto) {
+		case IPPROTO_TCP:
+			if (fp != NULL && add_tcpv4fp(ipv4src, ipv4dst, sport, dport, folded, ev->reply, &nat, fp) == SUCCESS)
+				break;
+			add_tcpv4flow(ipv4src, ipv4dst, sport, dport, folded, ev->reply, &nat, &ev->stats);
+			if (fp != NULL)
+				add_tcpv4fp(ipv4src, ipv4dst, sport, dport, folded, ev->reply, &nat, fp);
+			else if (!settled && ev->type != NFCT_T_DESTROY)
+				add_tcpv4trace(ipv4src, ipv4dst, sport, dport, folded, ev->reply, &nat);
+			break;
+		case IPPROTO_UDP:
+			if (fp != NULL && add_udpv4fp(ipv4src, ipv4dst, sport, dport, folded, ev->reply, &nat, fp) == SUCCESS)
+				break;
+			add_udpv4flow(ipv4src, ipv4dst, sport, dport, folded, ev->reply, &nat, &ev->stats);
+			if (fp != NULL)
+				add_udpv4fp(ipv4src, ipv4dst, sport, dport, folded, ev->reply, &nat, fp);
+			else if (!settled && ev->type != NFCT_T_DESTROY)
+				add_udpv4trace(ipv4src, ipv4dst, sport, dport, folded, ev->reply, &nat);
+			break;
+		case IPPROTO_ICMP:
+			if (fp != NULL && add_icmpv4fp(ipv4src, ipv4dst, ev->itype, ev->icode, ev->reply, &nat, fp) == SUCCESS)
+				break;
+			add_icmpv4flow(ipv4src, ipv4dst, ev->itype, ev->icode, ev->reply, &nat, &ev->stats);
+			if (fp != NULL)
+				add_icmpv4fp(ipv4src, ipv4dst, ev->itype, ev->icode, ev->reply, &nat, fp);
+			else if (!settled && ev->type != NFCT_T_DESTROY)
+				add_icmpv4trace(ipv4src, ipv4dst, ev->itype, ev->icode, ev->reply, &nat);
+			break;
+		}
+		break;
+	case AF_INET6:
+		switch (ev->proto) {
+		case IPPROTO_TCP:
+			if (fp != NULL && add_tcpv6fp(*ipv6src, *ipv6dst, sport, dport, folded, ev->reply, &nat, fp) == SUCCESS)
+				break;
+			add_tcpv6flow(*ipv6src, *ipv6dst, sport, dport, folded, ev->reply, &nat, &ev->stats);
+			if (fp != NULL)
+				add_tcpv6fp(*ipv6src, *ipv6dst, sport, dport, folded, ev->reply, &nat, fp);
+			else if (!settled && ev->type != NFCT_T_DESTROY)
+				add_tcpv6trace(*ipv6src, *ipv6dst, sport, dport, folded, ev->reply, &nat);
+			break;
+		case IPPROTO_UDP:
+			if (fp != NULL && add_udpv6fp(*ipv6src, *ipv6dst, sport, dport, folded, ev->reply, &nat, fp) == SUCCESS)
+				break;
+			add_udpv6flow(*ipv6src, *ipv6dst, sport, dport, folded, ev->reply, &nat, &ev->stats);
+			if (fp != NULL)
+				add_udpv6fp(*ipv6src, *ipv6dst, sport, dport, folded, ev->reply, &nat, fp);
+			else if (!settled && ev->type != NFCT_T_DESTROY)
+				add_udpv6trace(*ipv6src, *ipv6dst, sport, dport, folded, ev->reply, &nat);
+			break;
+		case IPPROTO_ICMPV6:
+			if (fp != NULL && add_icmpv6fp(*ipv6src, *ipv6dst, ev->itype, ev->icode, ev->reply, &nat, fp) == SUCCESS)
+				break;
+			add_icmpv6flow(*ipv6src, *ipv6dst, ev->itype, ev->icode, ev->reply, &nat, &ev->stats);
+			if (fp != NULL)
+				add_icmpv6fp(*ipv6src, *ipv6dst, ev->itype, ev->icode, ev->reply, &nat, fp);
+			else if (!settled && ev->type != NFCT_T_DESTROY)
+				add_icmpv6trace(*ipv6src, *ipv6dst, ev->itype, ev->icode, ev->reply, &nat);
+			break;
+		}
+		break;
+	}
+}
 
-	if (ct == NULL)
-		return MNL_CB_ERROR;
+static void ctevent_process(struct ctevent *ev)
+{
+	uint16_t sport, dport;
+	uint8_t folded;
 
-	if (nfct_payload_parse(mnl_attr_get_payload(attrs[NFULA_CT]),
-			       mnl_attr_get_payload_len(attrs[NFULA_CT]),
-			       nfg->nfgen_family, ct) < 0) {
-		return MNL_CB_ERROR;
-	}
+	ctevent_fold(ev, &sport, &dport, &folded);
+	ctevent_merge(ev, sport, dport, folded, FALSE);
+}
 
-	/*
-	 * ready to call conntracio_event_cb (like) function to populate
-	 * in-memory trees note: different than when calling from
-	 * libnetfilter_conntrack path, this one includes the tracing data with
-	 * a pointer to a local footprint struct (that shall be copied in the
-	 * conntrackio_event_cb and kept in memory with the flow list items
-	 */
+static gint ulognlctiocbio_event_cb(const struct nlmsghdr *nlh, void *data)
+{
+	struct ctevent ev;
 
-	ret = conntrackio_event_cb(NF_NETLINK_CONNTRACK_UPDATE, ct, &fp);
+	// ulog netlink msgs from kernel (TRACE): flow + footprint
 
-	nfct_destroy(ct);
+	if (ctevent_from_nflog(nlh, &ev) == SUCCESS)
+		ctevent_process(&ev);
 
 	return MNL_CB_OK;
 }
 
-static gint conntrackio_event_cb(enum nf_conntrack_msg_type type, struct nf_conntrack *ct, void *data)
+static void conntrackio_event(struct ctevent *ev)
 {
-	short reply = 0;
+	uint64_t seen;
+	uint16_t sport, dport;
+	uint8_t folded;
+	gboolean settled;
 
-	uint8_t *family = NULL, *proto = NULL;
-	uint16_t *psrc = NULL, *pdst = NULL;
-	uint8_t *itype = NULL, *icode = NULL;
-	uint32_t *constatus = NULL;
-	struct in_addr ipv4src, ipv4dst;
-	struct in6_addr *ipv6src = NULL, *ipv6dst = NULL;
-	uint16_t privport = htons(1024);
+	// folded once: the seen filter key and the flows tables share it
 
-	struct footprint *fp = data;
+	ctevent_fold(ev, &sport, &dport, &folded);
 
-	// initialize to avoid compiler warnings
+	// settled flows (known, confirmed and traced): nothing to learn from updates
 
-	memset(&ipv4src, 0, sizeof(struct in_addr));
-	memset(&ipv4dst, 0, sizeof(struct in_addr));
+	settled = seen_lookup(ev, sport, dport, &seen);
 
-	// check if flow ever got a reply from the peer
+	// ... but their counters and activity (-H): those still refresh the flow stats
 
-	constatus = (uint32_t *) nfct_get_attr(ct, ATTR_STATUS);
+	if (settled && !ev->hascounters && activitysecs == 0)
+		return;
 
-	if (*constatus & IPS_SEEN_REPLY)
-		reply = 1;
+	// accounting and timestamps: only conntrack events carry them
 
-	// skip address families other than IPv4 and IPv6
+	get_flowstats(ev, &ev->stats);
 
-	family = (uint8_t *) nfct_get_attr(ct, ATTR_L3PROTO);
+	// busiest destinations, services and sources (-k)
 
-	switch (*family) {
-	case AF_INET:
-	case AF_INET6:
-		break;
-	default:
-		debug("skipping non AF_INET/AF_INET6 traffic");
-		return NFCT_CB_CONTINUE;
-	}
+	hitters_add(ev);
 
-	// skip IP protocols other than TCP / UDP / ICMP / ICMPv6
+	ctevent_merge(ev, sport, dport, folded, settled);
 
-	proto = (uint8_t *) nfct_get_attr(ct, ATTR_L4PROTO);
+	// confirmed flows are traced (or sampled) by now: settled
 
-	switch (*proto) {
-	case IPPROTO_TCP:
-	case IPPROTO_UDP:
-	case IPPROTO_ICMP:
-	case IPPROTO_ICMPV6:
-		break;
-	default:
-		debug("skipping non UDP/TCP/ICMP/ICMPv6 traffic");
-		return NFCT_CB_CONTINUE;
-	}
+	if (!settled && ev->reply && ev->type != NFCT_T_DESTROY)
+		seen_add(seen);
+}
 
-	// netfilter: address family only attributes
+static gint conntrackio_event_cb(enum nf_conntrack_msg_type type, struct nf_conntrack *ct, void *data)
+{
+	struct ctevent ev;
 
-	switch (*family) {
-	case AF_INET:
-		ipv4src.s_addr = *((in_addr_t *) nfct_get_attr(ct, ATTR_IPV4_SRC));
-		ipv4dst.s_addr = *((in_addr_t *) nfct_get_attr(ct, ATTR_IPV4_DST));
-		break;
-	case AF_INET6:
-		ipv6src = (struct in6_addr *) nfct_get_attr(ct, ATTR_IPV6_SRC);
-		ipv6dst = (struct in6_addr *) nfct_get_attr(ct, ATTR_IPV6_DST);
-		break;
-	}
+	// table dumps (resync and polling) come as nf_conntrack objects
 
-	// netfilter: protocol only attributes
+	if (ctevent_from_ct(type, ct, &ev) == SUCCESS)
+		conntrackio_event(&ev);
 
-	switch (*proto) {
-	case IPPROTO_TCP:
-	case IPPROTO_UDP:
-		psrc = (uint16_t *) nfct_get_attr(ct, ATTR_PORT_SRC);
-		pdst = (uint16_t *) nfct_get_attr(ct, ATTR_PORT_DST);
-		// NOTE: all unprivileged source ports logged as 1024
-		if ((int) ntohs(*psrc) > 1024)
-			psrc = &privport;
-		break;
-	case IPPROTO_ICMP:
-	case IPPROTO_ICMPV6:
-		itype = (uint8_t *) nfct_get_attr(ct, ATTR_ICMP_TYPE);
-		icode = (uint8_t *) nfct_get_attr(ct, ATTR_ICMP_CODE);
-		break;
-	}
+	return NFCT_CB_CONTINUE;
+}
 
-	// store the flows in memory for further processing
+static int conntrackio_nlmsg_cb(const struct nlmsghdr *nlh, void *data)
+{
+	struct ctevent ev;
 
-	switch (*family) {
-	case AF_INET:
-		switch (*proto) {
-		case IPPROTO_TCP:
-			add_tcpv4flow(ipv4src, ipv4dst, *psrc, *pdst, reply);
-			if (fp != NULL)
-				add_tcpv4fp(ipv4src, ipv4dst, *psrc, *pdst, reply, fp);
-			else
-				add_tcpv4trace(ipv4src, ipv4dst, *psrc, *pdst, reply);
-			break;
-		case IPPROTO_UDP:
-			add_udpv4flow(ipv4src, ipv4dst, *psrc, *pdst, reply);
-			if (fp != NULL)
-				add_udpv4fp(ipv4src, ipv4dst, *psrc, *pdst, reply, fp);
-			else
-				add_udpv4trace(ipv4src, ipv4dst, *psrc, *pdst, reply);
-			break;
-		case IPPROTO_ICMP:
-			add_icmpv4flow(ipv4src, ipv4dst, *itype, *icode, reply);
-			if (fp != NULL)
-				add_icmpv4fp(ipv4src, ipv4dst, *itype, *icode, reply, fp);
-			else
-				add_icmpv4trace(ipv4src, ipv4dst, *itype, *icode, reply);
-			break;
-		}
-		break;
-	case AF_INET6:
-		switch (*proto) {
-		case IPPROTO_TCP:
-			add_tcpv6flow(*ipv6src, *ipv6dst, *psrc, *pdst, reply);
-			if (fp != NULL)
-				add_tcpv6fp(*ipv6src, *ipv6dst, *psrc, *pdst, reply, fp);
-			break;
-		case IPPROTO_UDP:
-			add_udpv6flow(*ipv6src, *ipv6dst, *psrc, *pdst, reply);
-			if (fp != NULL)
-				add_udpv6fp(*ipv6src, *ipv6dst, *psrc, *pdst, reply, fp);
-			break;
-		case IPPROTO_ICMPV6:
-			add_icmpv6flow(*ipv6src, *ipv6dst, *itype, *icode, reply);
-			if (fp != NULL)
-				add_icmpv6fp(*ipv6src, *ipv6dst, *itype, *icode, reply, fp);
-			break;
-		}
-		break;
-	}
+	// conntrack events: attributes walked in place (no nf_conntrack object)
 
-	return NFCT_CB_CONTINUE;
+	if (ctevent_from_nlmsg(nlh, &ev) == SUCCESS)
+		conntrackio_event(&ev);
+
+	return MNL_CB_OK;
 }
 
 void cleanup(void)
 {
-	out_all();
-	free_flows();
+	query_close();
+	workers_stop();
+	out_logfile();
+	out_netns();
+	if (rulesfile != NULL)
+		out_ruleset();
+	out_snapshot();
+	out_baseline();
+	out_nlbufs();
+	out_sampling();
+	out_sched();
+	out_traces();
+	out_fppaths();
+	out_polling();
+	out_seen();
+	out_ruleidx();
+	out_natdict();
+	netns_free();
+	free_fppaths();
+	poll_free();
+	free_seen();
+	free_baseline();
+	free_ruleidx();
+	free_hitters();
+	free_nat();
+	free_acct();
+	free_ports();
+	free_sample();
+	free_sched();
+	out_evstats();
+	ev_free();
 	endlog();
-	del_conntrack();
-	iptables_cleanup();
 }
 
 void trap(int what)
@@ -264,6 +253,30 @@ void trap(int what)
 	exit(SUCCESS);
 }
 
+static void resync_conntrack(struct netns *ns)
+{
+	uint32_t family = AF_UNSPEC;
+	struct nfct_handle *nfcth;
+
+	// a dump (separate socket) brings back new flows and counters
+
+	if (netns_setns(ns) == ERROR)
+		return;
+
+	nfcth = nfct_open(CONNTRACK, 0);
+
+	netns_setns(NULL);
+
+	if (nfcth == NULL)
+		return;
+
+	syslogwrap("Conntrack events were lost, dumping the table");
+
+	nfct_callback_register(nfcth, NFCT_T_ALL, conntrackio_event_cb, NULL);
+	nfct_query(nfcth, NFCT_Q_DUMP, &family);
+	nfct_close(nfcth);
+}
+
 gboolean ulognlctiocb(GIOChannel *source, GIOCondition condition, gpointer data)
 {
 	// deal with ulog (+ conntrack) netfilter netlink messages
@@ -275,8 +288,14 @@ gboolean ulognlctiocb(GIOChannel *source, GIOCondition condition, gpointer data)
 
 	ret = mnl_socket_recvfrom(ulognl, buf, sizeof(buf));
 
-	if (ret < 0)
-		return FALSE;
+	if (ret < 0) {
+		// lost trace messages: bigger buffer, nothing to resync
+		if (errno == ENOBUFS) {
+			nlbuf_overrun(netns_current()->ulogbuf);
+			return TRUE;
+		}
+		return errno == EINTR;
+	}
 
 	ret = mnl_cb_run(buf, ret, 0, portid, ulognlctiocbio_event_cb, NULL);
 
@@ -300,45 +319,206 @@ gboolean conntrackiocb(GIOChannel *source, GIOCondition condition, gpointer data
 
 	ret = nfnl_recv(nfnlh, buf, sizeof(buf));
 
-	if (ret < 0 && errno != EINTR)
-		return FALSE;
+	if (ret < 0) {
+		// lost events: bigger buffer and, if reliable, dump the table
+		if (errno == ENOBUFS) {
+			if (nlbuf_overrun(netns_current()->ctbuf))
+				resync_conntrack(netns_current());
+			return TRUE;
+		}
+		return errno == EINTR;
+	}
 
-	ret = nfnl_process(nfnlh, buf, ret);
+	ret = mnl_cb_run(buf, ret, 0, 0, conntrackio_nlmsg_cb, NULL);
 
-	if (ret <= NFNL_CB_STOP)
+	if (ret < MNL_CB_STOP)
 		return FALSE;
 
 	// return FALSE to stop event source, TRUE not to
 	return TRUE;
 }
 
-int main(int argc, char **argv)
+gboolean conntracknsiocb(GIOChannel *source, GIOCondition condition, gpointer data)
 {
-	int opt, ret = 0;
-	guint conntrackioid;
-	guint ulognlctioid;
+	gboolean ret;
+	struct netns *ns = data;
 
-	GIOChannel *conntrackio;
-	GIOChannel *ulognlctio;
+	// flows go to the tables of the namespace the socket belongs to
 
-	struct nfct_handle *nfcth;
+	netns_enter(ns);
+	ret = conntrackiocb(source, condition, (gpointer) nfct_nfnlh(ns->nfcth));
+	netns_leave();
+
+	return ret;
+}
+
+gboolean ulognlctnsiocb(GIOChannel *source, GIOCondition condition, gpointer data)
+{
+	gboolean ret;
+	struct netns *ns = data;
+
+	netns_enter(ns);
+	ret = ulognlctiocb(source, condition, ns->ulognl);
+	netns_leave();
+
+	return ret;
+}
+
+static gint start_netns(struct netns *ns)
+{
+	gint ret = 0;
+	gchar *name;
 	struct nfnl_handle *nfnlh;
-	struct mnl_socket *ulognl;
+
+	// rules and sets (current namespace)
 
 	ret |= iptables_cleanup();
 	ret |= add_conntrack();
 
 	if (ret == ERROR) {
 		perror("add_conntrack()");
-		exit(ERROR);
+		return ERROR;
 	}
 
-	loop = g_main_loop_new(NULL, FALSE);
+	// sockets are created inside the namespace they will listen to
+
+	if (netns_setns(ns) == ERROR)
+		return ERROR;
+
+	// polling mode: reply status and counters come from periodic dumps
+
+	ns->nfcth = nfct_open(CONNTRACK, NF_NETLINK_CONNTRACK_NEW |
+			      (pollsecs ? 0 : NF_NETLINK_CONNTRACK_UPDATE) |
+			      (lifecycle ? NF_NETLINK_CONNTRACK_DESTROY : 0));
+	ns->ulognl = ulognlct_open();
+	ns->ipsetnl = ipset_open();
+
+	netns_setns(NULL);
+
+	// conntrack initialization
+
+	if (!ns->nfcth) {
+		perror("nfct_open");
+		return ERROR;
+	}
+
+	// conntrack socket file descriptor callback (messages parsed in place)
+
+	nfnlh = (struct nfnl_handle *) nfct_nfnlh(ns->nfcth);
+
+	name = g_strdup_printf("conntrack %s", ns->name ? ns->name : "initial");
+	ns->ctbuf = nlbuf_new(name, nfnlh->fd);
+	g_free(name);
+
+	ns->conntrackioid = ev_add_io(nfnlh->fd, conntracknsiocb, ns);
+
+	if (pollsecs != 0)
+		ns->pollid = poll_start(ns);
+
+	// netfilter ulog netlink (through libmnl) initialization
+
+	if (ns->ulognl == NULL) {
+		perror("ulognlct_open");
+		return ERROR;
+	}
+
+	name = g_strdup_printf("trace %s", ns->name ? ns->name : "initial");
+	ns->ulogbuf = nlbuf_new(name, ns->ulognl->fd);
+	g_free(name);
+
+	if (ns->ipsetnl == NULL)
+		perror("ipset_open");
+
+	ipset_use(ns->ipsetnl);
+
+	if (ns->name == NULL && nworkers > 0) {
+		// traces decoded by worker threads, merged by the main loop
+		if (workers_start(ns->ulognl, ns->ulogbuf, ctevent_process) == ERROR) {
+			perror("workers_start");
+			return ERROR;
+		}
+	} else {
+		ns->ulognlctioid = ev_add_io(ns->ulognl->fd, ulognlctnsiocb, ns);
+	}
+
+	return SUCCESS;
+}
+
+static gint stop_netns(struct netns *ns)
+{
+	gint ret = 0;
+
+	if (ns->conntrackioid != 0)
+		ev_remove(ns->conntrackioid);
+	if (ns->ulognlctioid != 0)
+		ev_remove(ns->ulognlctioid);
+	if (ns->pollid != 0)
+		ev_remove(ns->pollid);
+
+	if (ns->nfcth != NULL)
+		ret |= nfct_close(ns->nfcth);
+	if (ns->ulognl != NULL)
+		ret |= ulognlct_close(ns->ulognl);
+
+	ipset_close(ns->ipsetnl);
+
+	nlbuf_free(ns->ctbuf);
+	nlbuf_free(ns->ulogbuf);
+
+	ns->ctbuf = ns->ulogbuf = NULL;
+	ns->conntrackioid = ns->ulognlctioid = ns->pollid = 0;
+	ns->nfcth = NULL;
+	ns->ulognl = NULL;
+	ns->ipsetnl = NULL;
+
+	// rules and sets (current namespace)
+
+	ret |= del_conntrack();
+	ret |= iptables_cleanup();
+
+	return ret;
+}
+
+void usage(char *prog)
+{
+	g_fprintf(stdout, "Syntax: %s -[f|d] for foreground/daemon mode\n", prog);
+	g_fprintf(stdout, "\t-s [flow|volume|recent] to sort the dump by flow, bytes or last seen\n");
+	g_fprintf(stdout, "\t-D to track connections lifecycle (DESTROY events)\n");
+	g_fprintf(stdout, "\t-H <secs> to keep the activity history of each flow in buckets of secs\n");
+	g_fprintf(stdout, "\t-k <count>[/prefix4[,prefix6]] to track the top destinations, services and source nets\n");
+	g_fprintf(stdout, "\t-X to keep translated connections (SNAT/DNAT) apart by their post-NAT endpoints\n");
+	g_fprintf(stdout, "\t-r <file> to generate a ruleset from the observed flows\n");
+	g_fprintf(stdout, "\t-R [nft|iptables] ruleset format (default: nft)\n");
+	g_fprintf(stdout, "\t-o <file> to write a binary snapshot of the observed flows\n");
+	g_fprintf(stdout, "\t-B <file> to report only flows (or footprints) not in a baseline snapshot\n");
+	g_fprintf(stdout, "\t-i to show the rule of each footprint (ruleset index kept current)\n");
+	g_fprintf(stdout, "\t-q <socket> to answer live queries at a unix socket\n");
+	g_fprintf(stdout, "\t-w <workers> number of threads decoding traces (default: 0, main loop)\n");
+	g_fprintf(stdout, "\t-e [glib|epoll] event loop backend (default: glib)\n");
+	g_fprintf(stdout, "\t-b <bytes> netlink receive buffers initial size (default: %d)\n", NLBUF_DEFAULT);
+	g_fprintf(stdout, "\t-N best effort (NETLINK_NO_ENOBUFS) instead of resyncing lost events\n");
+	g_fprintf(stdout, "\t-p <secs>[,mark=<val>[/mask]][,zone=<id>] to poll (filtered dumps) instead of update events\n");
+	g_fprintf(stdout, "\t-F <kbytes> filter out updates of settled flows (bloom filter size)\n");
+	g_fprintf(stdout, "\t-S <rate>[/prefix4[,prefix6]] to trace 1 of each <rate> flows of a class\n");
+	g_fprintf(stdout, "\t-I <secs>[/prefix4[,prefix6]] to reuse footprints of a traced flow from the same source net\n");
+	g_fprintf(stdout, "\t-m to trace IPv4 flows through set members (static rules) instead of rules\n");
+	g_fprintf(stdout, "\t-t <rules/sec> budget for trace rules installation\n");
+	g_fprintf(stdout, "\t-T <flows> max number of flows being traced at the same time\n");
+	g_fprintf(stdout, "\t-Q <msecs> stop tracing a confirmed flow after msecs without new footprints\n");
+	g_fprintf(stdout, "\t-L <packets> stop tracing a flow after packets trace messages\n");
+	g_fprintf(stdout, "\t-n [all|ns1,ns2,...] to also track network namespaces (from %s)\n", NETNS_RUN);
+
+	exit(SUCCESS);
+}
+
+int main(int argc, char **argv)
+{
+	int opt, ret = 0;
 
 	signal(SIGINT, trap);
 	signal(SIGTERM, trap);
 
-	while ((opt = getopt(argc, argv, "df")) != -1)
+	while ((opt = getopt(argc, argv, "dfs:DH:k:Xr:R:o:B:iq:w:n:e:b:Np:F:S:I:mt:T:Q:L:")) != -1)
 		switch(opt) {
 		case 'f':
 			amiadaemon = 0;
@@ -346,52 +526,147 @@ int main(int argc, char **argv)
 		case 'd':
 			amiadaemon = 1;
 			break;
+		case 'D':
+			lifecycle = 1;
+			break;
+		case 'H':
+			if (set_activity(optarg) == ERROR)
+				usage(argv[0]);
+			break;
+		case 'k':
+			if (set_hitters(optarg) == ERROR)
+				usage(argv[0]);
+			break;
+		case 'X':
+			natflows = TRUE;
+			break;
+		case 'r':
+			rulesfile = optarg;
+			break;
+		case 'o':
+			snapfile = optarg;
+			break;
+		case 'B':
+			basefile = optarg;
+			break;
+		case 'i':
+			ruleattr = TRUE;
+			break;
+		case 'q':
+			querypath = optarg;
+			break;
+		case 'w':
+			if (set_workers(optarg) == ERROR)
+				usage(argv[0]);
+			break;
+		case 'n':
+			netnsopt = optarg;
+			break;
+		case 'b':
+			nlbufsize = (int) strtol(optarg, NULL, 10);
+			if (nlbufsize <= 0 || nlbufsize > NLBUF_MAX)
+				usage(argv[0]);
+			break;
+		case 'N':
+			nlbufpolicy = NLBUF_BESTEFFORT;
+			break;
+		case 'p':
+			if (set_polling(optarg) == ERROR)
+				usage(argv[0]);
+			break;
+		case 'F':
+			if (set_seenfilter(optarg) == ERROR)
+				usage(argv[0]);
+			break;
+		case 'S':
+			if (set_sampling(optarg) == ERROR)
+				usage(argv[0]);
+			break;
+		case 'I':
+			if (set_inherit(optarg) == ERROR)
+				usage(argv[0]);
+			break;
+		case 'm':
+			tracesets = TRUE;
+			break;
+		case 't':
+			if (set_schedrate(optarg) == ERROR)
+				usage(argv[0]);
+			break;
+		case 'T':
+			if (set_schedcap(optarg) == ERROR)
+				usage(argv[0]);
+			break;
+		case 'Q':
+			if (set_tracequiet(optarg) == ERROR)
+				usage(argv[0]);
+			break;
+		case 'L':
+			if (set_tracelimit(optarg) == ERROR)
+				usage(argv[0]);
+			break;
+		case 'e':
+			if (set_evbackend(optarg) == ERROR)
+				usage(argv[0]);
+			break;
+		case 's':
+			if (set_sortorder(optarg) == ERROR)
+				usage(argv[0]);
+			break;
+		case 'R':
+			if (set_rulesformat(optarg) == ERROR)
+				usage(argv[0]);
+			break;
 		default:
-			g_fprintf(stdout, "Syntax: %s -[f|d] for foreground/daemon mode\n", argv[0]);
-			exit(SUCCESS);
+			usage(argv[0]);
 		}
 
 	initlog(argv[0]);
-	alloc_flows();
-
-	amiadaemon ? makemeadaemon() : dontmakemeadaemon();
-
-	// conntrack initialization
-
-	nfcth = nfct_open(CONNTRACK, NF_NETLINK_CONNTRACK_NEW | NF_NETLINK_CONNTRACK_UPDATE);
-	if (!nfcth) {
-		perror("nfct_open");
+	ev_init();
+	alloc_acct();
+	alloc_ports();
+	alloc_sample();
+	alloc_sched();
+	alloc_fppaths();
+	poll_init(conntrackio_event_cb);
+	alloc_seen();
+	alloc_hitters();
+	alloc_nat();
+
+	// flows are compared against a previous snapshot
+
+	if (alloc_baseline() == ERROR) {
+		g_fprintf(stderr, "Could not load baseline: %s\n", basefile);
 		ret = EXIT_FAILURE;
 		goto endclean;
 	}
 
-	nfct_callback_register(nfcth, NFCT_T_ALL, conntrackio_event_cb, NULL);
+	// ruleset index for rule attribution
 
-	// conntrack socket file descriptor callback
+	if (alloc_ruleidx() == ERROR) {
+		perror("alloc_ruleidx");
+		ret = EXIT_FAILURE;
+		goto endclean;
+	}
 
-	nfnlh = (struct nfnl_handle *) nfct_nfnlh(nfcth);
+	amiadaemon ? makemeadaemon() : dontmakemeadaemon();
 
-	conntrackio = g_io_channel_unix_new(nfnlh->fd);
-	conntrackioid = g_io_add_watch(conntrackio, G_IO_IN, conntrackiocb, nfnlh);
+	// live queries socket
 
-	// netfilter ulog netlink (through libmnl) initialization
-
-	ulognl = ulognlct_open();
-	if (ulognl == NULL) {
+	if (querypath != NULL && query_open() == ERROR) {
+		perror("query_open");
 		ret = EXIT_FAILURE;
 		goto endclean;
 	}
 
-	ulognlctio = g_io_channel_unix_new(ulognl->fd);
-	ulognlctioid = g_io_add_watch(ulognlctio, G_IO_IN, ulognlctiocb, ulognl);
-
-	g_main_loop_run(loop);
-
-	ret |= nfct_close(nfcth);
+	// conntrack and ulog sockets, rules and flows for each namespace
 
-	ret |= ulognlct_close(ulognl);
+	if (netns_init(start_netns, stop_netns) == ERROR) {
+		ret = EXIT_FAILURE;
+		goto endclean;
+	}
 
-	g_main_loop_unref(loop);
+	ev_run();
 
 endclean:
 
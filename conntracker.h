@@ -10,6 +10,7 @@
 
 void cleanup(void);
 void trap(int);
+void usage(char *);
 
 static gint conntrackio_event_cb(enum nf_conntrack_msg_type, struct nf_conntrack *, void *);
 static gint ulognlctiocbio_event_cb(const struct nlmsghdr *, void *);
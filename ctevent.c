@@ -0,0 +1,568 @@
+/*
+ * (C) 2021 by Rafael David Tinoco <rafael.tinoco@ibm.com>
+ * (C) 2021 by Rafael David Tinoco <rafaeldtinoco@ubuntu.com>
+ */
+
+#include <endian.h>
+
+#include "ctevent.h"
+#include "ruleidx.h"
+#include "nat.h"
+
+/*
+ * conntrack messages are decoded straight from the received buffer: the
+ * attributes are walked (libmnl) where they are, into tables kept in the
+ * stack, and only the few fields a flow needs are copied into the (fixed
+ * size) event. There is no nf_conntrack object, and no allocation at all,
+ * per message. The nf_conntrack path (ctevent_from_ct) is only kept for the
+ * table dumps (resync and polling), done through libnetfilter_conntrack.
+ */
+
+struct ctattrs {
+	const struct nlattr **tb;
+	uint16_t max;
+};
+
+static int ctattrs_cb(const struct nlattr *attr, void *data)
+{
+	struct ctattrs *attrs = data;
+
+	// attributes newer than the headers are simply skipped
+
+	if (mnl_attr_type_valid(attr, attrs->max) < 0)
+		return MNL_CB_OK;
+
+	attrs->tb[mnl_attr_get_type(attr)] = attr;
+
+	return MNL_CB_OK;
+}
+
+static gint ctattrs_nested(const struct nlattr *nest, const struct nlattr **tb, uint16_t max)
+{
+	struct ctattrs attrs = { tb, max };
+
+	memset(tb, 0, (max + 1) * sizeof(struct nlattr *));
+
+	if (nest == NULL)
+		return ERROR;
+
+	if (mnl_attr_parse_nested(nest, ctattrs_cb, &attrs) < 0)
+		return ERROR;
+
+	return SUCCESS;
+}
+
+static gint ctattrs_payload(const void *payload, size_t len, const struct nlattr **tb)
+{
+	struct ctattrs attrs = { tb, CTA_MAX };
+
+	memset(tb, 0, (CTA_MAX + 1) * sizeof(struct nlattr *));
+
+	if (mnl_attr_parse_payload(payload, len, ctattrs_cb, &attrs) < 0)
+		return ERROR;
+
+	return SUCCESS;
+}
+
+static gint ctattr_u8(const struct nlattr *attr, uint8_t *value)
+{
+	if (attr == NULL || mnl_attr_validate(attr, MNL_TYPE_U8) < 0)
+		return ERROR;
+
+	*value = mnl_attr_get_u8(attr);
+
+	return SUCCESS;
+}
+
+static gint ctattr_u16(const struct nlattr *attr, uint16_t *value)
+{
+	if (attr == NULL || mnl_attr_validate(attr, MNL_TYPE_U16) < 0)
+		return ERROR;
+
+	*value = mnl_attr_get_u16(attr);	// network order, kept
+
+	return SUCCESS;
+}
+
+static gint ctattr_u32(const struct nlattr *attr, uint32_t *value)
+{
+	if (attr == NULL || mnl_attr_validate(attr, MNL_TYPE_U32) < 0)
+		return ERROR;
+
+	*value = mnl_attr_get_u32(attr);	// network order, kept
+
+	return SUCCESS;
+}
+
+static gint ctattr_u64(const struct nlattr *attr, uint64_t *value)
+{
+	if (attr == NULL || mnl_attr_validate(attr, MNL_TYPE_U64) < 0)
+		return ERROR;
+
+	*value = be64toh(mnl_attr_get_u64(attr));
+
+	return SUCCESS;
+}
+
+static gint ctattr_in6(const struct nlattr *attr, struct in6_addr *value)
+{
+	if (attr == NULL || mnl_attr_validate2(attr, MNL_TYPE_UNSPEC, sizeof(struct in6_addr)) < 0)
+		return ERROR;
+
+	memcpy(value, mnl_attr_get_payload(attr), sizeof(struct in6_addr));
+
+	return SUCCESS;
+}
+
+static void ctevent_counters(const struct nlattr *nest, struct ctevent *ev)
+{
+	uint64_t packets, bytes;
+	const struct nlattr *tb[CTA_COUNTERS_MAX + 1];
+
+	if (ctattrs_nested(nest, tb, CTA_COUNTERS_MAX) == ERROR)
+		return;
+	if (ctattr_u64(tb[CTA_COUNTERS_PACKETS], &packets) == ERROR)
+		return;
+	if (ctattr_u64(tb[CTA_COUNTERS_BYTES], &bytes) == ERROR)
+		return;
+
+	ev->packets += packets;
+	ev->bytes += bytes;
+	ev->hascounters = 1;
+}
+
+static void ctevent_nat(uint32_t status, union ctaddr *rsrc, union ctaddr *rdst,
+			uint16_t rsport, uint16_t rdport, struct ctevent *ev)
+{
+	// reply tuple: the peers as translated (reply src: DNAT, reply dst: SNAT)
+
+	if (status & IPS_SRC_NAT) {
+		ev->nat |= NAT_SRC;
+		ev->nsrc = *rdst;
+		ev->nsport = rdport;
+	}
+
+	if (status & IPS_DST_NAT) {
+		ev->nat |= NAT_DST;
+		ev->ndst = *rsrc;
+		ev->ndport = rsport;
+	}
+}
+
+static void ctevent_nat_attrs(const struct nlattr *nest, uint32_t status, struct ctevent *ev)
+{
+	gint ret = SUCCESS;
+	uint16_t rsport = 0, rdport = 0;
+	union ctaddr rsrc, rdst;
+
+	const struct nlattr *tuple[CTA_TUPLE_MAX + 1];
+	const struct nlattr *ip[CTA_IP_MAX + 1];
+	const struct nlattr *proto[CTA_PROTO_MAX + 1];
+
+	memset(&rsrc, 0, sizeof(union ctaddr));
+	memset(&rdst, 0, sizeof(union ctaddr));
+
+	if (ctattrs_nested(nest, tuple, CTA_TUPLE_MAX) == ERROR)
+		return;
+	if (ctattrs_nested(tuple[CTA_TUPLE_IP], ip, CTA_IP_MAX) == ERROR)
+		return;
+	if (ctattrs_nested(tuple[CTA_TUPLE_PROTO], proto, CTA_PROTO_MAX) == ERROR)
+		return;
+
+	switch (ev->family) {
+	case AF_INET:
+		ret |= ctattr_u32(ip[CTA_IP_V4_SRC], &rsrc.ipv4.s_addr);
+		ret |= ctattr_u32(ip[CTA_IP_V4_DST], &rdst.ipv4.s_addr);
+		break;
+	case AF_INET6:
+		ret |= ctattr_in6(ip[CTA_IP_V6_SRC], &rsrc.ipv6);
+		ret |= ctattr_in6(ip[CTA_IP_V6_DST], &rdst.ipv6);
+		break;
+	}
+
+	switch (ev->proto) {
+	case IPPROTO_TCP:
+	case IPPROTO_UDP:
+		ret |= ctattr_u16(proto[CTA_PROTO_SRC_PORT], &rsport);
+		ret |= ctattr_u16(proto[CTA_PROTO_DST_PORT], &rdport);
+		break;
+	}
+
+	if (ret == ERROR)
+		return;
+
+	ctevent_nat(status, &rsrc, &rdst, rsport, rdport, ev);
+}
+
+static gint ctevent_from_attrs(const struct nlattr **tb, uint8_t family, struct ctevent *ev)
+{
+	gint ret = SUCCESS;
+	uint32_t status, id;
+
+	const struct nlattr *tuple[CTA_TUPLE_MAX + 1];
+	const struct nlattr *ip[CTA_IP_MAX + 1];
+	const struct nlattr *proto[CTA_PROTO_MAX + 1];
+	const struct nlattr *tstamp[CTA_TIMESTAMP_MAX + 1];
+
+	// check if flow ever got a reply from the peer
+
+	if (ctattr_u32(tb[CTA_STATUS], &status) == ERROR)
+		return ERROR;
+
+	if (ntohl(status) & IPS_SEEN_REPLY)
+		ev->reply = 1;
+
+	// skip address families other than IPv4 and IPv6
+
+	ev->family = family;
+
+	switch (ev->family) {
+	case AF_INET:
+	case AF_INET6:
+		break;
+	default:
+		debug("skipping non AF_INET/AF_INET6 traffic");
+		return ERROR;
+	}
+
+	// original tuple: addresses and protocol
+
+	if (ctattrs_nested(tb[CTA_TUPLE_ORIG], tuple, CTA_TUPLE_MAX) == ERROR)
+		return ERROR;
+	if (ctattrs_nested(tuple[CTA_TUPLE_IP], ip, CTA_IP_MAX) == ERROR)
+		return ERROR;
+	if (ctattrs_nested(tuple[CTA_TUPLE_PROTO], proto, CTA_PROTO_MAX) == ERROR)
+		return ERROR;
+
+	// skip IP protocols other than TCP / UDP / ICMP / ICMPv6
+
+	if (ctattr_u8(proto[CTA_PROTO_NUM], &ev->proto) == ERROR)
+		return ERROR;
+
+	switch (ev->proto) {
+	case IPPROTO_TCP:
+	case IPPROTO_UDP:
+	case IPPROTO_ICMP:
+	case IPPROTO_ICMPV6:
+		break;
+	default:
+		debug("skipping non UDP/TCP/ICMP/ICMPv6 traffic");
+		return ERROR;
+	}
+
+	// netfilter: address family only attributes
+
+	switch (ev->family) {
+	case AF_INET:
+		ret |= ctattr_u32(ip[CTA_IP_V4_SRC], &ev->src.ipv4.s_addr);
+		ret |= ctattr_u32(ip[CTA_IP_V4_DST], &ev->dst.ipv4.s_addr);
+		break;
+	case AF_INET6:
+		ret |= ctattr_in6(ip[CTA_IP_V6_SRC], &ev->src.ipv6);
+		ret |= ctattr_in6(ip[CTA_IP_V6_DST], &ev->dst.ipv6);
+		break;
+	}
+
+	// netfilter: protocol only attributes
+
+	switch (ev->proto) {
+	case IPPROTO_TCP:
+	case IPPROTO_UDP:
+		ret |= ctattr_u16(proto[CTA_PROTO_SRC_PORT], &ev->sport);
+		ret |= ctattr_u16(proto[CTA_PROTO_DST_PORT], &ev->dport);
+		break;
+	case IPPROTO_ICMP:
+		ret |= ctattr_u8(proto[CTA_PROTO_ICMP_TYPE], &ev->itype);
+		ret |= ctattr_u8(proto[CTA_PROTO_ICMP_CODE], &ev->icode);
+		break;
+	case IPPROTO_ICMPV6:
+		ret |= ctattr_u8(proto[CTA_PROTO_ICMPV6_TYPE], &ev->itype);
+		ret |= ctattr_u8(proto[CTA_PROTO_ICMPV6_CODE], &ev->icode);
+		break;
+	}
+
+	if (ret == ERROR)
+		return ERROR;
+
+	// translated connections (-X): post-NAT endpoints out of the reply tuple
+
+	if (natflows && (ntohl(status) & (IPS_SRC_NAT | IPS_DST_NAT)))
+		ctevent_nat_attrs(tb[CTA_TUPLE_REPLY], ntohl(status), ev);
+
+	// accounting (optional): id, counters and timestamps
+
+	if (ctattr_u32(tb[CTA_ID], &id) == SUCCESS) {
+		ev->id = ntohl(id);
+		ev->hasid = 1;
+	}
+
+	if (tb[CTA_COUNTERS_ORIG] != NULL) {
+		ctevent_counters(tb[CTA_COUNTERS_ORIG], ev);
+		ctevent_counters(tb[CTA_COUNTERS_REPLY], ev);
+	}
+
+	if (ctattrs_nested(tb[CTA_TIMESTAMP], tstamp, CTA_TIMESTAMP_MAX) == SUCCESS) {
+		ctattr_u64(tstamp[CTA_TIMESTAMP_START], &ev->tstart);
+		ctattr_u64(tstamp[CTA_TIMESTAMP_STOP], &ev->tstop);
+	}
+
+	return SUCCESS;
+}
+
+gint ctevent_from_nlmsg(const struct nlmsghdr *nlh, struct ctevent *ev)
+{
+	struct nfgenmsg *nfg;
+	const struct nlattr *tb[CTA_MAX + 1];
+	struct ctattrs attrs = { tb, CTA_MAX };
+
+	memset(ev, 0, sizeof(struct ctevent));
+
+	// conntrack event type out of the netlink message type and flags
+
+	switch (NFNL_MSG_TYPE(nlh->nlmsg_type)) {
+	case IPCTNL_MSG_CT_NEW:
+		if (nlh->nlmsg_flags & (NLM_F_CREATE | NLM_F_EXCL))
+			ev->type = NFCT_T_NEW;
+		else
+			ev->type = NFCT_T_UPDATE;
+		break;
+	case IPCTNL_MSG_CT_DELETE:
+		ev->type = NFCT_T_DESTROY;
+		break;
+	default:
+		return ERROR;
+	}
+
+	memset(tb, 0, sizeof(tb));
+
+	if (mnl_attr_parse(nlh, sizeof(struct nfgenmsg), ctattrs_cb, &attrs) < 0)
+		return ERROR;
+
+	nfg = mnl_nlmsg_get_payload(nlh);
+
+	return ctevent_from_attrs(tb, nfg->nfgen_family, ev);
+}
+
+gint ctevent_from_ct(enum nf_conntrack_msg_type type, struct nf_conntrack *ct, struct ctevent *ev)
+{
+	uint32_t *constatus = NULL;
+
+	memset(ev, 0, sizeof(struct ctevent));
+
+	ev->type = type;
+
+	// check if flow ever got a reply from the peer
+
+	constatus = (uint32_t *) nfct_get_attr(ct, ATTR_STATUS);
+
+	if (*constatus & IPS_SEEN_REPLY)
+		ev->reply = 1;
+
+	// skip address families other than IPv4 and IPv6
+
+	ev->family = *((uint8_t *) nfct_get_attr(ct, ATTR_L3PROTO));
+
+	switch (ev->family) {
+	case AF_INET:
+	case AF_INET6:
+		break;
+	default:
+		debug("skipping non AF_INET/AF_INET6 traffic");
+		return ERROR;
+	}
+
+	// skip IP protocols other than TCP / UDP / ICMP / ICMPv6
+
+	ev->proto = *((uint8_t *) nfct_get_attr(ct, ATTR_L4PROTO));
+
+	switch (ev->proto) {
+	case IPPROTO_TCP:
+	case IPPROTO_UDP:
+	case IPPROTO_ICMP:
+	case IPPROTO_ICMPV6:
+		break;
+	default:
+		debug("skipping non UDP/TCP/ICMP/ICMPv6 traffic");
+		return ERROR;
+	}
+
+	// netfilter: address family only attributes
+
+	switch (ev->family) {
+	case AF_INET:
+		ev->src.ipv4.s_addr = *((in_addr_t *) nfct_get_attr(ct, ATTR_IPV4_SRC));
+		ev->dst.ipv4.s_addr = *((in_addr_t *) nfct_get_attr(ct, ATTR_IPV4_DST));
+		break;
+	case AF_INET6:
+		memcpy(&ev->src.ipv6, nfct_get_attr(ct, ATTR_IPV6_SRC), sizeof(struct in6_addr));
+		memcpy(&ev->dst.ipv6, nfct_get_attr(ct, ATTR_IPV6_DST), sizeof(struct in6_addr));
+		break;
+	}
+
+	// netfilter: protocol only attributes
+
+	switch (ev->proto) {
+	case IPPROTO_TCP:
+	case IPPROTO_UDP:
+		ev->sport = *((uint16_t *) nfct_get_attr(ct, ATTR_PORT_SRC));
+		ev->dport = *((uint16_t *) nfct_get_attr(ct, ATTR_PORT_DST));
+		break;
+	case IPPROTO_ICMP:
+	case IPPROTO_ICMPV6:
+		ev->itype = *((uint8_t *) nfct_get_attr(ct, ATTR_ICMP_TYPE));
+		ev->icode = *((uint8_t *) nfct_get_attr(ct, ATTR_ICMP_CODE));
+		break;
+	}
+
+	// translated connections (-X): post-NAT endpoints out of the reply tuple
+
+	if (natflows && (*constatus & (IPS_SRC_NAT | IPS_DST_NAT))) {
+		union ctaddr rsrc, rdst;
+		uint16_t rsport = 0, rdport = 0;
+
+		switch (ev->family) {
+		case AF_INET:
+			rsrc.ipv4.s_addr = *((in_addr_t *) nfct_get_attr(ct, ATTR_REPL_IPV4_SRC));
+			rdst.ipv4.s_addr = *((in_addr_t *) nfct_get_attr(ct, ATTR_REPL_IPV4_DST));
+			break;
+		case AF_INET6:
+			memcpy(&rsrc.ipv6, nfct_get_attr(ct, ATTR_REPL_IPV6_SRC), sizeof(struct in6_addr));
+			memcpy(&rdst.ipv6, nfct_get_attr(ct, ATTR_REPL_IPV6_DST), sizeof(struct in6_addr));
+			break;
+		}
+
+		if (ev->proto == IPPROTO_TCP || ev->proto == IPPROTO_UDP) {
+			rsport = *((uint16_t *) nfct_get_attr(ct, ATTR_REPL_PORT_SRC));
+			rdport = *((uint16_t *) nfct_get_attr(ct, ATTR_REPL_PORT_DST));
+		}
+
+		ctevent_nat(*constatus, &rsrc, &rdst, rsport, rdport, ev);
+	}
+
+	// accounting (optional): id, counters and timestamps
+
+	if (nfct_attr_is_set(ct, ATTR_ID) > 0) {
+		ev->id = nfct_get_attr_u32(ct, ATTR_ID);
+		ev->hasid = 1;
+	}
+
+	if (nfct_attr_is_set(ct, ATTR_ORIG_COUNTER_PACKETS) > 0) {
+		ev->packets = nfct_get_attr_u64(ct, ATTR_ORIG_COUNTER_PACKETS);
+		ev->packets += nfct_get_attr_u64(ct, ATTR_REPL_COUNTER_PACKETS);
+		ev->bytes = nfct_get_attr_u64(ct, ATTR_ORIG_COUNTER_BYTES);
+		ev->bytes += nfct_get_attr_u64(ct, ATTR_REPL_COUNTER_BYTES);
+		ev->hascounters = 1;
+	}
+
+	if (nfct_attr_is_set(ct, ATTR_TIMESTAMP_START) > 0)
+		ev->tstart = nfct_get_attr_u64(ct, ATTR_TIMESTAMP_START);
+	if (nfct_attr_is_set(ct, ATTR_TIMESTAMP_STOP) > 0)
+		ev->tstop = nfct_get_attr_u64(ct, ATTR_TIMESTAMP_STOP);
+
+	return SUCCESS;
+}
+
+gint ctevent_from_nflog(const struct nlmsghdr *nlh, struct ctevent *ev)
+{
+	const char *prefix = NULL;
+
+	struct nfgenmsg *nfg;
+	struct nlattr *attrs[NFULA_MAX + 1] = { NULL };
+	const struct nlattr *ct[CTA_MAX + 1];
+
+	struct footprint fp;
+
+	// raw netlink msgs related to ulog (trace match)
+
+	if (nflog_nlmsg_parse(nlh, attrs) != MNL_CB_OK)
+		return ERROR;
+
+	nfg = mnl_nlmsg_get_payload(nlh);
+
+	if (attrs[NFULA_PREFIX])
+		prefix = mnl_attr_get_str(attrs[NFULA_PREFIX]);
+
+	if (prefix == NULL || !g_str_has_prefix(prefix, "TRACE: "))
+		return ERROR;
+
+	if (attrs[NFULA_CT] == NULL)
+		return ERROR;
+
+	/*
+	 * when receiving ulog netlink msgs from kernel (for TRACE) we have:
+	 *
+	 * TRACE: table:chain:type:position
+	 *        [0]   [1]   [2]  [3]
+	 */
+
+	gchar **vector = g_strsplit_set((prefix+strlen("TRACE: ")), ":", -1);
+
+	if (g_strv_length(vector) < 4) {
+		g_strfreev(vector);
+		return ERROR;
+	}
+
+	memset(&fp, 0, sizeof(struct footprint));
+
+	// chain name
+
+	g_strlcpy(fp.chain, vector[1], sizeof(fp.chain));
+
+	// table name
+
+	if (g_ascii_strcasecmp("raw", vector[0]) == 0)
+		fp.table = FOOTPRINT_TABLE_RAW;
+	if (g_ascii_strcasecmp("mangle", vector[0]) == 0)
+		fp.table = FOOTPRINT_TABLE_MANGLE;
+	if (g_ascii_strcasecmp("nat", vector[0]) == 0)
+		fp.table = FOOTPRINT_TABLE_NAT;
+	if (g_ascii_strcasecmp("filter", vector[0]) == 0)
+		fp.table = FOOTPRINT_TABLE_FILTER;
+	if (fp.table == 0)
+		fp.table = FOOTPRINT_TABLE_UNKNOWN;
+
+	// rule type
+
+	if (g_ascii_strcasecmp("policy", vector[2]) == 0)
+		fp.type = FOOTPRINT_TYPE_POLICY;
+	if (g_ascii_strcasecmp("rule", vector[2]) == 0)
+		fp.type = FOOTPRINT_TYPE_RULE;
+	if (g_ascii_strcasecmp("return", vector[2]) == 0)
+		fp.type = FOOTPRINT_TYPE_RETURN;
+	if (fp.type == 0)
+		fp.type = FOOTPRINT_TYPE_UNKNOWN;
+
+	// position of the rule
+
+	fp.position = (uint32_t) ((long int) strtol(vector[3], NULL, 0));
+
+	// ruleset generation the position refers to (-i)
+
+	fp.gen = ruleidx_generation();
+
+	g_strfreev(vector);
+
+	// conntrack data related, walked in place within the NFULA_CT payload
+
+	if (ctattrs_payload(mnl_attr_get_payload(attrs[NFULA_CT]),
+			    mnl_attr_get_payload_len(attrs[NFULA_CT]), ct) == ERROR)
+		return ERROR;
+
+	/*
+	 * different than when coming from conntrack events, this one includes
+	 * the tracing data (footprint), to be kept in memory with the flow
+	 * list items
+	 */
+
+	memset(ev, 0, sizeof(struct ctevent));
+
+	ev->type = NFCT_T_UPDATE;
+
+	if (ctevent_from_attrs(ct, nfg->nfgen_family, ev) == ERROR)
+		return ERROR;
+
+	ev->fp = fp;
+	ev->hasfp = 1;
+
+	return SUCCESS;
+}
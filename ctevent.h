@@ -0,0 +1,59 @@
+/*
+ * (C) 2021 by Rafael David Tinoco <rafael.tinoco@ibm.com>
+ * (C) 2021 by Rafael David Tinoco <rafaeldtinoco@ubuntu.com>
+ */
+
+#ifndef CTEVENT_H_
+#define CTEVENT_H_
+
+#include "general.h"
+#include "nlmsg.h"
+#include "footprint.h"
+#include "acct.h"
+
+/*
+ * one flow event (conntrack event or trace message) decoded from netlink: it
+ * only depends on the message itself, so it can be decoded anywhere (any
+ * thread) and then processed (stored into the flows tables) by the main loop
+ */
+
+union ctaddr {
+	struct in_addr ipv4;
+	struct in6_addr ipv6;
+};
+
+struct ctevent {
+	enum nf_conntrack_msg_type type;
+	uint8_t family;
+	uint8_t proto;
+	uint8_t reply;
+	union ctaddr src;
+	union ctaddr dst;
+	uint16_t sport;		// network order, not folded
+	uint16_t dport;
+	uint8_t itype;
+	uint8_t icode;
+	uint8_t hasfp;
+	uint8_t hasid;
+	uint8_t hascounters;
+	uint32_t id;		// conntrack id (accounting)
+	uint64_t packets;	// both directions, cumulative
+	uint64_t bytes;
+	uint64_t tstart;	// nsecs, zero if no timestamps
+	uint64_t tstop;
+	uint8_t nat;		// NAT_SRC | NAT_DST (-X), post-NAT endpoints:
+	union ctaddr nsrc;	// reply tuple destination (SNAT)
+	union ctaddr ndst;	// reply tuple source (DNAT)
+	uint16_t nsport;	// network order, not folded
+	uint16_t ndport;
+	struct footprint fp;
+	struct flowstats stats;
+	struct flowlife life;	// stats.life (-D) and stats.act (-H):
+	struct activity act;	// events own their blocks
+};
+
+gint ctevent_from_ct(enum nf_conntrack_msg_type, struct nf_conntrack *, struct ctevent *);
+gint ctevent_from_nlmsg(const struct nlmsghdr *, struct ctevent *);
+gint ctevent_from_nflog(const struct nlmsghdr *, struct ctevent *);
+
+#endif /* CTEVENT_H_ */
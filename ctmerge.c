@@ -0,0 +1,368 @@
+/*
+ * (C) 2021 by Rafael David Tinoco <rafael.tinoco@ibm.com>
+ * (C) 2021 by Rafael David Tinoco <rafaeldtinoco@ubuntu.com>
+ */
+
+#include "general.h"
+#include "snapshot.h"
+#include "footprint.h"
+
+/*
+ * ctmerge: merge the flow snapshots (conntracker -o) of many hosts into one
+ * report (and, optionally, one snapshot: a fleet wide baseline for -B).
+ *
+ * Snapshots are sorted by flow key, so this is a streaming k-way merge: a
+ * binary heap holds the current record of each input, the smallest one is
+ * popped, folded into the flow being merged and replaced by the next record
+ * of the same input. Records of the same flow come out one after another:
+ *
+ * - counters are summed, first/last seen are the earliest/latest ones and
+ *   the flow is confirmed if it was confirmed anywhere
+ * - footprints are united (sorted, without duplicates)
+ * - a bitmap (1 bit per host) tells which hosts have the flow, written into
+ *   the merged snapshot as well: merged snapshots can be merged again (their
+ *   hosts are numbered after the ones of the inputs before them)
+ *
+ * An input that ends before the flows count of its header (truncated) or has
+ * a bad record (corrupt) fails the merge: nothing would tell its flows are
+ * missing from the report.
+ *
+ * Only 1 record per input and the flow being merged are in memory at any
+ * time, no matter how many flows (or inputs) there are.
+ *
+ *   $ ctmerge [-o merged.snap] fw01.snap fw02.snap ... > fleet.log
+ */
+
+struct input {
+	const gchar *name;
+	FILE *file;
+	struct snaprec rec;
+	GArray *fps;
+	uint8_t *hostmap;	// hosts of the current record
+	uint32_t hosts;		// hosts in the input (1: a conntracker snapshot)
+	uint32_t hostbase;	// number of its first host in the merge
+	uint64_t count;		// records, as in the header
+	uint64_t read;
+};
+
+struct input *inputs;
+guint ninputs;
+uint32_t nhosts;
+
+guint *heap;			// input indexes, smallest current record first
+guint heaplen;
+
+struct merged {
+	struct snaprec rec;
+	GArray *fps;
+	uint8_t *hosts;		// bitmap, 1 bit per host
+	guint nhosts;
+	guint records;
+} merged;
+
+uint64_t mergedflows;
+
+// ----
+
+static gint input_next(struct input *in)
+{
+	// inputs are dropped from the heap at their end (or on a bad record)
+
+	if (in->read == in->count)
+		return ERROR;
+
+	if (snap_read_rec(in->file, &in->rec, in->fps, in->hostmap, in->hosts) == ERROR)
+		return ERROR;
+
+	in->read++;
+
+	return SUCCESS;
+}
+
+static gint input_check(struct input *in)
+{
+	if (in->read == in->count)
+		return SUCCESS;
+
+	g_fprintf(stderr, "Truncated or corrupt snapshot: %s (%" PRIu64 " of %" PRIu64 " flows read)\n",
+		  in->name, in->read, in->count);
+
+	return ERROR;
+}
+
+static gint cmp_input(guint one, guint two)
+{
+	return cmp_snaprec(&inputs[one].rec, &inputs[two].rec);
+}
+
+static void heap_down(guint pos)
+{
+	guint child, temp;
+
+	while ((child = 2 * pos + 1) < heaplen) {
+		if (child + 1 < heaplen && cmp_input(heap[child + 1], heap[child]) == LESS)
+			child++;
+		if (cmp_input(heap[pos], heap[child]) != MORE)
+			break;
+
+		temp = heap[pos];
+		heap[pos] = heap[child];
+		heap[child] = temp;
+		pos = child;
+	}
+}
+
+static void heap_init(void)
+{
+	guint i;
+
+	for (i = heaplen / 2; i > 0; i--)
+		heap_down(i - 1);
+}
+
+// ----
+
+static void merge_start(struct input *in)
+{
+	merged.rec = in->rec;
+	merged.nhosts = 0;
+	merged.records = 0;
+
+	g_array_set_size(merged.fps, 0);
+	memset(merged.hosts, 0, SNAP_HOSTBYTES(nhosts));
+}
+
+static void merge_add(struct input *in)
+{
+	guint i, host;
+	struct snaprec *rec = &in->rec;
+
+	if (merged.rec.first == 0 || (rec->first != 0 && rec->first < merged.rec.first))
+		merged.rec.first = rec->first;
+
+	merged.rec.last = MAX(merged.rec.last, rec->last);
+	merged.rec.reply |= rec->reply;
+
+	// the first record was copied as is: only later ones add up
+
+	if (merged.records++ != 0) {
+		merged.rec.packets += rec->packets;
+		merged.rec.bytes += rec->bytes;
+	}
+
+	for (i = 0; i < in->hosts; i++) {
+		if ((in->hostmap[i / 8] & (1 << (i % 8))) == 0)
+			continue;
+		host = in->hostbase + i;
+		if ((merged.hosts[host / 8] & (1 << (host % 8))) == 0) {
+			merged.hosts[host / 8] |= 1 << (host % 8);
+			merged.nhosts++;
+		}
+	}
+
+	g_array_append_vals(merged.fps, in->fps->data, in->fps->len);
+}
+
+static void out_merged_fp(struct snapfp *fp)
+{
+	g_fprintf(stdout, "\t\t\t\ttable: %s, chain: %s, type: %s, position: %u\n",
+		  footprint_table_str(fp->table), fp->chain, footprint_type_str(fp->type), fp->position);
+}
+
+static gint merge_end(FILE *out)
+{
+	guint i, len;
+	gchar *str;
+	GString *hosts;
+	struct snapfp *fps = (struct snapfp *) merged.fps->data;
+	time_t first = merged.rec.first, last = merged.rec.last;
+	gchar strfirst[32], strlast[32];
+
+	// union of the footprints: sorted, duplicates removed
+
+	len = snap_uniqfps(merged.fps);
+
+	merged.rec.nfps = len;
+	merged.rec.pathkey = snap_pathkey(fps, len);
+
+	// report
+
+	str = snap_str(&merged.rec.tuple);
+	g_fprintf(stdout, " [%12" PRIu64 "] %s%s\n", mergedflows++, str,
+		  merged.rec.reply ? " (confirmed)" : "");
+	g_free(str);
+
+	if (merged.rec.last != 0) {
+		strftime(strfirst, sizeof(strfirst), "%F %T", localtime(&first));
+		strftime(strlast, sizeof(strlast), "%F %T", localtime(&last));
+		g_fprintf(stdout, "\t\t\t\tpackets: %" PRIu64 ", bytes: %" PRIu64 ", first: %s, last: %s\n",
+			  merged.rec.packets, merged.rec.bytes, strfirst, strlast);
+	}
+
+	hosts = g_string_new(NULL);
+
+	for (i = 0; i < nhosts; i++)
+		if (merged.hosts[i / 8] & (1 << (i % 8)))
+			g_string_append_printf(hosts, " %u", i);
+
+	g_fprintf(stdout, "\t\t\t\thosts: %u of %u:%s\n", merged.nhosts, nhosts, hosts->str);
+	g_string_free(hosts, TRUE);
+
+	for (i = 0; i < len; i++)
+		out_merged_fp(&fps[i]);
+
+	if (out != NULL)
+		return snap_write_rec(out, &merged.rec, fps, merged.hosts, nhosts);
+
+	return SUCCESS;
+}
+
+// ----
+
+static void usage(char *prog)
+{
+	g_fprintf(stdout, "Syntax: %s [-o <file>] <snapshot> [<snapshot> ...]\n", prog);
+	g_fprintf(stdout, "\t-o <file> to also write the merged flows as a snapshot\n");
+
+	exit(SUCCESS);
+}
+
+int main(int argc, char **argv)
+{
+	int opt, ret = SUCCESS;
+	guint i;
+	uint64_t total = 0;
+	gchar *outfile = NULL;
+	FILE *out = NULL;
+	struct input *in;
+
+	while ((opt = getopt(argc, argv, "o:")) != -1)
+		switch(opt) {
+		case 'o':
+			outfile = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+
+	if (optind >= argc)
+		usage(argv[0]);
+
+	ninputs = argc - optind;
+	inputs = g_malloc0(ninputs * sizeof(struct input));
+	heap = g_malloc0(ninputs * sizeof(guint));
+
+	merged.fps = g_array_new(FALSE, FALSE, sizeof(struct snapfp));
+
+	// open every input and read its first record
+
+	for (i = 0; i < ninputs; i++) {
+		in = &inputs[i];
+		in->name = argv[optind + i];
+		in->fps = g_array_new(FALSE, FALSE, sizeof(struct snapfp));
+		in->file = fopen(in->name, "r");
+
+		if (in->file == NULL || snap_read_header(in->file, &in->count, &in->hosts) == ERROR ||
+		    nhosts + in->hosts > SNAP_MAXHOSTS) {
+			g_fprintf(stderr, "Could not read snapshot: %s\n", in->name);
+			ret = ERROR;
+			goto endclean;
+		}
+
+		in->hostmap = g_malloc0(SNAP_HOSTBYTES(in->hosts));
+		in->hostbase = nhosts;
+		nhosts += in->hosts;
+
+		if (in->hosts == 1) {
+			g_fprintf(stdout, "Host %u: %s (%" PRIu64 " flows)\n", in->hostbase, in->name, in->count);
+		} else {
+			g_fprintf(stdout, "Hosts %u-%u: %s (%" PRIu64 " flows)\n", in->hostbase,
+				  in->hostbase + in->hosts - 1, in->name, in->count);
+		}
+
+		total += in->count;
+
+		if (input_next(in) == SUCCESS) {
+			heap[heaplen++] = i;
+		} else if (input_check(in) == ERROR) {
+			ret = ERROR;
+			goto endclean;
+		}
+	}
+
+	merged.hosts = g_malloc0(SNAP_HOSTBYTES(nhosts));
+
+	// merged snapshot: the count is only known at the end (header rewritten)
+
+	if (outfile != NULL) {
+		out = fopen(outfile, "w");
+		if (out == NULL || snap_write_header(out, 0, nhosts) == ERROR) {
+			g_fprintf(stderr, "Could not write snapshot: %s\n", outfile);
+			ret = ERROR;
+			goto endclean;
+		}
+	}
+
+	heap_init();
+
+	while (heaplen > 0) {
+		in = &inputs[heap[0]];
+
+		// a new flow: the previous one is complete
+
+		if (merged.records != 0 && cmp_snaprec(&merged.rec, &in->rec) != EQUAL)
+			ret |= merge_end(out);
+		if (merged.records == 0 || cmp_snaprec(&merged.rec, &in->rec) != EQUAL)
+			merge_start(in);
+
+		merge_add(in);
+
+		// next record of the same input (or the input is done, or broken)
+
+		if (input_next(in) == ERROR) {
+			if (input_check(in) == ERROR) {
+				ret = ERROR;
+				goto endclean;
+			}
+			heap[0] = heap[--heaplen];
+		}
+
+		heap_down(0);
+	}
+
+	if (merged.records != 0)
+		ret |= merge_end(out);
+
+	g_fprintf(stdout, "Merged: %" PRIu64 " flows (%" PRIu64 " records) from %u hosts\n",
+		  mergedflows, total, nhosts);
+
+	if (out != NULL) {
+		rewind(out);
+		ret |= snap_write_header(out, mergedflows, nhosts);
+	}
+
+endclean:
+
+	if (out != NULL && fclose(out) != 0)
+		ret = ERROR;
+
+	// a partial merged snapshot would pass for a complete one
+
+	if (out != NULL && ret == ERROR)
+		unlink(outfile);
+
+	for (i = 0; i < ninputs; i++) {
+		if (inputs[i].file != NULL)
+			fclose(inputs[i].file);
+		if (inputs[i].fps != NULL)
+			g_array_free(inputs[i].fps, TRUE);
+		g_free(inputs[i].hostmap);
+	}
+
+	g_array_free(merged.fps, TRUE);
+	g_free(merged.hosts);
+	g_free(heap);
+	g_free(inputs);
+
+	return ret == SUCCESS ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,171 @@
+/*
+ * (C) 2021 by Rafael David Tinoco <rafael.tinoco@ibm.com>
+ * (C) 2021 by Rafael David Tinoco <rafaeldtinoco@ubuntu.com>
+ */
+
+#include "ctpoll.h"
+#include "event.h"
+
+/*
+ * Polling mode (-p secs[,mark=<val>[/<mask>]][,zone=<id>]): conntrack UPDATE
+ * events (one for each TCP state change of each connection) are not asked for.
+ * The conntrack sockets only get NEW (and DESTROY, for the lifecycle) events
+ * and, every "secs", a dump filtered by the kernel brings:
+ *
+ * - the reply status: only confirmed (IPS_SEEN_REPLY) entries are dumped
+ * - the counters (accounting): already diffed per conntrack id (acct.c)
+ *
+ * optionally restricted to a mark (and mask) and a zone. The dumped entries
+ * go through the same path as the events: flows already known and confirmed
+ * cost a lookup, and traces are only started once per flow.
+ */
+
+#define POLL_MASK 0xffffffff
+
+guint pollsecs;
+uint32_t pollmark;
+uint32_t pollmask;
+gint pollzone = -1;
+
+struct nfct_filter_dump *pollfilter;
+nfct_cb pollcb;
+
+struct pollstats {
+	uint64_t polls;
+	uint64_t entries;
+	gint64 usecs;
+} pollstats;
+
+// ----
+
+gint set_polling(char *optarg)
+{
+	guint i;
+	gchar *end;
+	gint ret = SUCCESS;
+	gchar **vector = g_strsplit(optarg, ",", -1);
+
+	pollsecs = (guint) strtoul(vector[0], &end, 10);
+
+	if (pollsecs == 0 || *end != '\0')
+		ret = ERROR;
+
+	for (i = 1; vector[i] != NULL && ret == SUCCESS; i++) {
+		if (g_str_has_prefix(vector[i], "mark=")) {
+			pollmark = (uint32_t) strtoul(vector[i] + strlen("mark="), &end, 0);
+			pollmask = POLL_MASK;
+			if (*end == '/')
+				pollmask = (uint32_t) strtoul(end + 1, &end, 0);
+		} else if (g_str_has_prefix(vector[i], "zone=")) {
+			pollzone = (gint) strtoul(vector[i] + strlen("zone="), &end, 0);
+			if (pollzone > G_MAXUINT16)
+				ret = ERROR;
+		} else {
+			ret = ERROR;
+		}
+		if (*end != '\0')
+			ret = ERROR;
+	}
+
+	g_strfreev(vector);
+
+	return ret;
+}
+
+static gint poll_event_cb(enum nf_conntrack_msg_type type, struct nf_conntrack *ct, void *data)
+{
+	pollstats.entries++;
+
+	return pollcb(type, ct, data);
+}
+
+static gboolean poll_conntrack(gpointer data)
+{
+	struct netns *ns = data;
+	struct netns *prev = netns_current();
+	struct nfct_handle *nfcth;
+	gint64 start;
+
+	// namespace gone: one time exec from now on
+
+	if (ns->fd < 0)
+		return FALSE;
+
+	// dumps use a separate socket (created inside the namespace)
+
+	if (netns_setns(ns) == ERROR)
+		return TRUE;
+
+	nfcth = nfct_open(CONNTRACK, 0);
+
+	netns_setns(NULL);
+
+	if (nfcth == NULL)
+		return TRUE;
+
+	start = g_get_monotonic_time();
+
+	nfct_callback_register(nfcth, NFCT_T_ALL, poll_event_cb, NULL);
+
+	netns_enter(ns);
+	nfct_query(nfcth, NFCT_Q_DUMP_FILTER, pollfilter);
+	netns_enter(prev);
+
+	nfct_close(nfcth);
+
+	pollstats.polls++;
+	pollstats.usecs += g_get_monotonic_time() - start;
+
+	return TRUE;
+}
+
+// ----
+
+void poll_init(nfct_cb cb)
+{
+	struct nfct_filter_dump_status status = {
+		.val = IPS_SEEN_REPLY,
+		.mask = IPS_SEEN_REPLY,
+	};
+	struct nfct_filter_dump_mark mark = {
+		.val = pollmark,
+		.mask = pollmask,
+	};
+
+	if (pollsecs == 0)
+		return;
+
+	pollcb = cb;
+
+	pollfilter = nfct_filter_dump_create();
+
+	// both address families, confirmed entries only
+
+	nfct_filter_dump_set_attr_u8(pollfilter, NFCT_FILTER_DUMP_L3NUM, AF_UNSPEC);
+	nfct_filter_dump_set_attr(pollfilter, NFCT_FILTER_DUMP_STATUS, &status);
+
+	if (pollmask != 0)
+		nfct_filter_dump_set_attr(pollfilter, NFCT_FILTER_DUMP_MARK, &mark);
+	if (pollzone >= 0)
+		nfct_filter_dump_set_attr_u16(pollfilter, NFCT_FILTER_DUMP_ZONE, (uint16_t) pollzone);
+}
+
+guint poll_start(struct netns *ns)
+{
+	return ev_add_seconds(pollsecs, poll_conntrack, ns);
+}
+
+void poll_free(void)
+{
+	if (pollfilter != NULL)
+		nfct_filter_dump_destroy(pollfilter);
+}
+
+void out_polling(void)
+{
+	if (pollstats.polls == 0)
+		return;
+
+	syslogwrap("Polling: %" PRIu64 " dumps, %" PRIu64 " entries, avg dump: %" PRId64 " ms",
+		   pollstats.polls, pollstats.entries, pollstats.usecs / (gint64) pollstats.polls / 1000);
+}
@@ -0,0 +1,24 @@
+/*
+ * (C) 2021 by Rafael David Tinoco <rafael.tinoco@ibm.com>
+ * (C) 2021 by Rafael David Tinoco <rafaeldtinoco@ubuntu.com>
+ */
+
+#ifndef CTPOLL_H_
+#define CTPOLL_H_
+
+#include "general.h"
+#include "netns.h"
+
+#include <libnetfilter_conntrack/libnetfilter_conntrack.h>
+
+extern guint pollsecs;
+
+gint set_polling(char *);
+
+void poll_init(nfct_cb);
+guint poll_start(struct netns *);
+void poll_free(void);
+
+void out_polling(void);
+
+#endif /* CTPOLL_H_ */
@@ -0,0 +1,441 @@
+/*
+ * (C) 2021 by Rafael David Tinoco <rafael.tinoco@ibm.com>
+ * (C) 2021 by Rafael David Tinoco <rafaeldtinoco@ubuntu.com>
+ */
+
+#include "event.h"
+
+/*
+ * Event loop: sockets (conntrack, ulog, queries, workers), timers (trace rules
+ * removal, refreshes) and idle callbacks (batched sends) are registered here
+ * and dispatched by one of 2 backends (-e):
+ *
+ * - glib: GLib main loop (GIOChannel watches, timeout and idle sources)
+ * - epoll: a single epoll descriptor, timers kept in a sorted sequence (the
+ *   nearest one is the epoll_wait() timeout) and idle callbacks run after
+ *   each round of ready sockets. No GSource/GIOChannel per socket or timer,
+ *   no poll() arrays rebuilt at each iteration.
+ *
+ * Both backends count dispatches and the time spent in callbacks, reported
+ * when finishing, so they can be compared for the same (replayed) workload.
+ */
+
+#define EV_MAXEVENTS 64
+
+enum evtype {
+	EV_IO = 0,
+	EV_TIMER = 1,
+	EV_IDLE = 2,
+};
+
+struct evsource {
+	guint id;
+	enum evtype type;
+	int fd;
+	GIOFunc iofn;
+	GSourceFunc fn;
+	gpointer data;
+	guint interval;		// msecs
+	gint64 expiry;		// monotonic usecs
+	guint gid;		// glib backend source id
+	GSequenceIter *iter;	// epoll backend timers position
+};
+
+struct evstats {
+	uint64_t wakeups;
+	uint64_t dispatches[3];
+	uint64_t usecs;
+};
+
+int evbackend = EV_GLIB;
+
+GHashTable *evsources;
+GSequence *evtimers;
+GPtrArray *evidles;
+GMainLoop *evloop;
+int evfd = -1;
+guint evlastid;
+
+struct evstats evstats;
+
+// ----
+
+gint set_evbackend(char *optarg)
+{
+	if (g_ascii_strcasecmp("glib", optarg) == 0)
+		evbackend = EV_GLIB;
+	else if (g_ascii_strcasecmp("epoll", optarg) == 0)
+		evbackend = EV_EPOLL;
+	else
+		return ERROR;
+
+	return SUCCESS;
+}
+
+static gint cmp_evtimers(gconstpointer ptr_one, gconstpointer ptr_two, gpointer data)
+{
+	const struct evsource *one = ptr_one, *two = ptr_two;
+
+	if (one->expiry != two->expiry)
+		return one->expiry < two->expiry ? LESS : MORE;
+	if (one->id != two->id)
+		return one->id < two->id ? LESS : MORE;
+
+	return EQUAL;
+}
+
+static void ev_forget(struct evsource *src)
+{
+	switch (src->type) {
+	case EV_IO:
+		if (evbackend == EV_EPOLL)
+			epoll_ctl(evfd, EPOLL_CTL_DEL, src->fd, NULL);
+		break;
+	case EV_TIMER:
+		if (src->iter != NULL)
+			g_sequence_remove(src->iter);
+		break;
+	case EV_IDLE:
+		if (evbackend == EV_EPOLL)
+			g_ptr_array_remove(evidles, src);
+		break;
+	}
+
+	g_hash_table_remove(evsources, GUINT_TO_POINTER(src->id));
+}
+
+static gboolean ev_dispatch(struct evsource *src)
+{
+	gboolean ret;
+	enum evtype type = src->type;
+	gint64 start = g_get_monotonic_time();
+
+	// the callback might remove (free) its own source
+
+	if (type == EV_IO)
+		ret = src->iofn(NULL, G_IO_IN, src->data);
+	else
+		ret = src->fn(src->data);
+
+	evstats.dispatches[type]++;
+	evstats.usecs += g_get_monotonic_time() - start;
+
+	return ret;
+}
+
+// ---- glib backend
+
+static gboolean ev_glib_io(GIOChannel *source, GIOCondition condition, gpointer data)
+{
+	struct evsource *src = data;
+	guint id = src->id;
+
+	if (ev_dispatch(src))
+		return TRUE;
+
+	// the callback might have removed the source already
+
+	if (g_hash_table_contains(evsources, GUINT_TO_POINTER(id)))
+		ev_forget(src);
+
+	return FALSE;
+}
+
+static gboolean ev_glib_source(gpointer data)
+{
+	struct evsource *src = data;
+	guint id = src->id;
+
+	if (ev_dispatch(src))
+		return TRUE;
+
+	if (g_hash_table_contains(evsources, GUINT_TO_POINTER(id)))
+		ev_forget(src);
+
+	return FALSE;
+}
+
+// ---- epoll backend
+
+static void ev_epoll_arm(struct evsource *src)
+{
+	src->expiry = g_get_monotonic_time() + (gint64) src->interval * 1000;
+	src->iter = g_sequence_insert_sorted(evtimers, src, cmp_evtimers, NULL);
+}
+
+static int ev_epoll_timeout(void)
+{
+	gint64 wait;
+	struct evsource *src;
+
+	if (evidles->len > 0)
+		return 0;
+
+	if (g_sequence_get_length(evtimers) == 0)
+		return -1;
+
+	src = g_sequence_get(g_sequence_get_begin_iter(evtimers));
+	wait = src->expiry - g_get_monotonic_time();
+
+	return wait <= 0 ? 0 : (int) ((wait + 999) / 1000);
+}
+
+static void ev_epoll_timers(void)
+{
+	guint id;
+	gint64 now = g_get_monotonic_time();
+	struct evsource *src;
+
+	while (g_sequence_get_length(evtimers) > 0) {
+		src = g_sequence_get(g_sequence_get_begin_iter(evtimers));
+		if (src->expiry > now)
+			break;
+
+		g_sequence_remove(src->iter);
+		src->iter = NULL;
+		id = src->id;
+
+		if (!ev_dispatch(src)) {
+			if (g_hash_table_contains(evsources, GUINT_TO_POINTER(id)))
+				ev_forget(src);
+			continue;
+		}
+
+		// re-arm unless the callback removed it
+
+		if (g_hash_table_contains(evsources, GUINT_TO_POINTER(id)) && src->iter == NULL)
+			ev_epoll_arm(src);
+	}
+}
+
+static void ev_epoll_idles(void)
+{
+	guint i, id;
+	GArray *ids;
+	struct evsource *src;
+
+	if (evidles->len == 0)
+		return;
+
+	// idle callbacks might add or remove idle callbacks
+
+	ids = g_array_new(FALSE, FALSE, sizeof(guint));
+	for (i = 0; i < evidles->len; i++)
+		g_array_append_val(ids, ((struct evsource *) g_ptr_array_index(evidles, i))->id);
+
+	for (i = 0; i < ids->len; i++) {
+		id = g_array_index(ids, guint, i);
+		src = g_hash_table_lookup(evsources, GUINT_TO_POINTER(id));
+		if (src == NULL)
+			continue;
+		if (!ev_dispatch(src) && g_hash_table_contains(evsources, GUINT_TO_POINTER(id)))
+			ev_forget(src);
+	}
+
+	g_array_free(ids, TRUE);
+}
+
+static void ev_epoll_run(void)
+{
+	int i, ready;
+	guint id;
+	struct evsource *src;
+	struct epoll_event events[EV_MAXEVENTS];
+
+	while (TRUE) {
+		ready = epoll_wait(evfd, events, EV_MAXEVENTS, ev_epoll_timeout());
+
+		if (ready < 0 && errno != EINTR)
+			break;
+
+		evstats.wakeups++;
+
+		for (i = 0; i < ready; i++) {
+			id = (guint) events[i].data.u64;
+			src = g_hash_table_lookup(evsources, GUINT_TO_POINTER(id));
+			if (src == NULL)
+				continue;
+			if (!ev_dispatch(src) && g_hash_table_contains(evsources, GUINT_TO_POINTER(id)))
+				ev_forget(src);
+		}
+
+		ev_epoll_timers();
+		ev_epoll_idles();
+	}
+}
+
+// ----
+
+static struct evsource *ev_new(enum evtype type)
+{
+	struct evsource *src = g_new0(struct evsource, 1);
+
+	src->id = ++evlastid;
+	src->type = type;
+	src->fd = -1;
+
+	g_hash_table_insert(evsources, GUINT_TO_POINTER(src->id), src);
+
+	return src;
+}
+
+guint ev_add_io(int fd, GIOFunc fn, gpointer data)
+{
+	GIOChannel *channel;
+	struct epoll_event event;
+	struct evsource *src = ev_new(EV_IO);
+
+	src->fd = fd;
+	src->iofn = fn;
+	src->data = data;
+
+	switch (evbackend) {
+	case EV_GLIB:
+		channel = g_io_channel_unix_new(fd);
+		src->gid = g_io_add_watch(channel, G_IO_IN, ev_glib_io, src);
+		g_io_channel_unref(channel);
+		break;
+	case EV_EPOLL:
+		memset(&event, 0, sizeof(struct epoll_event));
+		event.events = EPOLLIN;
+		event.data.u64 = src->id;
+		if (epoll_ctl(evfd, EPOLL_CTL_ADD, fd, &event) < 0) {
+			g_hash_table_remove(evsources, GUINT_TO_POINTER(src->id));
+			return 0;
+		}
+		break;
+	}
+
+	return src->id;
+}
+
+guint ev_add_timeout(guint msecs, GSourceFunc fn, gpointer data)
+{
+	struct evsource *src = ev_new(EV_TIMER);
+
+	src->fn = fn;
+	src->data = data;
+	src->interval = msecs;
+
+	switch (evbackend) {
+	case EV_GLIB:
+		src->gid = g_timeout_add(msecs, ev_glib_source, src);
+		break;
+	case EV_EPOLL:
+		ev_epoll_arm(src);
+		break;
+	}
+
+	return src->id;
+}
+
+guint ev_add_seconds(guint secs, GSourceFunc fn, gpointer data)
+{
+	struct evsource *src;
+
+	if (evbackend == EV_EPOLL)
+		return ev_add_timeout(secs * 1000, fn, data);
+
+	// glib groups second timers to wake up less
+
+	src = ev_new(EV_TIMER);
+	src->fn = fn;
+	src->data = data;
+	src->interval = secs * 1000;
+	src->gid = g_timeout_add_seconds(secs, ev_glib_source, src);
+
+	return src->id;
+}
+
+guint ev_add_idle(GSourceFunc fn, gpointer data)
+{
+	struct evsource *src = ev_new(EV_IDLE);
+
+	src->fn = fn;
+	src->data = data;
+
+	switch (evbackend) {
+	case EV_GLIB:
+		src->gid = g_idle_add(ev_glib_source, src);
+		break;
+	case EV_EPOLL:
+		g_ptr_array_add(evidles, src);
+		break;
+	}
+
+	return src->id;
+}
+
+void ev_remove(guint id)
+{
+	struct evsource *src = g_hash_table_lookup(evsources, GUINT_TO_POINTER(id));
+
+	if (src == NULL)
+		return;
+
+	if (evbackend == EV_GLIB)
+		g_source_remove(src->gid);
+
+	ev_forget(src);
+}
+
+// ----
+
+void ev_init(void)
+{
+	evsources = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_free);
+
+	switch (evbackend) {
+	case EV_GLIB:
+		evloop = g_main_loop_new(NULL, FALSE);
+		break;
+	case EV_EPOLL:
+		evfd = epoll_create1(EPOLL_CLOEXEC);
+		evtimers = g_sequence_new(NULL);
+		evidles = g_ptr_array_new();
+		break;
+	}
+}
+
+void ev_run(void)
+{
+	switch (evbackend) {
+	case EV_GLIB:
+		g_main_loop_run(evloop);
+		break;
+	case EV_EPOLL:
+		ev_epoll_run();
+		break;
+	}
+}
+
+void ev_free(void)
+{
+	if (evsources == NULL)
+		return;
+
+	switch (evbackend) {
+	case EV_GLIB:
+		g_main_loop_unref(evloop);
+		break;
+	case EV_EPOLL:
+		g_sequence_free(evtimers);
+		g_ptr_array_free(evidles, TRUE);
+		close(evfd);
+		break;
+	}
+
+	g_hash_table_destroy(evsources);
+	evsources = NULL;
+}
+
+void out_evstats(void)
+{
+	uint64_t total = evstats.dispatches[EV_IO] + evstats.dispatches[EV_TIMER] + evstats.dispatches[EV_IDLE];
+
+	syslogwrap("Event loop (%s): io: %" PRIu64 ", timers: %" PRIu64 ", idle: %" PRIu64
+		   ", wakeups: %" PRIu64 ", callbacks: %" PRIu64 " usecs (%.2f per dispatch)",
+		   evbackend == EV_EPOLL ? "epoll" : "glib",
+		   evstats.dispatches[EV_IO], evstats.dispatches[EV_TIMER], evstats.dispatches[EV_IDLE],
+		   evstats.wakeups, evstats.usecs, total ? (double) evstats.usecs / total : 0.0);
+}
@@ -0,0 +1,34 @@
+/*
+ * (C) 2021 by Rafael David Tinoco <rafael.tinoco@ibm.com>
+ * (C) 2021 by Rafael David Tinoco <rafaeldtinoco@ubuntu.com>
+ */
+
+#ifndef EVENT_H_
+#define EVENT_H_
+
+#include "general.h"
+
+#include <sys/epoll.h>
+
+enum {
+	EV_GLIB = 0,
+	EV_EPOLL = 1,
+};
+
+extern int evbackend;
+
+gint set_evbackend(char *);
+
+guint ev_add_io(int, GIOFunc, gpointer);
+guint ev_add_timeout(guint, GSourceFunc, gpointer);
+guint ev_add_seconds(guint, GSourceFunc, gpointer);
+guint ev_add_idle(GSourceFunc, gpointer);
+void ev_remove(guint);
+
+void ev_init(void);
+void ev_run(void);
+void ev_free(void);
+
+void out_evstats(void);
+
+#endif /* EVENT_H_ */
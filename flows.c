@@ -4,6 +4,9 @@
  */
 
 #include "flows.h"
+#include "fppath.h"
+#include "baseline.h"
+#include "hitters.h"
 
 // seqs stored in memory
 
@@ -71,6 +74,11 @@ cmp_portbase(struct portbase one, struct portbase two)
 			return MORE;
 	}
 
+	if (one.folded < two.folded)
+		return LESS;
+	if (one.folded > two.folded)
+		return MORE;
+
 	return EQUAL;
 }
 
@@ -142,6 +150,8 @@ gint cmp_tcpv4flow(struct tcpv4flow *one, struct tcpv4flow *two)
 		return res;
 	if ((res = cmp_portbase(one->base, two->base)) != EQUAL)
 		return res;
+	if ((res = cmp_natbase(one->nat, two->nat)) != EQUAL)
+		return res;
 
 	if (one->foots.reply < two->foots.reply)
 		return LESS;
@@ -159,6 +169,8 @@ gint cmp_udpv4flow(struct udpv4flow *one, struct udpv4flow *two)
 		return res;
 	if ((res = cmp_portbase(one->base, two->base)) != EQUAL)
 		return res;
+	if ((res = cmp_natbase(one->nat, two->nat)) != EQUAL)
+		return res;
 
 	if (one->foots.reply < two->foots.reply)
 		return LESS;
@@ -176,6 +188,8 @@ gint cmp_icmpv4flow(struct icmpv4flow *one, struct icmpv4flow *two)
 		return res;
 	if ((res = cmp_icmpbase(one->base, two->base)) != EQUAL)
 		return res;
+	if ((res = cmp_natbase(one->nat, two->nat)) != EQUAL)
+		return res;
 
 	if (one->foots.reply < two->foots.reply)
 		return LESS;
@@ -193,6 +207,8 @@ gint cmp_tcpv6flow(struct tcpv6flow *one, struct tcpv6flow *two)
 		return res;
 	if ((res = cmp_portbase(one->base, two->base)) != EQUAL)
 		return res;
+	if ((res = cmp_natbase(one->nat, two->nat)) != EQUAL)
+		return res;
 
 	if (one->foots.reply < two->foots.reply)
 		return LESS;
@@ -210,6 +226,8 @@ gint cmp_udpv6flow(struct udpv6flow *one, struct udpv6flow *two)
 		return res;
 	if ((res = cmp_portbase(one->base, two->base)) != EQUAL)
 		return res;
+	if ((res = cmp_natbase(one->nat, two->nat)) != EQUAL)
+		return res;
 
 	if (one->foots.reply < two->foots.reply)
 		return LESS;
@@ -227,6 +245,8 @@ gint cmp_icmpv6flow(struct icmpv6flow *one, struct icmpv6flow *two)
 		return res;
 	if ((res = cmp_icmpbase(one->base, two->base)) != EQUAL)
 		return res;
+	if ((res = cmp_natbase(one->nat, two->nat)) != EQUAL)
+		return res;
 
 	if (one->foots.reply < two->foots.reply)
 		return LESS;
@@ -242,6 +262,15 @@ gint cmp_tcpv4flows(gconstpointer ptr_one, gconstpointer ptr_two, gpointer data)
 {
 	struct tcpv4flow *one = (struct tcpv4flow*) ptr_one;
 	struct tcpv4flow *two = (struct tcpv4flow*) ptr_two;
+	int res;
+
+	// NAT variants of a flow (-X) are adjacent: the tuple only
+
+	if (data == FLOW_TUPLE) {
+		if ((res = cmp_ipv4base(one->addrs, two->addrs)) != EQUAL)
+			return res;
+		return cmp_portbase(one->base, two->base);
+	}
 
 	return cmp_tcpv4flow(one, two);
 }
@@ -250,6 +279,15 @@ gint cmp_udpv4flows(gconstpointer ptr_one, gconstpointer ptr_two, gpointer data)
 {
 	struct udpv4flow *one = (struct udpv4flow*) ptr_one;
 	struct udpv4flow *two = (struct udpv4flow*) ptr_two;
+	int res;
+
+	// NAT variants of a flow (-X) are adjacent: the tuple only
+
+	if (data == FLOW_TUPLE) {
+		if ((res = cmp_ipv4base(one->addrs, two->addrs)) != EQUAL)
+			return res;
+		return cmp_portbase(one->base, two->base);
+	}
 
 	return cmp_udpv4flow(one, two);
 }
@@ -258,6 +296,15 @@ gint cmp_icmpv4flows(gconstpointer ptr_one, gconstpointer ptr_two, gpointer data
 {
 	struct icmpv4flow *one = (struct icmpv4flow*) ptr_one;
 	struct icmpv4flow *two = (struct icmpv4flow*) ptr_two;
+	int res;
+
+	// NAT variants of a flow (-X) are adjacent: the tuple only
+
+	if (data == FLOW_TUPLE) {
+		if ((res = cmp_ipv4base(one->addrs, two->addrs)) != EQUAL)
+			return res;
+		return cmp_icmpbase(one->base, two->base);
+	}
 
 	return cmp_icmpv4flow(one, two);
 }
@@ -266,6 +313,15 @@ gint cmp_tcpv6flows(gconstpointer ptr_one, gconstpointer ptr_two, gpointer data)
 {
 	struct tcpv6flow *one = (struct tcpv6flow*) ptr_one;
 	struct tcpv6flow *two = (struct tcpv6flow*) ptr_two;
+	int res;
+
+	// NAT variants of a flow (-X) are adjacent: the tuple only
+
+	if (data == FLOW_TUPLE) {
+		if ((res = cmp_ipv6base(one->addrs, two->addrs)) != EQUAL)
+			return res;
+		return cmp_portbase(one->base, two->base);
+	}
 
 	return cmp_tcpv6flow(one, two);
 }
@@ -274,6 +330,15 @@ gint cmp_udpv6flows(gconstpointer ptr_one, gconstpointer ptr_two, gpointer data)
 {
 	struct udpv6flow *one = (struct udpv6flow*) ptr_one;
 	struct udpv6flow *two = (struct udpv6flow*) ptr_two;
+	int res;
+
+	// NAT variants of a flow (-X) are adjacent: the tuple only
+
+	if (data == FLOW_TUPLE) {
+		if ((res = cmp_ipv6base(one->addrs, two->addrs)) != EQUAL)
+			return res;
+		return cmp_portbase(one->base, two->base);
+	}
 
 	return cmp_udpv6flow(one, two);
 }
@@ -282,6 +347,15 @@ gint cmp_icmpv6flows(gconstpointer ptr_one, gconstpointer ptr_two, gpointer data
 {
 	struct icmpv6flow *one = (struct icmpv6flow*) ptr_one;
 	struct icmpv6flow *two = (struct icmpv6flow*) ptr_two;
+	int res;
+
+	// NAT variants of a flow (-X) are adjacent: the tuple only
+
+	if (data == FLOW_TUPLE) {
+		if ((res = cmp_ipv6base(one->addrs, two->addrs)) != EQUAL)
+			return res;
+		return cmp_icmpbase(one->base, two->base);
+	}
 
 	return cmp_icmpv6flow(one, two);
 }
@@ -297,8 +371,10 @@ gint add_tcpv4flows(struct tcpv4flow *flow)
 	memcpy(temp, flow, sizeof(struct tcpv4flow));
 	found = g_sequence_lookup(tcpv4flows, temp, cmp_tcpv4flows, NULL);
 
-	if (found != NULL)
+	if (found != NULL) {
+		ptr = g_sequence_get(found);
 		goto noneed;
+	}
 
 	switch (temp->foots.reply) {
 	case 0:
@@ -309,11 +385,12 @@ gint add_tcpv4flows(struct tcpv4flow *flow)
 		temp->foots.reply = 0;
 
 		if (found2 == NULL) {
-			/* create the footprint sequence (for tracing) */
-			temp->foots.fp = g_sequence_new(cleanfp);
+			/* no footprints yet: the (shared) empty path */
+			temp->foots.path = NULL;
 			g_sequence_insert_sorted(tcpv4flows, temp, cmp_tcpv4flows, NULL);
 			goto inserted;
 		}
+		ptr = g_sequence_get(found2);
 		break;
 	case 1:
 		 // if it does confirm it, if not create and confirm it
@@ -324,8 +401,8 @@ gint add_tcpv4flows(struct tcpv4flow *flow)
 			ptr = g_sequence_get(found2);
 			ptr->foots.reply = 1;
 		} else {
-			/* create the footprint sequence (for tracing) */
-			temp->foots.fp = g_sequence_new(cleanfp);
+			/* no footprints yet: the (shared) empty path */
+			temp->foots.path = NULL;
 			g_sequence_insert_sorted(tcpv4flows, temp, cmp_tcpv4flows, NULL);
 			goto inserted;
 		}
@@ -333,9 +410,15 @@ gint add_tcpv4flows(struct tcpv4flow *flow)
 	}
 
 noneed:
+	add_flowstats(&ptr->stats, &flow->stats);
 	g_free(temp);
 
+	return SUCCESS;
+
 inserted:
+	keep_flowstats(&temp->stats);
+	baseline_tcpv4flow(temp);
+
 	return SUCCESS;
 }
 
@@ -348,8 +431,10 @@ gint add_udpv4flows(struct udpv4flow *flow)
 	memcpy(temp, flow, sizeof(struct udpv4flow));
 	found = g_sequence_lookup(udpv4flows, temp, cmp_udpv4flows, NULL);
 
-	if (found != NULL)
+	if (found != NULL) {
+		ptr = g_sequence_get(found);
 		goto noneed;
+	}
 
 	switch (temp->foots.reply) {
 	case 0:
@@ -358,10 +443,11 @@ gint add_udpv4flows(struct udpv4flow *flow)
 		temp->foots.reply = 0;
 
 		if (found2 == NULL) {
-			temp->foots.fp = g_sequence_new(cleanfp);
+			temp->foots.path = NULL;
 			g_sequence_insert_sorted(udpv4flows, temp, cmp_udpv4flows, NULL);
 			goto inserted;
 		}
+		ptr = g_sequence_get(found2);
 		break;
 	case 1:
 		temp->foots.reply = 0;
@@ -370,7 +456,7 @@ gint add_udpv4flows(struct udpv4flow *flow)
 			ptr = g_sequence_get(found2);
 			ptr->foots.reply = 1;
 		} else {
-			temp->foots.fp = g_sequence_new(cleanfp);
+			temp->foots.path = NULL;
 			g_sequence_insert_sorted(udpv4flows, temp, cmp_udpv4flows, NULL);
 			goto inserted;
 		}
@@ -378,9 +464,15 @@ gint add_udpv4flows(struct udpv4flow *flow)
 	}
 
 noneed:
+	add_flowstats(&ptr->stats, &flow->stats);
 	g_free(temp);
 
+	return SUCCESS;
+
 inserted:
+	keep_flowstats(&temp->stats);
+	baseline_udpv4flow(temp);
+
 	return SUCCESS;
 }
 
@@ -393,8 +485,10 @@ gint add_icmpv4flows(struct icmpv4flow *flow)
 	memcpy(temp, flow, sizeof(struct icmpv4flow));
 	found = g_sequence_lookup(icmpv4flows, temp, cmp_icmpv4flows, NULL);
 
-	if (found != NULL)
+	if (found != NULL) {
+		ptr = g_sequence_get(found);
 		goto noneed;
+	}
 
 	switch (temp->foots.reply) {
 	case 0:
@@ -403,10 +497,11 @@ gint add_icmpv4flows(struct icmpv4flow *flow)
 		temp->foots.reply = 0;
 
 		if (found2 == NULL) {
-			temp->foots.fp = g_sequence_new(cleanfp);
+			temp->foots.path = NULL;
 			g_sequence_insert_sorted(icmpv4flows, temp, cmp_icmpv4flows, NULL);
 			goto inserted;
 		}
+		ptr = g_sequence_get(found2);
 		break;
 	case 1:
 		temp->foots.reply = 0;
@@ -415,7 +510,7 @@ gint add_icmpv4flows(struct icmpv4flow *flow)
 			ptr = g_sequence_get(found2);
 			ptr->foots.reply = 1;
 		} else {
-			temp->foots.fp = g_sequence_new(cleanfp);
+			temp->foots.path = NULL;
 			g_sequence_insert_sorted(icmpv4flows, temp, cmp_icmpv4flows, NULL);
 			goto inserted;
 		}
@@ -423,9 +518,15 @@ gint add_icmpv4flows(struct icmpv4flow *flow)
 	}
 
 noneed:
+	add_flowstats(&ptr->stats, &flow->stats);
 	g_free(temp);
 
+	return SUCCESS;
+
 inserted:
+	keep_flowstats(&temp->stats);
+	baseline_icmpv4flow(temp);
+
 	return SUCCESS;
 }
 
@@ -438,8 +539,10 @@ gint add_tcpv6flows(struct tcpv6flow *flow)
 	memcpy(temp, flow, sizeof(struct tcpv6flow));
 	found = g_sequence_lookup(tcpv6flows, temp, cmp_tcpv6flows, NULL);
 
-	if (found != NULL)
+	if (found != NULL) {
+		ptr = g_sequence_get(found);
 		goto noneed;
+	}
 
 	switch (temp->foots.reply) {
 	case 0:
@@ -448,10 +551,11 @@ gint add_tcpv6flows(struct tcpv6flow *flow)
 		temp->foots.reply = 0;
 
 		if (found2 == NULL) {
-			temp->foots.fp = g_sequence_new(cleanfp);
+			temp->foots.path = NULL;
 			g_sequence_insert_sorted(tcpv6flows, temp, cmp_tcpv6flows, NULL);
 			goto inserted;
 		}
+		ptr = g_sequence_get(found2);
 		break;
 	case 1:
 		temp->foots.reply = 0;
@@ -460,7 +564,7 @@ gint add_tcpv6flows(struct tcpv6flow *flow)
 			ptr = g_sequence_get(found2);
 			ptr->foots.reply = 1;
 		} else {
-			temp->foots.fp = g_sequence_new(cleanfp);
+			temp->foots.path = NULL;
 			g_sequence_insert_sorted(tcpv6flows, temp, cmp_tcpv6flows, NULL);
 			goto inserted;
 		}
@@ -468,9 +572,15 @@ gint add_tcpv6flows(struct tcpv6flow *flow)
 	}
 
 noneed:
+	add_flowstats(&ptr->stats, &flow->stats);
 	g_free(temp);
 
+	return SUCCESS;
+
 inserted:
+	keep_flowstats(&temp->stats);
+	baseline_tcpv6flow(temp);
+
 	return SUCCESS;
 }
 
@@ -483,8 +593,10 @@ gint add_udpv6flows(struct udpv6flow *flow)
 	memcpy(temp, flow, sizeof(struct udpv6flow));
 	found = g_sequence_lookup(udpv6flows, temp, cmp_udpv6flows, NULL);
 
-	if (found != NULL)
+	if (found != NULL) {
+		ptr = g_sequence_get(found);
 		goto noneed;
+	}
 
 	switch (temp->foots.reply) {
 	case 0:
@@ -493,10 +605,11 @@ gint add_udpv6flows(struct udpv6flow *flow)
 		temp->foots.reply = 0;
 
 		if (found2 == NULL) {
-			temp->foots.fp = g_sequence_new(cleanfp);
+			temp->foots.path = NULL;
 			g_sequence_insert_sorted(udpv6flows, temp, cmp_udpv6flows, NULL);
 			goto inserted;
 		}
+		ptr = g_sequence_get(found2);
 		break;
 	case 1:
 		temp->foots.reply = 0;
@@ -505,7 +618,7 @@ gint add_udpv6flows(struct udpv6flow *flow)
 			ptr = g_sequence_get(found2);
 			ptr->foots.reply = 1;
 		} else {
-			temp->foots.fp = g_sequence_new(cleanfp);
+			temp->foots.path = NULL;
 			g_sequence_insert_sorted(udpv6flows, temp, cmp_udpv6flows, NULL);
 			goto inserted;
 		}
@@ -513,9 +626,15 @@ gint add_udpv6flows(struct udpv6flow *flow)
 	}
 
 noneed:
+	add_flowstats(&ptr->stats, &flow->stats);
 	g_free(temp);
 
+	return SUCCESS;
+
 inserted:
+	keep_flowstats(&temp->stats);
+	baseline_udpv6flow(temp);
+
 	return SUCCESS;
 }
 
@@ -528,8 +647,10 @@ gint add_icmpv6flows(struct icmpv6flow *flow)
 	memcpy(temp, flow, sizeof(struct icmpv6flow));
 	found = g_sequence_lookup(icmpv6flows, temp, cmp_icmpv6flows, NULL);
 
-	if (found != NULL)
+	if (found != NULL) {
+		ptr = g_sequence_get(found);
 		goto noneed;
+	}
 
 	switch (temp->foots.reply) {
 	case 0:
@@ -538,10 +659,11 @@ gint add_icmpv6flows(struct icmpv6flow *flow)
 		temp->foots.reply = 0;
 
 		if (found2 == NULL) {
-			temp->foots.fp = g_sequence_new(cleanfp);
+			temp->foots.path = NULL;
 			g_sequence_insert_sorted(icmpv6flows, temp, cmp_icmpv6flows, NULL);
 			goto inserted;
 		}
+		ptr = g_sequence_get(found2);
 		break;
 	case 1:
 		temp->foots.reply = 0;
@@ -550,7 +672,7 @@ gint add_icmpv6flows(struct icmpv6flow *flow)
 			ptr = g_sequence_get(found2);
 			ptr->foots.reply = 1;
 		} else {
-			temp->foots.fp = g_sequence_new(cleanfp);
+			temp->foots.path = NULL;
 			g_sequence_insert_sorted(icmpv6flows, temp, cmp_icmpv6flows, NULL);
 			goto inserted;
 		}
@@ -558,105 +680,133 @@ gint add_icmpv6flows(struct icmpv6flow *flow)
 	}
 
 noneed:
+	add_flowstats(&ptr->stats, &flow->stats);
 	g_free(temp);
 
+	return SUCCESS;
+
 inserted:
+	keep_flowstats(&temp->stats);
+	baseline_icmpv6flow(temp);
+
 	return SUCCESS;
 }
 
 // ----
 
-gint add_tcpv4flow(struct in_addr s, struct in_addr d, uint16_t ps, uint16_t pd, uint8_t r)
+gint add_tcpv4flow(struct in_addr s, struct in_addr d, uint16_t ps, uint16_t pd, uint8_t f, uint8_t r, struct natbase *nat,
+		   struct flowstats *st)
 {
 	struct tcpv4flow flow;
 
-	memset(&flow, '0', sizeof(struct tcpv4flow));
+	memset(&flow, 0, sizeof(struct tcpv4flow));
 
 	flow.addrs.src = s;
 	flow.addrs.dst = d;
 	flow.base.src = ps;
 	flow.base.dst = pd;
+	flow.base.folded = f;
+	flow.nat = *nat;
 	flow.foots.reply = r;
+	flow.stats = *st;
 
 	add_tcpv4flows(&flow);
 
 	return SUCCESS;
 }
 
-gint add_udpv4flow(struct in_addr s, struct in_addr d, uint16_t ps, uint16_t pd, uint8_t r)
+gint add_udpv4flow(struct in_addr s, struct in_addr d, uint16_t ps, uint16_t pd, uint8_t f, uint8_t r, struct natbase *nat,
+		   struct flowstats *st)
 {
 	struct udpv4flow flow;
-	memset(&flow, '0', sizeof(struct udpv4flow));
+	memset(&flow, 0, sizeof(struct udpv4flow));
 
 	flow.addrs.src = s;
 	flow.addrs.dst = d;
 	flow.base.src = ps;
 	flow.base.dst = pd;
+	flow.base.folded = f;
+	flow.nat = *nat;
 	flow.foots.reply = r;
+	flow.stats = *st;
 
 	add_udpv4flows(&flow);
 
 	return SUCCESS;
 }
 
-gint add_icmpv4flow(struct in_addr s, struct in_addr d, uint8_t ps, uint8_t pd, uint8_t r)
+gint add_icmpv4flow(struct in_addr s, struct in_addr d, uint8_t ps, uint8_t pd, uint8_t r, struct natbase *nat,
+		   struct flowstats *st)
 {
 	struct icmpv4flow flow;
-	memset(&flow, '0', sizeof(struct icmpv4flow));
+	memset(&flow, 0, sizeof(struct icmpv4flow));
 
 	flow.addrs.src = s;
 	flow.addrs.dst = d;
 	flow.base.type = ps;
 	flow.base.code = pd;
+	flow.nat = *nat;
 	flow.foots.reply = r;
+	flow.stats = *st;
 
 	add_icmpv4flows(&flow);
 
 	return SUCCESS;
 }
 
-gint add_tcpv6flow(struct in6_addr s, struct in6_addr d, uint16_t ps, uint16_t pd, uint8_t r)
+gint add_tcpv6flow(struct in6_addr s, struct in6_addr d, uint16_t ps, uint16_t pd, uint8_t f, uint8_t r, struct natbase *nat,
+		   struct flowstats *st)
 {
 	struct tcpv6flow flow;
-	memset(&flow, '0', sizeof(struct tcpv6flow));
+	memset(&flow, 0, sizeof(struct tcpv6flow));
 
 	flow.addrs.src = s;
 	flow.addrs.dst = d;
 	flow.base.src = ps;
 	flow.base.dst = pd;
+	flow.base.folded = f;
+	flow.nat = *nat;
 	flow.foots.reply = r;
+	flow.stats = *st;
 
 	add_tcpv6flows(&flow);
 
 	return SUCCESS;
 }
 
-gint add_udpv6flow(struct in6_addr s, struct in6_addr d, uint16_t ps, uint16_t pd, uint8_t r)
+gint add_udpv6flow(struct in6_addr s, struct in6_addr d, uint16_t ps, uint16_t pd, uint8_t f, uint8_t r, struct natbase *nat,
+		   struct flowstats *st)
 {
 	struct udpv6flow flow;
-	memset(&flow, '0', sizeof(struct udpv6flow));
+	memset(&flow, 0, sizeof(struct udpv6flow));
 
 	flow.addrs.src = s;
 	flow.addrs.dst = d;
 	flow.base.src = ps;
 	flow.base.dst = pd;
+	flow.base.folded = f;
+	flow.nat = *nat;
 	flow.foots.reply = r;
+	flow.stats = *st;
 
 	add_udpv6flows(&flow);
 
 	return SUCCESS;
 }
 
-gint add_icmpv6flow(struct in6_addr s, struct in6_addr d, uint8_t ps, uint8_t pd, uint8_t r)
+gint add_icmpv6flow(struct in6_addr s, struct in6_addr d, uint8_t ps, uint8_t pd, uint8_t r, struct natbase *nat,
+		   struct flowstats *st)
 {
 	struct icmpv6flow flow;
-	memset(&flow, '0', sizeof(struct icmpv6flow));
+	memset(&flow, 0, sizeof(struct icmpv6flow));
 
 	flow.addrs.src = s;
 	flow.addrs.dst = d;
 	flow.base.type = ps;
 	flow.base.code = pd;
+	flow.nat = *nat;
 	flow.foots.reply = r;
+	flow.stats = *st;
 
 	add_icmpv6flows(&flow);
 
@@ -671,6 +821,9 @@ void out_tcpv4flows(gpointer data, gpointer user_data)
 	gchar *src, *dst;
 	struct tcpv4flow *flow = data;
 
+	if (skip_flowstats(&flow->stats))
+		return;
+
 	src = ipv4_str(&flow->addrs.src);
 	dst = ipv4_str(&flow->addrs.dst);
 
@@ -678,7 +831,11 @@ void out_tcpv4flows(gpointer data, gpointer user_data)
 	                ntohs(flow->base.src), dst, ntohs(flow->base.dst),
 	                flow->foots.reply ? " (confirmed)" : "");
 
-	g_sequence_foreach(flow->foots.fp, out_footprint, NULL);
+	out_nat(&flow->nat, AF_INET, IPPROTO_TCP, &flow->addrs.src, &flow->addrs.dst, flow->base.src, flow->base.dst);
+	out_flowstats(&flow->stats);
+
+	fppath_foreach(flow->foots.path, out_footprint, GUINT_TO_POINTER(AF_INET));
+	out_inherited(&flow->foots, AF_INET);
 
 	g_free(src);
 	g_free(dst);
@@ -690,6 +847,9 @@ void out_udpv4flows(gpointer data, gpointer user_data)
 	gchar *src, *dst;
 	struct udpv4flow *flow = data;
 
+	if (skip_flowstats(&flow->stats))
+		return;
+
 	src = ipv4_str(&flow->addrs.src);
 	dst = ipv4_str(&flow->addrs.dst);
 
@@ -697,7 +857,11 @@ void out_udpv4flows(gpointer data, gpointer user_data)
 	                ntohs(flow->base.src), dst, ntohs(flow->base.dst),
 	                flow->foots.reply ? " (confirmed)" : "");
 
-	g_sequence_foreach(flow->foots.fp, out_footprint, NULL);
+	out_nat(&flow->nat, AF_INET, IPPROTO_UDP, &flow->addrs.src, &flow->addrs.dst, flow->base.src, flow->base.dst);
+	out_flowstats(&flow->stats);
+
+	fppath_foreach(flow->foots.path, out_footprint, GUINT_TO_POINTER(AF_INET));
+	out_inherited(&flow->foots, AF_INET);
 
 	g_free(src);
 	g_free(dst);
@@ -709,6 +873,9 @@ void out_icmpv4flows(gpointer data, gpointer user_data)
 	gchar *src, *dst;
 	struct icmpv4flow *flow = data;
 
+	if (skip_flowstats(&flow->stats))
+		return;
+
 	src = ipv4_str(&flow->addrs.src);
 	dst = ipv4_str(&flow->addrs.dst);
 
@@ -716,7 +883,11 @@ void out_icmpv4flows(gpointer data, gpointer user_data)
 	                dst, (uint8_t) ntohs(flow->base.type), (uint8_t) ntohs(flow->base.code),
 	                flow->foots.reply ? " (confirmed)" : "");
 
-	g_sequence_foreach(flow->foots.fp, out_footprint, NULL);
+	out_nat(&flow->nat, AF_INET, IPPROTO_ICMP, &flow->addrs.src, &flow->addrs.dst, 0, 0);
+	out_flowstats(&flow->stats);
+
+	fppath_foreach(flow->foots.path, out_footprint, GUINT_TO_POINTER(AF_INET));
+	out_inherited(&flow->foots, AF_INET);
 
 	g_free(src);
 	g_free(dst);
@@ -728,6 +899,9 @@ void out_tcpv6flows(gpointer data, gpointer user_data)
 	gchar *src, *dst;
 	struct tcpv6flow *flow = data;
 
+	if (skip_flowstats(&flow->stats))
+		return;
+
 	src = ipv6_str(&flow->addrs.src);
 	dst = ipv6_str(&flow->addrs.dst);
 
@@ -735,7 +909,11 @@ void out_tcpv6flows(gpointer data, gpointer user_data)
 	                ntohs(flow->base.src), dst, ntohs(flow->base.dst),
 	                flow->foots.reply ? " (confirmed)" : "");
 
-	g_sequence_foreach(flow->foots.fp, out_footprint, NULL);
+	out_nat(&flow->nat, AF_INET6, IPPROTO_TCP, &flow->addrs.src, &flow->addrs.dst, flow->base.src, flow->base.dst);
+	out_flowstats(&flow->stats);
+
+	fppath_foreach(flow->foots.path, out_footprint, GUINT_TO_POINTER(AF_INET6));
+	out_inherited(&flow->foots, AF_INET6);
 
 	g_free(src);
 	g_free(dst);
@@ -747,6 +925,9 @@ void out_udpv6flows(gpointer data, gpointer user_data)
 	gchar *src, *dst;
 	struct udpv6flow *flow = data;
 
+	if (skip_flowstats(&flow->stats))
+		return;
+
 	src = ipv6_str(&flow->addrs.src);
 	dst = ipv6_str(&flow->addrs.dst);
 
@@ -754,7 +935,11 @@ void out_udpv6flows(gpointer data, gpointer user_data)
 	                ntohs(flow->base.src), dst, ntohs(flow->base.dst),
 	                flow->foots.reply ? " (confirmed)" : "");
 
-	g_sequence_foreach(flow->foots.fp, out_footprint, NULL);
+	out_nat(&flow->nat, AF_INET6, IPPROTO_UDP, &flow->addrs.src, &flow->addrs.dst, flow->base.src, flow->base.dst);
+	out_flowstats(&flow->stats);
+
+	fppath_foreach(flow->foots.path, out_footprint, GUINT_TO_POINTER(AF_INET6));
+	out_inherited(&flow->foots, AF_INET6);
 
 	g_free(src);
 	g_free(dst);
@@ -766,6 +951,9 @@ void out_icmpv6flows(gpointer data, gpointer user_data)
 	gchar *src, *dst;
 	struct icmpv6flow *flow = data;
 
+	if (skip_flowstats(&flow->stats))
+		return;
+
 	src = ipv6_str(&flow->addrs.src);
 	dst = ipv6_str(&flow->addrs.dst);
 
@@ -773,7 +961,11 @@ void out_icmpv6flows(gpointer data, gpointer user_data)
 	                dst, (uint8_t) ntohs(flow->base.type), (uint8_t) ntohs(flow->base.code),
 	                flow->foots.reply ? " (confirmed)" : "");
 
-	g_sequence_foreach(flow->foots.fp, out_footprint, NULL);
+	out_nat(&flow->nat, AF_INET6, IPPROTO_ICMPV6, &flow->addrs.src, &flow->addrs.dst, 0, 0);
+	out_flowstats(&flow->stats);
+
+	fppath_foreach(flow->foots.path, out_footprint, GUINT_TO_POINTER(AF_INET6));
+	out_inherited(&flow->foots, AF_INET6);
 
 	g_free(src);
 	g_free(dst);
@@ -781,20 +973,117 @@ void out_icmpv6flows(gpointer data, gpointer user_data)
 
 // ----
 
-void out_all(void)
+static void append_flow(gpointer data, gpointer user_data)
 {
-	// tell user through syslog what logfile will contain the data
+	g_ptr_array_add(user_data, data);
+}
+
+void out_sorted(GSequence *seq, GFunc func, gsize offset)
+{
+	/*
+	 * sequences are sorted by flow tuple. to dump them by volume or
+	 * recency, sort an array of pointers to the flows instead.
+	 */
+
+	GPtrArray *flows = g_ptr_array_sized_new(g_sequence_get_length(seq));
 
-	out_logfile();
+	g_sequence_foreach(seq, append_flow, flows);
+	g_ptr_array_sort_with_data(flows, cmp_flowstats, GSIZE_TO_POINTER(offset));
+	g_ptr_array_foreach(flows, func, NULL);
+	g_ptr_array_free(flows, TRUE);
+}
+
+gpointer lookup_natflow(GSequence *seq, gpointer flow, GCompareDataFunc func, gsize offset)
+{
+	/*
+	 * no flow with the same post-NAT endpoints (-X): trace messages of a
+	 * packet not translated yet. the NAT variants of the tuple are adjacent,
+	 * the one with an open trace window (same direction) gets them or, if
+	 * none is being traced, the first one (same direction).
+	 */
+
+	gpointer ptr, found = NULL;
+	GSequenceIter *iter, *prev;
+	struct footprints *foots, *want = (struct footprints *) ((gchar *) flow + offset);
+
+	if (!natflows)
+		return NULL;
+
+	iter = g_sequence_lookup(seq, flow, func, FLOW_TUPLE);
+
+	if (iter == NULL)
+		return NULL;
+
+	while (!g_sequence_iter_is_begin(iter)) {
+		prev = g_sequence_iter_prev(iter);
+		if (func(g_sequence_get(prev), flow, FLOW_TUPLE) != EQUAL)
+			break;
+		iter = prev;
+	}
+
+	for (; !g_sequence_iter_is_end(iter); iter = g_sequence_iter_next(iter)) {
+		ptr = g_sequence_get(iter);
+		if (func(ptr, flow, FLOW_TUPLE) != EQUAL)
+			break;
+		foots = (struct footprints *) ((gchar *) ptr + offset);
+		if (foots->reply != want->reply)
+			continue;
+		if (foots->trace != NULL)
+			return ptr;
+		if (found == NULL)
+			found = ptr;
+	}
 
+	return found;
+}
+
+// ----
+
+static void out_flows(void)
+{
+	switch (sortorder) {
+	case SORT_FLOW:
+		g_sequence_foreach(tcpv4flows, out_tcpv4flows, NULL);
+		g_sequence_foreach(udpv4flows, out_udpv4flows, NULL);
+		g_sequence_foreach(icmpv4flows, out_icmpv4flows, NULL);
+		g_sequence_foreach(tcpv6flows, out_tcpv6flows, NULL);
+		g_sequence_foreach(udpv6flows, out_udpv6flows, NULL);
+		g_sequence_foreach(icmpv6flows, out_icmpv6flows, NULL);
+		break;
+	default:
+		out_sorted(tcpv4flows, out_tcpv4flows, offsetof(struct tcpv4flow, stats));
+		out_sorted(udpv4flows, out_udpv4flows, offsetof(struct udpv4flow, stats));
+		out_sorted(icmpv4flows, out_icmpv4flows, offsetof(struct icmpv4flow, stats));
+		out_sorted(tcpv6flows, out_tcpv6flows, offsetof(struct tcpv6flow, stats));
+		out_sorted(udpv6flows, out_udpv6flows, offsetof(struct udpv6flow, stats));
+		out_sorted(icmpv6flows, out_icmpv6flows, offsetof(struct icmpv6flow, stats));
+		break;
+	}
+}
+
+void out_all(void)
+{
 	// dump internal data into the logfile
 
-	g_sequence_foreach(tcpv4flows, out_tcpv4flows, NULL);
-	g_sequence_foreach(udpv4flows, out_udpv4flows, NULL);
-	g_sequence_foreach(icmpv4flows, out_icmpv4flows, NULL);
-	g_sequence_foreach(tcpv6flows, out_tcpv6flows, NULL);
-	g_sequence_foreach(udpv6flows, out_udpv6flows, NULL);
-	g_sequence_foreach(icmpv6flows, out_icmpv6flows, NULL);
+	if (!lifecycle) {
+		out_flows();
+		out_hitters();
+		return;
+	}
+
+	// flows with active connections first, then the ended ones
+
+	dprintf(logfd, "Active flows:\n");
+	lifesection = LIFE_ACTIVE;
+	out_flows();
+
+	dprintf(logfd, "History (ended flows):\n");
+	lifesection = LIFE_HISTORY;
+	out_flows();
+
+	lifesection = LIFE_ALL;
+
+	out_hitters();
 }
 
 // ----
@@ -802,42 +1091,48 @@ void out_all(void)
 void cleanflow_tcpv4(gpointer data)
 {
 	struct tcpv4flow *tcpv4 = data;
-	g_sequence_free(tcpv4->foots.fp);
+	fppath_unref(tcpv4->foots.path);
+	free_flowstats(&tcpv4->stats);
 	g_free(data);
 }
 
 void cleanflow_udpv4(gpointer data)
 {
 	struct udpv4flow *udpv4 = data;
-	g_sequence_free(udpv4->foots.fp);
+	fppath_unref(udpv4->foots.path);
+	free_flowstats(&udpv4->stats);
 	g_free(data);
 }
 
 void cleanflow_icmpv4(gpointer data)
 {
 	struct icmpv4flow *icmpv4 = data;
-	g_sequence_free(icmpv4->foots.fp);
+	fppath_unref(icmpv4->foots.path);
+	free_flowstats(&icmpv4->stats);
 	g_free(data);
 }
 
 void cleanflow_tcpv6(gpointer data)
 {
 	struct tcpv6flow *tcpv6 = data;
-	g_sequence_free(tcpv6->foots.fp);
+	fppath_unref(tcpv6->foots.path);
+	free_flowstats(&tcpv6->stats);
 	g_free(data);
 }
 
 void cleanflow_udpv6(gpointer data)
 {
 	struct udpv6flow *udpv6 = data;
-	g_sequence_free(udpv6->foots.fp);
+	fppath_unref(udpv6->foots.path);
+	free_flowstats(&udpv6->stats);
 	g_free(data);
 }
 
 void cleanflow_icmpv6(gpointer data)
 {
 	struct icmpv6flow *icmpv6 = data;
-	g_sequence_free(icmpv6->foots.fp);
+	fppath_unref(icmpv6->foots.path);
+	free_flowstats(&icmpv6->stats);
 	g_free(data);
 }
 
@@ -862,3 +1157,25 @@ void free_flows(void)
 	g_sequence_free(udpv6flows);
 	g_sequence_free(icmpv6flows);
 }
+
+// ----
+
+void save_flows(struct flowtables *tables)
+{
+	tables->tcpv4flows = tcpv4flows;
+	tables->udpv4flows = udpv4flows;
+	tables->icmpv4flows = icmpv4flows;
+	tables->tcpv6flows = tcpv6flows;
+	tables->udpv6flows = udpv6flows;
+	tables->icmpv6flows = icmpv6flows;
+}
+
+void load_flows(struct flowtables *tables)
+{
+	tcpv4flows = tables->tcpv4flows;
+	udpv4flows = tables->udpv4flows;
+	icmpv4flows = tables->icmpv4flows;
+	tcpv6flows = tables->tcpv6flows;
+	udpv6flows = tables->udpv6flows;
+	icmpv6flows = tables->icmpv6flows;
+}
@@ -8,6 +8,8 @@
 
 #include "general.h"
 #include "footprint.h"
+#include "acct.h"
+#include "nat.h"
 
 extern int logfd;
 
@@ -26,6 +28,7 @@ struct ipv6base {
 struct portbase {
 	uint16_t src;
 	uint16_t dst;
+	uint8_t folded;		// FOLDED_SRC | FOLDED_DST (ports.h)
 };
 
 struct icmpbase {
@@ -38,19 +41,25 @@ struct icmpbase {
 struct tcpv4flow {
 	struct ipv4base addrs;
 	struct portbase base;
+	struct natbase nat;
 	struct footprints foots;
+	struct flowstats stats;
 };
 
 struct udpv4flow {
 	struct ipv4base addrs;
 	struct portbase base;
+	struct natbase nat;
 	struct footprints foots;
+	struct flowstats stats;
 };
 
 struct icmpv4flow {
 	struct ipv4base addrs;
 	struct icmpbase base;
+	struct natbase nat;
 	struct footprints foots;
+	struct flowstats stats;
 };
 
 // IPv6 netfilter flows
@@ -58,19 +67,25 @@ struct icmpv4flow {
 struct tcpv6flow {
 	struct ipv6base addrs;
 	struct portbase base;
+	struct natbase nat;
 	struct footprints foots;
+	struct flowstats stats;
 };
 
 struct udpv6flow {
 	struct ipv6base addrs;
 	struct portbase base;
+	struct natbase nat;
 	struct footprints foots;
+	struct flowstats stats;
 };
 
 struct icmpv6flow {
 	struct ipv6base addrs;
 	struct icmpbase base;
+	struct natbase nat;
 	struct footprints foots;
+	struct flowstats stats;
 };
 
 // prototypes
@@ -90,6 +105,10 @@ gint cmp_tcp6flow(struct tcpv6flow *, struct tcpv6flow *);
 gint cmp_udpv6flow(struct udpv6flow *, struct udpv6flow *);
 gint cmp_icmpv6flow(struct icmpv6flow *, struct icmpv6flow *);
 
+/* cmp_*flows() data: the tuple only (post-NAT endpoints and reply left out) */
+
+#define FLOW_TUPLE GINT_TO_POINTER(1)
+
 gint cmp_tcpv4flows(gconstpointer, gconstpointer, gpointer);
 gint cmp_udpv4flows(gconstpointer, gconstpointer, gpointer);
 gint cmp_icmpv4flows(gconstpointer, gconstpointer, gpointer);
@@ -97,12 +116,12 @@ gint cmp_tcpv6flows(gconstpointer, gconstpointer, gpointer);
 gint cmp_udpv6flows(gconstpointer, gconstpointer, gpointer);
 gint cmp_icmpv6flows(gconstpointer, gconstpointer, gpointer);
 
-gint add_tcpv4flow(struct in_addr, struct in_addr, uint16_t, uint16_t, uint8_t);
-gint add_udpv4flow(struct in_addr, struct in_addr, uint16_t, uint16_t, uint8_t);
-gint add_icmpv4flow(struct in_addr, struct in_addr, uint8_t, uint8_t, uint8_t);
-gint add_tcpv6flow(struct in6_addr, struct in6_addr, uint16_t, uint16_t, uint8_t);
-gint add_udpv6flow(struct in6_addr, struct in6_addr, uint16_t, uint16_t, uint8_t);
-gint add_icmpv6flow(struct in6_addr, struct in6_addr, uint8_t, uint8_t, uint8_t);
+gint add_tcpv4flow(struct in_addr, struct in_addr, uint16_t, uint16_t, uint8_t, uint8_t, struct natbase *, struct flowstats *);
+gint add_udpv4flow(struct in_addr, struct in_addr, uint16_t, uint16_t, uint8_t, uint8_t, struct natbase *, struct flowstats *);
+gint add_icmpv4flow(struct in_addr, struct in_addr, uint8_t, uint8_t, uint8_t, struct natbase *, struct flowstats *);
+gint add_tcpv6flow(struct in6_addr, struct in6_addr, uint16_t, uint16_t, uint8_t, uint8_t, struct natbase *, struct flowstats *);
+gint add_udpv6flow(struct in6_addr, struct in6_addr, uint16_t, uint16_t, uint8_t, uint8_t, struct natbase *, struct flowstats *);
+gint add_icmpv6flow(struct in6_addr, struct in6_addr, uint8_t, uint8_t, uint8_t, struct natbase *, struct flowstats *);
 
 gint add_tcpv4flows(struct tcpv4flow *);
 gint add_udpv4flows(struct udpv4flow *);
@@ -125,6 +144,23 @@ void cleanflow_tcpv6(gpointer);
 void cleanflow_udpv6(gpointer);
 void cleanflow_icmpv6(gpointer);
 
+void out_sorted(GSequence *, GFunc, gsize);
+gpointer lookup_natflow(GSequence *, gpointer, GCompareDataFunc, gsize);
+
+/* all flows tables (one set per network namespace) */
+
+struct flowtables {
+	GSequence *tcpv4flows;
+	GSequence *udpv4flows;
+	GSequence *icmpv4flows;
+	GSequence *tcpv6flows;
+	GSequence *udpv6flows;
+	GSequence *icmpv6flows;
+};
+
+void save_flows(struct flowtables *);
+void load_flows(struct flowtables *);
+
 void alloc_flows(void);
 void cleanflow(gpointer);
 void out_all(void);
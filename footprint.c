@@ -5,6 +5,9 @@
 
 #include "footprint.h"
 #include "flows.h"
+#include "iptables.h"
+#include "fppath.h"
+#include "ruleidx.h"
 
 extern GSequence *tcpv4flows;
 extern GSequence *udpv4flows;
@@ -46,6 +49,12 @@ gint cmp_footprint(gconstpointer ptr_one, gconstpointer ptr_two, gpointer data)
 					return LESS;
 				if (one->position > two->position)
 					return MORE;
+
+				// same position under another ruleset is another rule
+				if (one->gen < two->gen)
+					return LESS;
+				if (one->gen > two->gen)
+					return MORE;
 			}
 		}
 	}
@@ -57,194 +66,150 @@ gint cmp_footprint(gconstpointer ptr_one, gconstpointer ptr_two, gpointer data)
 
 gint add_tcpv4fps(struct tcpv4flow *flow, struct footprint *fp)
 {
+	gboolean added;
 	struct tcpv4flow *ptr;
-	struct footprint *newfp;
-	GSequenceIter *tcpv4found, *fpfound;
+	GSequenceIter *tcpv4found;
 
 	tcpv4found = g_sequence_lookup(tcpv4flows, flow, cmp_tcpv4flows, NULL);
 
-	if (tcpv4found == NULL)
-		goto inserted;
+	if (tcpv4found != NULL)
+		ptr = g_sequence_get(tcpv4found);
+	else
+		ptr = lookup_natflow(tcpv4flows, flow, cmp_tcpv4flows, offsetof(struct tcpv4flow, foots));
 
-	// alloc a new footprint to lookup and, if needed, add
+	if (ptr == NULL)
+		return ERROR;
 
-	ptr = g_sequence_get(tcpv4found);
-	newfp = g_malloc0(sizeof(struct footprint));
-	memcpy(newfp, fp, sizeof(struct footprint));
+	// footprints are interned paths: move the flow to the extended one
 
-	fpfound = g_sequence_lookup(ptr->foots.fp, newfp, cmp_footprint, NULL);
+	ptr->foots.path = fppath_add(ptr->foots.path, fp, &added);
 
-	// footprint already exists, ignore
+	// an open trace window wants to know (packets and new footprints)
 
-	if (fpfound != NULL)
-		goto noneed;
+	trace_observed(&ptr->foots, added);
 
-	g_sequence_insert_sorted(ptr->foots.fp, newfp, cmp_footprint, NULL);
-	goto inserted;
-
-noneed:
-	g_free(newfp);
-
-inserted:
 	return SUCCESS;
 }
 
 gint add_udpv4fps(struct udpv4flow *flow, struct footprint *fp)
 {
+	gboolean added;
 	struct udpv4flow *ptr;
-	struct footprint *newfp;
-	GSequenceIter *udpv4found, *fpfound;
+	GSequenceIter *udpv4found;
 
 	udpv4found = g_sequence_lookup(udpv4flows, flow, cmp_udpv4flows, NULL);
 
-	if (udpv4found == NULL)
-		goto inserted;
-
-	ptr = g_sequence_get(udpv4found);
-	newfp = g_malloc0(sizeof(struct footprint));
-	memcpy(newfp, fp, sizeof(struct footprint));
+	if (udpv4found != NULL)
+		ptr = g_sequence_get(udpv4found);
+	else
+		ptr = lookup_natflow(udpv4flows, flow, cmp_udpv4flows, offsetof(struct udpv4flow, foots));
 
-	fpfound = g_sequence_lookup(ptr->foots.fp, newfp, cmp_footprint, NULL);
+	if (ptr == NULL)
+		return ERROR;
 
-	if (fpfound != NULL)
-		goto noneed;
+	ptr->foots.path = fppath_add(ptr->foots.path, fp, &added);
 
-	g_sequence_insert_sorted(ptr->foots.fp, newfp, cmp_footprint, NULL);
-	goto inserted;
+	trace_observed(&ptr->foots, added);
 
-noneed:
-	g_free(newfp);
-
-inserted:
 	return SUCCESS;
 }
 
 gint add_icmpv4fps(struct icmpv4flow *flow, struct footprint *fp)
 {
+	gboolean added;
 	struct icmpv4flow *ptr;
-	struct footprint *newfp;
-	GSequenceIter *icmpv4found, *fpfound;
+	GSequenceIter *icmpv4found;
 
 	icmpv4found = g_sequence_lookup(icmpv4flows, flow, cmp_icmpv4flows, NULL);
 
-	if (icmpv4found == NULL)
-		goto inserted;
-
-	ptr = g_sequence_get(icmpv4found);
-	newfp = g_malloc0(sizeof(struct footprint));
-	memcpy(newfp, fp, sizeof(struct footprint));
-
-	fpfound = g_sequence_lookup(ptr->foots.fp, newfp, cmp_footprint, NULL);
+	if (icmpv4found != NULL)
+		ptr = g_sequence_get(icmpv4found);
+	else
+		ptr = lookup_natflow(icmpv4flows, flow, cmp_icmpv4flows, offsetof(struct icmpv4flow, foots));
 
-	if (fpfound != NULL)
-		goto noneed;
+	if (ptr == NULL)
+		return ERROR;
 
-	g_sequence_insert_sorted(ptr->foots.fp, newfp, cmp_footprint, NULL);
-	goto inserted;
+	ptr->foots.path = fppath_add(ptr->foots.path, fp, &added);
 
-noneed:
-	g_free(newfp);
+	trace_observed(&ptr->foots, added);
 
-inserted:
 	return SUCCESS;
 }
 
 gint add_tcpv6fps(struct tcpv6flow *flow, struct footprint *fp)
 {
+	gboolean added;
 	struct tcpv6flow *ptr;
-	struct footprint *newfp;
-	GSequenceIter *tcpv6found, *fpfound;
-
-	HERE;
+	GSequenceIter *tcpv6found;
 
 	tcpv6found = g_sequence_lookup(tcpv6flows, flow, cmp_tcpv6flows, NULL);
 
-	if (tcpv6found == NULL)
-		goto inserted;
-
-	ptr = g_sequence_get(tcpv6found);
-	newfp = g_malloc0(sizeof(struct footprint));
-	memcpy(newfp, fp, sizeof(struct footprint));
-
-	fpfound = g_sequence_lookup(ptr->foots.fp, newfp, cmp_footprint, NULL);
+	if (tcpv6found != NULL)
+		ptr = g_sequence_get(tcpv6found);
+	else
+		ptr = lookup_natflow(tcpv6flows, flow, cmp_tcpv6flows, offsetof(struct tcpv6flow, foots));
 
-	if (fpfound != NULL)
-		goto noneed;
+	if (ptr == NULL)
+		return ERROR;
 
-	g_sequence_insert_sorted(ptr->foots.fp, newfp, cmp_footprint, NULL);
-	goto inserted;
+	ptr->foots.path = fppath_add(ptr->foots.path, fp, &added);
 
-noneed:
-	g_free(newfp);
+	trace_observed(&ptr->foots, added);
 
-inserted:
 	return SUCCESS;
 }
 
 gint add_udpv6fps(struct udpv6flow *flow, struct footprint *fp)
 {
+	gboolean added;
 	struct udpv6flow *ptr;
-	struct footprint *newfp;
-	GSequenceIter *udpv6found, *fpfound;
+	GSequenceIter *udpv6found;
 
 	udpv6found = g_sequence_lookup(udpv6flows, flow, cmp_udpv6flows, NULL);
 
-	if (udpv6found == NULL)
-		goto inserted;
+	if (udpv6found != NULL)
+		ptr = g_sequence_get(udpv6found);
+	else
+		ptr = lookup_natflow(udpv6flows, flow, cmp_udpv6flows, offsetof(struct udpv6flow, foots));
 
-	ptr = g_sequence_get(udpv6found);
-	newfp = g_malloc0(sizeof(struct footprint));
-	memcpy(newfp, fp, sizeof(struct footprint));
+	if (ptr == NULL)
+		return ERROR;
 
-	fpfound = g_sequence_lookup(ptr->foots.fp, newfp, cmp_footprint, NULL);
+	ptr->foots.path = fppath_add(ptr->foots.path, fp, &added);
 
-	if (fpfound != NULL)
-		goto noneed;
+	trace_observed(&ptr->foots, added);
 
-	g_sequence_insert_sorted(ptr->foots.fp, newfp, cmp_footprint, NULL);
-	goto inserted;
-
-noneed:
-	g_free(newfp);
-
-inserted:
 	return SUCCESS;
 }
 
 gint add_icmpv6fps(struct icmpv6flow *flow, struct footprint *fp)
 {
+	gboolean added;
 	struct icmpv6flow *ptr;
-	struct footprint *newfp;
-	GSequenceIter *icmpv6found, *fpfound;
+	GSequenceIter *icmpv6found;
 
 	icmpv6found = g_sequence_lookup(icmpv6flows, flow, cmp_icmpv6flows, NULL);
 
-	if (icmpv6found == NULL)
-		goto inserted;
-
-	ptr = g_sequence_get(icmpv6found);
-	newfp = g_malloc0(sizeof(struct footprint));
-	memcpy(newfp, fp, sizeof(struct footprint));
+	if (icmpv6found != NULL)
+		ptr = g_sequence_get(icmpv6found);
+	else
+		ptr = lookup_natflow(icmpv6flows, flow, cmp_icmpv6flows, offsetof(struct icmpv6flow, foots));
 
-	fpfound = g_sequence_lookup(ptr->foots.fp, newfp, cmp_footprint, NULL);
+	if (ptr == NULL)
+		return ERROR;
 
-	if (fpfound != NULL)
-		goto noneed;
+	ptr->foots.path = fppath_add(ptr->foots.path, fp, &added);
 
-	g_sequence_insert_sorted(ptr->foots.fp, newfp, cmp_footprint, NULL);
-	goto inserted;
+	trace_observed(&ptr->foots, added);
 
-noneed:
-	g_free(newfp);
-
-inserted:
 	return SUCCESS;
 }
 
 // ----
 
 gint add_tcpv4fp(struct in_addr s, struct in_addr d,
-		uint16_t ps, uint16_t pd, uint8_t r,
+		uint16_t ps, uint16_t pd, uint8_t f, uint8_t r, struct natbase *nat,
 		struct footprint *fp)
 {
 
@@ -256,15 +221,15 @@ gint add_tcpv4fp(struct in_addr s, struct in_addr d,
 	flow.addrs.dst = d;
 	flow.base.src = ps;
 	flow.base.dst = pd;
+	flow.base.folded = f;
+	flow.nat = *nat;
 	flow.foots.reply = r;
 
-	add_tcpv4fps(&flow, fp);
-
-	return SUCCESS;
+	return add_tcpv4fps(&flow, fp);
 }
 
 gint add_udpv4fp(struct in_addr s,struct in_addr d,
-		uint16_t ps, uint16_t pd, uint8_t r,
+		uint16_t ps, uint16_t pd, uint8_t f, uint8_t r, struct natbase *nat,
 		struct footprint *fp)
 {
 	struct udpv4flow flow;
@@ -275,15 +240,15 @@ gint add_udpv4fp(struct in_addr s,struct in_addr d,
 	flow.addrs.dst = d;
 	flow.base.src = ps;
 	flow.base.dst = pd;
+	flow.base.folded = f;
+	flow.nat = *nat;
 	flow.foots.reply = r;
 
-	add_udpv4fps(&flow, fp);
-
-	return SUCCESS;
+	return add_udpv4fps(&flow, fp);
 }
 
 gint add_icmpv4fp(struct in_addr s, struct in_addr d,
-		uint8_t ps, uint8_t pd, uint8_t r,
+		uint8_t ps, uint8_t pd, uint8_t r, struct natbase *nat,
 		struct footprint *fp)
 {
 	struct icmpv4flow flow;
@@ -293,15 +258,14 @@ gint add_icmpv4fp(struct in_addr s, struct in_addr d,
 	flow.addrs.dst = d;
 	flow.base.type = ps;
 	flow.base.code = pd;
+	flow.nat = *nat;
 	flow.foots.reply = r;
 
-	add_icmpv4fps(&flow, fp);
-
-	return SUCCESS;
+	return add_icmpv4fps(&flow, fp);
 }
 
 gint add_tcpv6fp(struct in6_addr s, struct in6_addr d,
-		uint16_t ps, uint16_t pd, uint8_t r,
+		uint16_t ps, uint16_t pd, uint8_t f, uint8_t r, struct natbase *nat,
 		struct footprint *fp)
 {
 	struct tcpv6flow flow;
@@ -312,15 +276,15 @@ gint add_tcpv6fp(struct in6_addr s, struct in6_addr d,
 	flow.addrs.dst = d;
 	flow.base.src = ps;
 	flow.base.dst = pd;
+	flow.base.folded = f;
+	flow.nat = *nat;
 	flow.foots.reply = r;
 
-	add_tcpv6fps(&flow, fp);
-
-	return SUCCESS;
+	return add_tcpv6fps(&flow, fp);
 }
 
 gint add_udpv6fp(struct in6_addr s, struct in6_addr d,
-		uint16_t ps, uint16_t pd, uint8_t r,
+		uint16_t ps, uint16_t pd, uint8_t f, uint8_t r, struct natbase *nat,
 		struct footprint *fp)
 {
 	struct udpv6flow flow;
@@ -331,15 +295,15 @@ gint add_udpv6fp(struct in6_addr s, struct in6_addr d,
 	flow.addrs.dst = d;
 	flow.base.src = ps;
 	flow.base.dst = pd;
+	flow.base.folded = f;
+	flow.nat = *nat;
 	flow.foots.reply = r;
 
-	add_udpv6fps(&flow, fp);
-
-	return SUCCESS;
+	return add_udpv6fps(&flow, fp);
 }
 
 gint add_icmpv6fp(struct in6_addr s, struct in6_addr d,
-		uint8_t ps, uint8_t pd, uint8_t r,
+		uint8_t ps, uint8_t pd, uint8_t r, struct natbase *nat,
 		struct footprint *fp)
 {
 	struct icmpv6flow flow;
@@ -350,11 +314,10 @@ gint add_icmpv6fp(struct in6_addr s, struct in6_addr d,
 	flow.addrs.dst = d;
 	flow.base.type = ps;
 	flow.base.code = pd;
+	flow.nat = *nat;
 	flow.foots.reply = r;
 
-	add_icmpv6fps(&flow, fp);
-
-	return SUCCESS;
+	return add_icmpv6fps(&flow, fp);
 }
 
 // ----
@@ -362,49 +325,57 @@ gint add_icmpv6fp(struct in6_addr s, struct in6_addr d,
 void out_footprint(gpointer data, gpointer user_data)
 {
 	static int times = 0;
-	gchar *table, *type;
+	const gchar *rule;
+	gboolean current;
 	struct footprint *fp = data;
 
-	switch (fp->table) {
-	case FOOTPRINT_TABLE_RAW:
-		table = "raw";
-		break;
-	case FOOTPRINT_TABLE_MANGLE:
-		table = "mangle";
-		break;
-	case FOOTPRINT_TABLE_NAT:
-		table = "nat";
-		break;
-	case FOOTPRINT_TABLE_FILTER:
-		table = "filter";
-		break;
-	default:
-		table = "unknown";
-		break;
+	dprintf(logfd, "\t\t\t\ttable: %s, chain: %s, type: %s, position: %u\n",
+			footprint_table_str(fp->table), fp->chain, footprint_type_str(fp->type), fp->position);
+
+	// rule attribution (-i): the rule as it was when the footprint was observed
+
+	rule = ruleidx_lookup(GPOINTER_TO_UINT(user_data), fp, &current);
+
+	if (rule == NULL)
+		return;
+
+	if (current) {
+		dprintf(logfd, "\t\t\t\t  rule: %s\n", rule);
+	} else {
+		dprintf(logfd, "\t\t\t\t  rule: %s (ruleset generation %u, now %u)\n",
+				rule, fp->gen, ruleidx_generation());
 	}
+}
 
-	switch (fp->type) {
-	case FOOTPRINT_TYPE_POLICY:
-		type = "policy";
-		break;
-	case FOOTPRINT_TYPE_RULE:
-		type = "rule";
-		break;
-	case FOOTPRINT_TYPE_RETURN:
-		type = "return";
-		break;
-	default:
-		type = "unknown";
-		break;
+void out_inherited(struct footprints *foots, uint8_t family)
+{
+	const gchar *source;
+	uint8_t sampled = 0, inherited = 0;
+	struct footprints *sibling = foots->sibling;
+
+	// flows not traced because of sampling (or inheritance) show the ones of their sibling
+
+	if (sibling == NULL || fppath_length(foots->path) > 0)
+		return;
+
+	foots->inherited ? inherited++ : sampled++;
+
+	// a sampled in flow might have inherited as well: siblings are always older flows
+
+	while (sibling->sibling != NULL && fppath_length(sibling->path) == 0) {
+		sibling->inherited ? inherited++ : sampled++;
+		sibling = sibling->sibling;
 	}
 
-	dprintf(logfd, "\t\t\t\ttable: %s, chain: %s, type: %s, position: %u\n",
-			table, fp->chain, type, fp->position);
-}
+	if (sampled && inherited)
+		source = "a sampled sibling and a recent trace of the same source network";
+	else if (inherited)
+		source = "a recent trace of the same source network";
+	else
+		source = "a sampled sibling";
 
-// ----
+	dprintf(logfd, "\t\t\t\t(inherited from %s)\n", source);
 
-void cleanfp(gpointer data)
-{
-	g_free(data);
+	fppath_foreach(sibling->path, out_footprint, GUINT_TO_POINTER(family));
 }
+
@@ -10,10 +10,16 @@
 
 /* footprints */
 
+struct fppath;
+struct natbase;
+
 struct footprints {
 	uint8_t traced;
 	uint8_t reply;
-	GSequence *fp;
+	uint8_t inherited;		// sibling adopted by trace inheritance (-I), not sampling
+	struct fppath *path;		// interned footprint set (fppath.c), NULL: empty
+	struct footprints *sibling;	// not traced (sampled out): inherit from
+	gpointer trace;			// trace window while being traced (iptables.c)
 };
 
 struct footprint {
@@ -36,19 +42,22 @@ struct footprint {
 	 */
 	char chain[20];
 	uint32_t position;
+	uint32_t gen;		// ruleset generation (ruleidx.c), 0: unknown
 };
 
 gint cmp_footprint(gconstpointer, gconstpointer, gpointer);
 
-gint add_tcpv4fp(struct in_addr, struct in_addr, uint16_t, uint16_t, uint8_t, struct footprint *);
-gint add_udpv4fp(struct in_addr, struct in_addr, uint16_t, uint16_t, uint8_t, struct footprint *);
-gint add_icmpv4fp(struct in_addr, struct in_addr, uint8_t, uint8_t, uint8_t, struct footprint *);
-gint add_tcpv6fp(struct in6_addr, struct in6_addr, uint16_t, uint16_t, uint8_t, struct footprint *);
-gint add_udpv6fp(struct in6_addr, struct in6_addr, uint16_t, uint16_t, uint8_t, struct footprint *);
-gint add_icmpv6fp(struct in6_addr, struct in6_addr, uint8_t, uint8_t, uint8_t, struct footprint *);
+gint add_tcpv4fp(struct in_addr, struct in_addr, uint16_t, uint16_t, uint8_t, uint8_t, struct natbase *, struct footprint *);
+gint add_udpv4fp(struct in_addr, struct in_addr, uint16_t, uint16_t, uint8_t, uint8_t, struct natbase *, struct footprint *);
+gint add_icmpv4fp(struct in_addr, struct in_addr, uint8_t, uint8_t, uint8_t, struct natbase *, struct footprint *);
+gint add_tcpv6fp(struct in6_addr, struct in6_addr, uint16_t, uint16_t, uint8_t, uint8_t, struct natbase *, struct footprint *);
+gint add_udpv6fp(struct in6_addr, struct in6_addr, uint16_t, uint16_t, uint8_t, uint8_t, struct natbase *, struct footprint *);
+gint add_icmpv6fp(struct in6_addr, struct in6_addr, uint8_t, uint8_t, uint8_t, struct natbase *, struct footprint *);
 
-void out_footprint(gpointer, gpointer);
+const gchar *footprint_table_str(uint8_t);
+const gchar *footprint_type_str(uint8_t);
 
-void cleanfp(gpointer);
+void out_footprint(gpointer, gpointer);
+void out_inherited(struct footprints *, uint8_t);
 
 #endif /* FOOTPRINT_H_ */
@@ -0,0 +1,42 @@
+/*
+ * (C) 2021 by Rafael David Tinoco <rafael.tinoco@ibm.com>
+ * (C) 2021 by Rafael David Tinoco <rafaeldtinoco@ubuntu.com>
+ */
+
+#include "footprint.h"
+
+/*
+ * Footprint table and rule type names, as shown in the reports: shared by
+ * conntracker (out_footprint) and ctmerge, which only links the snapshot
+ * code and can't pull footprint.c (and the flows tables) in.
+ */
+
+const gchar *footprint_table_str(uint8_t table)
+{
+	switch (table) {
+	case FOOTPRINT_TABLE_RAW:
+		return "raw";
+	case FOOTPRINT_TABLE_MANGLE:
+		return "mangle";
+	case FOOTPRINT_TABLE_NAT:
+		return "nat";
+	case FOOTPRINT_TABLE_FILTER:
+		return "filter";
+	}
+
+	return "unknown";
+}
+
+const gchar *footprint_type_str(uint8_t type)
+{
+	switch (type) {
+	case FOOTPRINT_TYPE_POLICY:
+		return "policy";
+	case FOOTPRINT_TYPE_RULE:
+		return "rule";
+	case FOOTPRINT_TYPE_RETURN:
+		return "return";
+	}
+
+	return "unknown";
+}
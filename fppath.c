@@ -0,0 +1,253 @@
+/*
+ * (C) 2021 by Rafael David Tinoco <rafael.tinoco@ibm.com>
+ * (C) 2021 by Rafael David Tinoco <rafaeldtinoco@ubuntu.com>
+ */
+
+#include "fppath.h"
+
+/*
+ * Footprint paths: almost every flow crosses the same few rules (e.g. filter
+ * INPUT policy + filter OUTPUT policy), so instead of each flow keeping its
+ * own copy of its footprints, footprint sets are interned:
+ *
+ * - a path is an immutable sorted array of footprints, hash-consed (there is
+ *   a single path for each distinct set) and refcounted (flows pointing to it)
+ * - the empty path is NULL: flows without footprints cost nothing
+ * - adding a footprint to a flow moves it to the extended path, found through
+ *   the transition cache of the path it is in (path + footprint -> path), so
+ *   the usual case is a single hash lookup and no allocation at all
+ *
+ * Transition caches hold references to the paths they lead to: a path lives
+ * as long as flows, or shorter paths leading to it, do.
+ */
+
+GHashTable *fppaths;		// interned paths
+GHashTable *fproot;		// transition cache of the empty path
+
+struct fppathstats {
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t shared;
+} fppathstats;
+
+// ----
+
+static guint hash_footprint(gconstpointer data)
+{
+	const struct footprint *fp = data;
+
+	return g_str_hash(fp->chain) ^ ((guint) fp->table << 24) ^ ((guint) fp->type << 16) ^ fp->position ^ (fp->gen << 8);
+}
+
+static gboolean equal_footprint(gconstpointer one, gconstpointer two)
+{
+	return cmp_footprint(one, two, NULL) == EQUAL;
+}
+
+static guint hash_fppath(gconstpointer data)
+{
+	return ((const struct fppath *) data)->hash;
+}
+
+static gboolean equal_fppath(gconstpointer ptr_one, gconstpointer ptr_two)
+{
+	guint i;
+	const struct fppath *one = ptr_one, *two = ptr_two;
+
+	if (one->hash != two->hash || one->length != two->length)
+		return FALSE;
+
+	for (i = 0; i < one->length; i++) {
+		if (cmp_footprint(&one->fps[i], &two->fps[i], NULL) != EQUAL)
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+static gpointer copy_footprint(struct footprint *fp)
+{
+	struct footprint *new = g_malloc(sizeof(struct footprint));
+
+	memcpy(new, fp, sizeof(struct footprint));
+
+	return new;
+}
+
+static void unref_fppath(gpointer data)
+{
+	fppath_unref(data);
+}
+
+static GHashTable *new_transitions(void)
+{
+	return g_hash_table_new_full(hash_footprint, equal_footprint, g_free, unref_fppath);
+}
+
+// ----
+
+static gint fppath_find(struct fppath *path, struct footprint *fp, guint *where)
+{
+	gint res;
+	guint low = 0, high = path ? path->length : 0, mid;
+
+	// binary search: position of the footprint (or where it would be)
+
+	while (low < high) {
+		mid = (low + high) / 2;
+		res = cmp_footprint(&path->fps[mid], fp, NULL);
+		if (res == EQUAL) {
+			*where = mid;
+			return SUCCESS;
+		}
+		if (res == LESS)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	*where = low;
+
+	return ERROR;
+}
+
+static struct fppath *fppath_extend(struct fppath *path, struct footprint *fp, guint where)
+{
+	guint i, length = path ? path->length : 0;
+	struct fppath *new, *found;
+
+	new = g_malloc0(sizeof(struct fppath));
+	new->length = length + 1;
+	new->fps = g_malloc(new->length * sizeof(struct footprint));
+
+	if (where > 0)
+		memcpy(new->fps, path->fps, where * sizeof(struct footprint));
+	memcpy(&new->fps[where], fp, sizeof(struct footprint));
+	if (where < length)
+		memcpy(&new->fps[where + 1], &path->fps[where], (length - where) * sizeof(struct footprint));
+
+	new->hash = 17;
+	for (i = 0; i < new->length; i++)
+		new->hash = new->hash * 31 + hash_footprint(&new->fps[i]);
+
+	// hash-consing: an identical path might exist (reached another way)
+
+	found = g_hash_table_lookup(fppaths, new);
+
+	if (found != NULL) {
+		g_free(new->fps);
+		g_free(new);
+		fppathstats.shared++;
+		return found;
+	}
+
+	g_hash_table_add(fppaths, new);
+
+	return new;
+}
+
+// ----
+
+struct fppath *fppath_add(struct fppath *path, struct footprint *fp, gboolean *added)
+{
+	guint where;
+	GHashTable *next;
+	struct fppath *to;
+
+	// footprint already in the path: flow stays where it is
+
+	*added = fppath_find(path, fp, &where) == ERROR;
+
+	if (!*added)
+		return path;
+
+	if (path == NULL)
+		next = fproot;
+	else if (path->next == NULL)
+		next = path->next = new_transitions();
+	else
+		next = path->next;
+
+	to = g_hash_table_lookup(next, fp);
+
+	if (to != NULL) {
+		fppathstats.hits++;
+	} else {
+		fppathstats.misses++;
+		to = fppath_extend(path, fp, where);
+		g_hash_table_insert(next, copy_footprint(fp), fppath_ref(to));
+	}
+
+	// the flow moves: a reference to the new path, one less to the old one
+
+	fppath_ref(to);
+	fppath_unref(path);
+
+	return to;
+}
+
+struct fppath *fppath_ref(struct fppath *path)
+{
+	if (path != NULL)
+		path->refs++;
+
+	return path;
+}
+
+void fppath_unref(struct fppath *path)
+{
+	if (path == NULL || --path->refs > 0)
+		return;
+
+	g_hash_table_remove(fppaths, path);
+
+	if (path->next != NULL)
+		g_hash_table_destroy(path->next);
+
+	g_free(path->fps);
+	g_free(path);
+}
+
+guint fppath_length(struct fppath *path)
+{
+	return path ? path->length : 0;
+}
+
+void fppath_foreach(struct fppath *path, GFunc func, gpointer data)
+{
+	guint i;
+
+	for (i = 0; i < fppath_length(path); i++)
+		func(&path->fps[i], data);
+}
+
+// ----
+
+void alloc_fppaths(void)
+{
+	fppaths = g_hash_table_new(hash_fppath, equal_fppath);
+	fproot = new_transitions();
+}
+
+void free_fppaths(void)
+{
+	// paths only referenced by transition caches go away with them
+
+	g_hash_table_destroy(fproot);
+	g_hash_table_destroy(fppaths);
+}
+
+void out_fppaths(void)
+{
+	guint footprints = 0;
+	GHashTableIter iter;
+	gpointer path;
+
+	g_hash_table_iter_init(&iter, fppaths);
+	while (g_hash_table_iter_next(&iter, &path, NULL))
+		footprints += ((struct fppath *) path)->length;
+
+	syslogwrap("Footprint paths: %u distinct (%u footprints), transitions: %" PRIu64 " cached, "
+		   "%" PRIu64 " new, %" PRIu64 " shared", g_hash_table_size(fppaths), footprints,
+		   fppathstats.hits, fppathstats.misses, fppathstats.shared);
+}
@@ -0,0 +1,33 @@
+/*
+ * (C) 2021 by Rafael David Tinoco <rafael.tinoco@ibm.com>
+ * (C) 2021 by Rafael David Tinoco <rafaeldtinoco@ubuntu.com>
+ */
+
+#ifndef FPPATH_H_
+#define FPPATH_H_
+
+#include "general.h"
+#include "footprint.h"
+
+/* footprint paths: sorted footprint sets, interned and shared by flows */
+
+struct fppath {
+	guint refs;
+	guint hash;
+	guint length;
+	struct footprint *fps;		// sorted by cmp_footprint()
+	GHashTable *next;		// transition cache: footprint -> extended path
+};
+
+struct fppath *fppath_add(struct fppath *, struct footprint *, gboolean *);
+struct fppath *fppath_ref(struct fppath *);
+void fppath_unref(struct fppath *);
+
+guint fppath_length(struct fppath *);
+void fppath_foreach(struct fppath *, GFunc, gpointer);
+
+void alloc_fppaths(void);
+void free_fppaths(void);
+void out_fppaths(void);
+
+#endif /* FPPATH_H_ */
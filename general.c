@@ -16,6 +16,60 @@ void debug(char *string)
 #endif
 }
 
+/*
+ * hash table keys (sampling classes, heavy hitters, NAT addresses...) are
+ * structs hashed and compared as raw bytes: callers memset the whole key,
+ * padding included, before filling it in
+ */
+
+guint hash_bytes(const void *data, gsize len)
+{
+	gsize i;
+	guint hash = 5381;
+	const uint8_t *bytes = data;
+
+	// djb2
+
+	for (i = 0; i < len; i++)
+		hash = hash * 33 + bytes[i];
+
+	return hash;
+}
+
+uint64_t hash_bytes64(const void *data, gsize len)
+{
+	gsize i;
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	const uint8_t *bytes = data;
+
+	// FNV-1a, then a final mix: all the bits depend on all the bytes
+
+	for (i = 0; i < len; i++)
+		hash = (hash ^ bytes[i]) * 0x100000001b3ULL;
+
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdULL;
+	hash ^= hash >> 33;
+
+	return hash;
+}
+
+/* keep the first <prefix> bits of an address (network order) */
+
+void mask_prefix(uint8_t *addr, guint len, guint prefix)
+{
+	guint i;
+
+	for (i = 0; i < len; i++) {
+		if (prefix >= 8) {
+			prefix -= 8;
+			continue;
+		}
+		addr[i] &= (uint8_t) (0xff << (8 - prefix));
+		prefix = 0;
+	}
+}
+
 int makemeadaemon(void)
 {
 	int fd;
@@ -15,6 +15,8 @@
 #include <syslog.h>
 #include <libgen.h>
 #include <stddef.h>
+#include <inttypes.h>
+#include <time.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <netinet/ip.h>
@@ -46,6 +48,10 @@ void endlog(void);
 void out_logfile(void);
 void debug(char *);
 
+guint hash_bytes(const void *, gsize);
+uint64_t hash_bytes64(const void *, gsize);
+void mask_prefix(uint8_t *, guint, guint);
+
 /* log functions */
 
 #define syslogwrap(...)										\
@@ -0,0 +1,367 @@
+/*
+ * (C) 2021 by Rafael David Tinoco <rafael.tinoco@ibm.com>
+ * (C) 2021 by Rafael David Tinoco <rafaeldtinoco@ubuntu.com>
+ */
+
+#include "hitters.h"
+#include "netns.h"
+
+extern int logfd;
+
+/*
+ * Heavy hitters (-k count[/prefix4[,prefix6]]): the busiest destinations,
+ * services and source networks right now, without keeping every flow.
+ *
+ * There is one Space-Saving summary per protocol (TCP, UDP, ICMP), dimension
+ * (destination address, destination port or ICMP type, source network) and
+ * metric (new connections and, with accounting, bytes), each one keeping at
+ * most <count> counters:
+ *
+ * - a key already counted just adds up
+ * - a new key takes the place of the smallest counter, inheriting its count
+ *   (the most it could have been missed by: shown as the error)
+ *
+ * Any key above total/<count> is guaranteed to be there. Counters are kept
+ * in a min-heap (the smallest one is the root) indexed by a hash table, so
+ * each event costs a few O(log count) updates and memory never grows.
+ *
+ * Fed by conntrack events (all namespaces), shown in the log file and by
+ * the "hitters" live query.
+ */
+
+#define HH_PREFIX4 24
+#define HH_PREFIX6 64
+
+enum {
+	HH_TCP = 0,
+	HH_UDP = 1,
+	HH_ICMP = 2,
+	HH_PROTOS = 3,
+};
+
+enum {
+	HH_DST = 0,
+	HH_DPORT = 1,
+	HH_SRCNET = 2,
+	HH_DIMS = 3,
+};
+
+enum {
+	HH_CONNS = 0,
+	HH_BYTES = 1,
+	HH_METRICS = 2,
+};
+
+struct hhkey {
+	uint8_t family;			// 0: ports (both families)
+	uint8_t pad;
+	uint16_t port;			// host order (ICMP: type)
+	union ctaddr addr;
+};
+
+struct hhslot {
+	struct hhkey key;
+	uint64_t count;
+	uint64_t error;
+	guint pos;			// position in the heap
+};
+
+struct hhtable {
+	struct hhslot *slots;
+	struct hhslot **heap;
+	guint len;
+	uint64_t total;
+	GHashTable *index;		// key -> slot
+};
+
+guint hitters;
+guint hitprefix4 = HH_PREFIX4;
+guint hitprefix6 = HH_PREFIX6;
+
+struct hhtable hhtables[HH_PROTOS][HH_DIMS][HH_METRICS];
+
+// ----
+
+gint set_hitters(char *optarg)
+{
+	gchar *prefix;
+
+	hitters = (guint) strtoul(optarg, &prefix, 10);
+
+	if (hitters == 0)
+		return ERROR;
+
+	if (*prefix == '/') {
+		hitprefix4 = (guint) strtoul(prefix + 1, &prefix, 10);
+		if (*prefix == ',')
+			hitprefix6 = (guint) strtoul(prefix + 1, &prefix, 10);
+	}
+
+	if (*prefix != '\0' || hitprefix4 > 32 || hitprefix6 > 128)
+		return ERROR;
+
+	return SUCCESS;
+}
+
+static guint hash_hhkey(gconstpointer data)
+{
+	return hash_bytes(data, sizeof(struct hhkey));
+}
+
+static gboolean equal_hhkey(gconstpointer one, gconstpointer two)
+{
+	return memcmp(one, two, sizeof(struct hhkey)) == 0;
+}
+
+// ----
+
+static void hh_swap(struct hhtable *t, guint one, guint two)
+{
+	struct hhslot *temp = t->heap[one];
+
+	t->heap[one] = t->heap[two];
+	t->heap[two] = temp;
+	t->heap[one]->pos = one;
+	t->heap[two]->pos = two;
+}
+
+static void hh_up(struct hhtable *t, guint pos)
+{
+	while (pos > 0 && t->heap[pos]->count < t->heap[(pos - 1) / 2]->count) {
+		hh_swap(t, pos, (pos - 1) / 2);
+		pos = (pos - 1) / 2;
+	}
+}
+
+static void hh_down(struct hhtable *t, guint pos)
+{
+	guint child;
+
+	while ((child = 2 * pos + 1) < t->len) {
+		if (child + 1 < t->len && t->heap[child + 1]->count < t->heap[child]->count)
+			child++;
+		if (t->heap[pos]->count <= t->heap[child]->count)
+			break;
+		hh_swap(t, pos, child);
+		pos = child;
+	}
+}
+
+static void hh_add(struct hhtable *t, struct hhkey *key, uint64_t weight)
+{
+	struct hhslot *slot;
+
+	if (weight == 0)
+		return;
+
+	t->total += weight;
+
+	// counted already: only grows (moves away from the root)
+
+	slot = g_hash_table_lookup(t->index, key);
+
+	if (slot != NULL) {
+		slot->count += weight;
+		hh_down(t, slot->pos);
+		return;
+	}
+
+	// room left: a new counter
+
+	if (t->len < hitters) {
+		slot = &t->slots[t->len];
+		slot->key = *key;
+		slot->count = weight;
+		slot->error = 0;
+		slot->pos = t->len;
+		t->heap[t->len++] = slot;
+		g_hash_table_insert(t->index, &slot->key, slot);
+		hh_up(t, slot->pos);
+		return;
+	}
+
+	// full: the smallest counter is taken over (its count becomes the error)
+
+	slot = t->heap[0];
+
+	g_hash_table_remove(t->index, &slot->key);
+
+	slot->key = *key;
+	slot->error = slot->count;
+	slot->count += weight;
+
+	g_hash_table_insert(t->index, &slot->key, slot);
+	hh_down(t, 0);
+}
+
+void hitters_add(struct ctevent *ev)
+{
+	guint p, d;
+	uint64_t conns, bytes;
+	struct hhkey keys[HH_DIMS];
+
+	if (hitters == 0)
+		return;
+
+	switch (ev->proto) {
+	case IPPROTO_TCP:
+		p = HH_TCP;
+		break;
+	case IPPROTO_UDP:
+		p = HH_UDP;
+		break;
+	default:
+		p = HH_ICMP;
+		break;
+	}
+
+	// new connections and, with accounting, bytes since the last event
+
+	conns = ev->type == NFCT_T_NEW ? 1 : 0;
+	bytes = ev->stats.bytes;
+
+	if (conns == 0 && bytes == 0)
+		return;
+
+	memset(keys, 0, sizeof(keys));
+
+	keys[HH_DST].family = ev->family;
+	keys[HH_DST].addr = ev->dst;
+
+	keys[HH_DPORT].port = p == HH_ICMP ? ev->itype : ntohs(ev->dport);
+
+	keys[HH_SRCNET].family = ev->family;
+	keys[HH_SRCNET].addr = ev->src;
+
+	if (ev->family == AF_INET)
+		mask_prefix((uint8_t *) &keys[HH_SRCNET].addr.ipv4, sizeof(struct in_addr), hitprefix4);
+	else
+		mask_prefix((uint8_t *) &keys[HH_SRCNET].addr.ipv6, sizeof(struct in6_addr), hitprefix6);
+
+	for (d = 0; d < HH_DIMS; d++) {
+		hh_add(&hhtables[p][d][HH_CONNS], &keys[d], conns);
+		hh_add(&hhtables[p][d][HH_BYTES], &keys[d], bytes);
+	}
+}
+
+// ----
+
+void alloc_hitters(void)
+{
+	guint p, d, m;
+	struct hhtable *t;
+
+	if (hitters == 0)
+		return;
+
+	for (p = 0; p < HH_PROTOS; p++) {
+		for (d = 0; d < HH_DIMS; d++) {
+			for (m = 0; m < HH_METRICS; m++) {
+				t = &hhtables[p][d][m];
+				t->slots = g_new0(struct hhslot, hitters);
+				t->heap = g_new0(struct hhslot *, hitters);
+				t->index = g_hash_table_new(hash_hhkey, equal_hhkey);
+			}
+		}
+	}
+}
+
+void free_hitters(void)
+{
+	guint p, d, m;
+	struct hhtable *t;
+
+	if (hitters == 0)
+		return;
+
+	for (p = 0; p < HH_PROTOS; p++) {
+		for (d = 0; d < HH_DIMS; d++) {
+			for (m = 0; m < HH_METRICS; m++) {
+				t = &hhtables[p][d][m];
+				g_hash_table_destroy(t->index);
+				g_free(t->heap);
+				g_free(t->slots);
+			}
+		}
+	}
+
+	memset(hhtables, 0, sizeof(hhtables));
+}
+
+static gint cmp_hhslot(gconstpointer ptr_one, gconstpointer ptr_two)
+{
+	const struct hhslot *one = *(struct hhslot **) ptr_one;
+	const struct hhslot *two = *(struct hhslot **) ptr_two;
+
+	if (one->count > two->count)
+		return LESS;
+	if (one->count < two->count)
+		return MORE;
+
+	return EQUAL;
+}
+
+static gchar *hhkey_str(guint p, guint d, struct hhkey *key)
+{
+	gchar addr[INET6_ADDRSTRLEN];
+
+	switch (d) {
+	case HH_DPORT:
+		if (p == HH_ICMP)
+			return g_strdup_printf("type %u", key->port);
+		return g_strdup_printf("port %u", key->port);
+	case HH_SRCNET:
+		inet_ntop(key->family, &key->addr, addr, sizeof(addr));
+		return g_strdup_printf("%s/%u", addr, key->family == AF_INET ? hitprefix4 : hitprefix6);
+	default:
+		inet_ntop(key->family, &key->addr, addr, sizeof(addr));
+		return g_strdup(addr);
+	}
+}
+
+void out_hitters(void)
+{
+	guint p, d, m, i;
+	gchar *str;
+	GPtrArray *sorted;
+	struct hhtable *t;
+	struct hhslot *slot;
+	struct netns *ns = netns_current();
+	const gchar *protos[HH_PROTOS] = { "TCP", "UDP", "ICMP" };
+	const gchar *dims[HH_DIMS] = { "destinations", "services", "source networks" };
+	const gchar *metrics[HH_METRICS] = { "connections", "bytes" };
+
+	// shared by all namespaces: shown once
+
+	if (hitters == 0 || (ns != NULL && ns->name != NULL))
+		return;
+
+	dprintf(logfd, "Heavy hitters (top %u, count +- error):\n", hitters);
+
+	for (p = 0; p < HH_PROTOS; p++) {
+		for (d = 0; d < HH_DIMS; d++) {
+			for (m = 0; m < HH_METRICS; m++) {
+				t = &hhtables[p][d][m];
+				if (t->len == 0)
+					continue;
+
+				dprintf(logfd, " %s %s by %s (total: %" PRIu64 ")\n",
+						protos[p], dims[d], metrics[m], t->total);
+
+				sorted = g_ptr_array_sized_new(t->len);
+				for (i = 0; i < t->len; i++)
+					g_ptr_array_add(sorted, t->heap[i]);
+				g_ptr_array_sort(sorted, cmp_hhslot);
+
+				for (i = 0; i < sorted->len; i++) {
+					slot = g_ptr_array_index(sorted, i);
+					str = hhkey_str(p, d, &slot->key);
+					dprintf(logfd, "\t%s: %" PRIu64 " +- %" PRIu64 "\n", str, slot->count, slot->error);
+					g_free(str);
+				}
+
+				g_ptr_array_free(sorted, TRUE);
+			}
+		}
+	}
+}
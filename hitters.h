@@ -0,0 +1,22 @@
+/*
+ * (C) 2021 by Rafael David Tinoco <rafael.tinoco@ibm.com>
+ * (C) 2021 by Rafael David Tinoco <rafaeldtinoco@ubuntu.com>
+ */
+
+#ifndef HITTERS_H_
+#define HITTERS_H_
+
+#include "general.h"
+#include "ctevent.h"
+
+extern guint hitters;
+
+gint set_hitters(char *);
+
+void hitters_add(struct ctevent *);
+
+void alloc_hitters(void);
+void free_hitters(void);
+void out_hitters(void);
+
+#endif /* HITTERS_H_ */
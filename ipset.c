@@ -0,0 +1,197 @@
+/*
+ * (C) 2021 by Rafael David Tinoco <rafael.tinoco@ibm.com>
+ * (C) 2021 by Rafael David Tinoco <rafaeldtinoco@ubuntu.com>
+ */
+
+#include "ipset.h"
+#include "event.h"
+
+/*
+ * ipset members through netlink: each traced IPv6 flow (and IPv4 flow, with
+ * -m) becomes one member of a set (with a timeout) instead of 2 new TRACE
+ * rules. Members are queued into a single buffer and sent, all at once, when
+ * the main loop becomes idle (or the buffer is full), so a burst of new flows
+ * costs one sendto() and no forks. Members expire by themselves (set timeout)
+ * but can be removed sooner, the same way, when a trace window ends early.
+ */
+
+#define IPSET_BATCH_SIZE MNL_SOCKET_BUFFER_SIZE
+
+struct mnl_socket *ipsetnl;
+struct mnl_nlmsg_batch *ipsetbatch;
+char ipsetbuf[IPSET_BATCH_SIZE * 2];
+guint ipsetidle;
+
+// ----
+
+static void ipset_drain(void)
+{
+	char buf[MNL_SOCKET_BUFFER_SIZE];
+
+	// discard errors (e.g. set not there): nobody is waiting for them
+
+	while (recv(mnl_socket_get_fd(ipsetnl), buf, sizeof(buf), MSG_DONTWAIT) > 0)
+		;
+}
+
+static void ipset_send(void)
+{
+	if (ipsetbatch == NULL || mnl_nlmsg_batch_is_empty(ipsetbatch))
+		return;
+
+	if (ipsetnl == NULL) {
+		mnl_nlmsg_batch_reset(ipsetbatch);
+		return;
+	}
+
+	if (mnl_socket_sendto(ipsetnl, mnl_nlmsg_batch_head(ipsetbatch),
+			      mnl_nlmsg_batch_size(ipsetbatch)) < 0)
+		debug("could not send ipset members");
+
+	mnl_nlmsg_batch_reset(ipsetbatch);
+
+	ipset_drain();
+}
+
+static gboolean ipset_send_wrap(gpointer data)
+{
+	ipset_send();
+
+	ipsetidle = 0;
+
+	// one time exec: disable future idle callbacks
+
+	return FALSE;
+}
+
+static void ipset_put_ip(struct nlmsghdr *nlh, uint16_t type, uint8_t family, const void *addr)
+{
+	struct nlattr *nest;
+
+	nest = mnl_attr_nest_start(nlh, type | NLA_F_NESTED);
+
+	if (family == AF_INET)
+		mnl_attr_put(nlh, IPSET_ATTR_IPADDR_IPV4 | NLA_F_NET_BYTEORDER, sizeof(struct in_addr), addr);
+	else
+		mnl_attr_put(nlh, IPSET_ATTR_IPADDR_IPV6 | NLA_F_NET_BYTEORDER, sizeof(struct in6_addr), addr);
+
+	mnl_attr_nest_end(nlh, nest);
+}
+
+// ----
+
+static gint oper_member(uint16_t cmd, uint8_t family, const char *set, const void *src, const void *dst,
+			uint8_t proto, uint16_t port)
+{
+	struct nlmsghdr *nlh;
+	struct nfgenmsg *nfg;
+	struct nlattr *data;
+
+	if (ipsetnl == NULL)
+		return ERROR;
+
+	nlh = mnl_nlmsg_put_header(mnl_nlmsg_batch_current(ipsetbatch));
+	nlh->nlmsg_type = (NFNL_SUBSYS_IPSET << 8) | cmd;
+	nlh->nlmsg_flags = NLM_F_REQUEST;
+
+	nfg = mnl_nlmsg_put_extra_header(nlh, sizeof(struct nfgenmsg));
+	nfg->nfgen_family = family;
+	nfg->version = NFNETLINK_V0;
+	nfg->res_id = 0;
+
+	mnl_attr_put_u8(nlh, IPSET_ATTR_PROTOCOL, IPSET_PROTOCOL);
+	mnl_attr_put_strz(nlh, IPSET_ATTR_SETNAME, set);
+
+	// member: src[,proto:port],dst (no NLM_F_EXCL: re-adding, or deleting, is fine)
+
+	data = mnl_attr_nest_start(nlh, IPSET_ATTR_DATA | NLA_F_NESTED);
+
+	ipset_put_ip(nlh, IPSET_ATTR_IP, family, src);
+
+	if (proto != 0) {
+		mnl_attr_put_u16(nlh, IPSET_ATTR_PORT | NLA_F_NET_BYTEORDER, port);
+		mnl_attr_put_u8(nlh, IPSET_ATTR_PROTO, proto);
+	}
+
+	ipset_put_ip(nlh, IPSET_ATTR_IP2, family, dst);
+
+	mnl_attr_nest_end(nlh, data);
+
+	// buffer full: send what fits (the new member is kept for next time)
+
+	if (!mnl_nlmsg_batch_next(ipsetbatch))
+		ipset_send();
+
+	if (ipsetidle == 0)
+		ipsetidle = ev_add_idle(ipset_send_wrap, NULL);
+
+	return SUCCESS;
+}
+
+gint add_ipset4(const char *set, struct in_addr *src, struct in_addr *dst, uint8_t proto, uint16_t port)
+{
+	return oper_member(IPSET_CMD_ADD, AF_INET, set, src, dst, proto, port);
+}
+
+gint del_ipset4(const char *set, struct in_addr *src, struct in_addr *dst, uint8_t proto, uint16_t port)
+{
+	return oper_member(IPSET_CMD_DEL, AF_INET, set, src, dst, proto, port);
+}
+
+gint add_ipset6(const char *set, struct in6_addr *src, struct in6_addr *dst, uint8_t proto, uint16_t port)
+{
+	return oper_member(IPSET_CMD_ADD, AF_INET6, set, src, dst, proto, port);
+}
+
+gint del_ipset6(const char *set, struct in6_addr *src, struct in6_addr *dst, uint8_t proto, uint16_t port)
+{
+	return oper_member(IPSET_CMD_DEL, AF_INET6, set, src, dst, proto, port);
+}
+
+// ----
+
+struct mnl_socket *ipset_open(void)
+{
+	struct mnl_socket *nl;
+
+	// sets are per network namespace: so are the sockets to reach them
+
+	nl = mnl_socket_open(NETLINK_NETFILTER);
+	if (nl == NULL)
+		return NULL;
+
+	if (mnl_socket_bind(nl, 0, MNL_SOCKET_AUTOPID) < 0) {
+		mnl_socket_close(nl);
+		return NULL;
+	}
+
+	if (ipsetbatch == NULL)
+		ipsetbatch = mnl_nlmsg_batch_start(ipsetbuf, IPSET_BATCH_SIZE);
+
+	return nl;
+}
+
+void ipset_use(struct mnl_socket *nl)
+{
+	if (nl == ipsetnl)
+		return;
+
+	// queued members belong to the previous socket (namespace)
+
+	ipset_send();
+
+	ipsetnl = nl;
+}
+
+void ipset_close(struct mnl_socket *nl)
+{
+	if (nl == NULL)
+		return;
+
+	if (nl == ipsetnl) {
+		ipset_send();
+		ipsetnl = NULL;
+	}
+
+	mnl_socket_close(nl);
+}
@@ -0,0 +1,32 @@
+/*
+ * (C) 2021 by Rafael David Tinoco <rafael.tinoco@ibm.com>
+ * (C) 2021 by Rafael David Tinoco <rafaeldtinoco@ubuntu.com>
+ */
+
+#ifndef IPSET_H_
+#define IPSET_H_
+
+#include "general.h"
+
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netfilter/ipset/ip_set.h>
+
+#include <libmnl/libmnl.h>
+
+// sets matched by the static TRACE rules (see iptables.c)
+
+#define IPSET_TRACE4 "conntracker4"
+#define IPSET_TRACE4_HOSTS "conntracker4h"
+#define IPSET_TRACE6 "conntracker6"
+#define IPSET_TRACE6_HOSTS "conntracker6h"
+
+struct mnl_socket *ipset_open(void);
+void ipset_use(struct mnl_socket *);
+void ipset_close(struct mnl_socket *);
+
+gint add_ipset4(const char *, struct in_addr *, struct in_addr *, uint8_t, uint16_t);
+gint del_ipset4(const char *, struct in_addr *, struct in_addr *, uint8_t, uint16_t);
+gint add_ipset6(const char *, struct in6_addr *, struct in6_addr *, uint8_t, uint16_t);
+gint del_ipset6(const char *, struct in6_addr *, struct in6_addr *, uint8_t, uint16_t);
+
+#endif /* IPSET_H_ */
@@ -5,6 +5,12 @@
 
 #include "iptables.h"
 #include "flows.h"
+#include "ports.h"
+#include "ipset.h"
+#include "netns.h"
+#include "sample.h"
+#include "event.h"
+#include "tracesched.h"
 
 /* seqs stored in memory */
 
@@ -86,7 +92,7 @@ gint iptables_flush(char *bin)
 	memset(cmd, 0, 1024);
 	snprintf(cmd, 1024, "%s %s", bin, flushraw);
 
-	return system(cmd);
+	return netns_system(cmd);
 }
 
 gint iptables4_flush(void)
@@ -109,6 +115,112 @@ gint iptables_cleanup(void)
 	return ret;
 }
 
+/*
+ * IPv6 flows are not traced by ad-hoc rules: 2 static TRACE rules per chain
+ * match the members of 2 sets (with a 30 seconds timeout each member) and
+ * tracing a flow is adding a member to one of them (ipset.c):
+ *
+ *   conntracker6  (hash:ip,port,ip) src,proto:dport,dst (TCP, UDP, ICMPv6)
+ *   conntracker6h (hash:ip,ip)      src,dst (folded destination ports)
+ *
+ * The cost of tracing a flow is constant, no matter how many flows are being
+ * traced, and there are no forks after the start.
+ *
+ * IPv4 flows are traced the same way (conntracker4 and conntracker4h sets) in
+ * the static rules mode (-m): the ruleset never changes at runtime and trace
+ * windows are only member additions and removals, batched in netlink messages.
+ *
+ * Note: marking the conntrack entries (and matching the mark) can't be used
+ * instead, raw table hooks run before conntrack attaches the entry to packets.
+ */
+
+char *ipsetbin = "/sbin/ipset";
+char *ipsetopts = "timeout 30 -exist";
+
+gboolean tracesets;
+
+gint oper_ipset(char *mid, char *set, char *type)
+{
+	gchar cmd[1024];
+
+	memset(cmd, 0, 1024);
+	snprintf(cmd, 1024, "%s %s %s %s", ipsetbin, mid, set, type);
+
+	return netns_system(cmd);
+}
+
+gint oper_trace_set(char *bin, char *mid, char *set, char *flags)
+{
+	gchar cmd[1024];
+
+	memset(cmd, 0, 1024);
+	snprintf(cmd, 1024, "%s %s -t raw -m set --match-set %s %s -m comment --comment %s -j TRACE",
+		 bin, mid, set, flags, TRACE_COMMENT);
+
+	return netns_system(cmd);
+}
+
+gint add_trace_sets(char *bin, char *family, char *set, char *hosts)
+{
+	gint ret = 0;
+	gchar *type;
+
+	type = g_strdup_printf("hash:ip,port,ip family %s %s", family, ipsetopts);
+	ret |= oper_ipset("create", set, type);
+	g_free(type);
+
+	type = g_strdup_printf("hash:ip,ip family %s %s", family, ipsetopts);
+	ret |= oper_ipset("create", hosts, type);
+	g_free(type);
+
+	ret |= oper_ipset("flush", set, "");
+	ret |= oper_ipset("flush", hosts, "");
+
+	ret |= oper_trace_set(bin, "-A OUTPUT", set, "src,dst,dst");
+	ret |= oper_trace_set(bin, "-A PREROUTING", set, "src,dst,dst");
+	ret |= oper_trace_set(bin, "-A OUTPUT", hosts, "src,dst");
+	ret |= oper_trace_set(bin, "-A PREROUTING", hosts, "src,dst");
+
+	return ret;
+}
+
+gint del_trace_sets(char *bin, char *set, char *hosts)
+{
+	gint ret = 0;
+
+	ret |= oper_trace_set(bin, "-D OUTPUT", set, "src,dst,dst");
+	ret |= oper_trace_set(bin, "-D PREROUTING", set, "src,dst,dst");
+	ret |= oper_trace_set(bin, "-D OUTPUT", hosts, "src,dst");
+	ret |= oper_trace_set(bin, "-D PREROUTING", hosts, "src,dst");
+
+	ret |= oper_ipset("destroy", set, "");
+	ret |= oper_ipset("destroy", hosts, "");
+
+	return ret;
+}
+
+gint add_trace_ipv4(void)
+{
+	return add_trace_sets(ipv4bin, "inet", IPSET_TRACE4, IPSET_TRACE4_HOSTS);
+}
+
+gint del_trace_ipv4(void)
+{
+	return del_trace_sets(ipv4bin, IPSET_TRACE4, IPSET_TRACE4_HOSTS);
+}
+
+gint add_trace_ipv6(void)
+{
+	return add_trace_sets(ipv6bin, "inet6", IPSET_TRACE6, IPSET_TRACE6_HOSTS);
+}
+
+gint del_trace_ipv6(void)
+{
+	return del_trace_sets(ipv6bin, IPSET_TRACE6, IPSET_TRACE6_HOSTS);
+}
+
+// ----
+
 gint oper_conntrack(char *bin, char *mid)
 {
 	gchar cmd[1024];
@@ -116,7 +228,7 @@ gint oper_conntrack(char *bin, char *mid)
 	memset(cmd, 0, 1024);
 	snprintf(cmd, 1024, "%s %s %s", bin, mid, ctsufix);
 
-	return system(cmd);
+	return netns_system(cmd);
 }
 
 gint add_conntrack_ipv4(void)
@@ -126,6 +238,9 @@ gint add_conntrack_ipv4(void)
 	ret |= oper_conntrack(ipv4bin, "-I OUTPUT 1");
 	ret |= oper_conntrack(ipv4bin, "-I PREROUTING 1");
 
+	if (tracesets)
+		ret |= add_trace_ipv4();
+
 	return ret;
 }
 
@@ -135,6 +250,7 @@ gint add_conntrack_ipv6(void)
 
 	ret |= oper_conntrack(ipv6bin, "-I OUTPUT 1");
 	ret |= oper_conntrack(ipv6bin, "-I PREROUTING 1");
+	ret |= add_trace_ipv6();
 
 	return ret;
 }
@@ -156,6 +272,9 @@ gint del_conntrack_ipv4(void)
 	ret |= oper_conntrack(ipv4bin, "-D OUTPUT");
 	ret |= oper_conntrack(ipv4bin, "-D PREROUTING");
 
+	if (tracesets)
+		ret |= del_trace_ipv4();
+
 	return ret;
 }
 
@@ -165,6 +284,7 @@ gint del_conntrack_ipv6(void)
 
 	ret |= oper_conntrack(ipv6bin, "-D OUTPUT");
 	ret |= oper_conntrack(ipv6bin, "-D PREROUTING");
+	ret |= del_trace_ipv6();
 
 	return ret;
 }
@@ -179,6 +299,10 @@ gint del_conntrack(void)
 	return ret;
 }
 
+/* icmp type and code as a port (how ipset and sampling classes use them) */
+
+#define ICMP_PORT(base) htons((uint16_t) (base).type << 8 | (base).code)
+
 gint oper_trace(gchar *bin, gchar *mid, gchar *proto, gchar *src, gchar *dst, uint16_t dport)
 {
 	gchar cmd[1024];
@@ -186,24 +310,26 @@ gint oper_trace(gchar *bin, gchar *mid, gchar *proto, gchar *src, gchar *dst, ui
 	memset(cmd, 0, 1024);
 
 	if (dport != 0) {
-		snprintf(cmd, 1024, "%s %s -t raw -p %s -s %s -d %s --dport %u -j TRACE",
+		snprintf(cmd, 1024, "%s %s -t raw -p %s -s %s -d %s --dport %u -m comment --comment %s -j TRACE",
 			bin,
 			mid,
 			proto,
 			src,
 			dst,
-			dport);
+			dport,
+			TRACE_COMMENT);
 	} else {
 
-		snprintf(cmd, 1024, "%s %s -t raw -p %s -s %s -d %s -j TRACE",
+		snprintf(cmd, 1024, "%s %s -t raw -p %s -s %s -d %s -m comment --comment %s -j TRACE",
 			bin,
 			mid,
 			proto,
 			src,
-			dst);
+			dst,
+			TRACE_COMMENT);
 	}
 
-	return system(cmd);
+	return netns_system(cmd);
 }
 
 gint oper_trace_tcpv4flow(gchar *bin, gchar *mid, struct tcpv4flow *flow)
@@ -214,6 +340,11 @@ gint oper_trace_tcpv4flow(gchar *bin, gchar *mid, struct tcpv4flow *flow)
 	gchar *dst = ipv4_str(&flow->addrs.dst);
 	uint16_t dport = ntohs(flow->base.dst);
 
+	// folded (client side) ports can't be matched
+
+	if (flow->base.folded & FOLDED_DST)
+		dport = 0;
+
 	ret |= oper_trace(ipv4bin, mid, "tcp", src, dst, dport);
 
 	g_free(src);
@@ -230,6 +361,11 @@ gint oper_trace_udpv4flow(gchar *bin, gchar *mid, struct udpv4flow *flow)
 	gchar *dst = ipv4_str(&flow->addrs.dst);
 	uint16_t dport = ntohs(flow->base.dst);
 
+	// folded (client side) ports can't be matched
+
+	if (flow->base.folded & FOLDED_DST)
+		dport = 0;
+
 	ret |= oper_trace(ipv4bin, mid, "udp", src, dst, dport);
 
 	g_free(src);
@@ -253,28 +389,19 @@ gint oper_trace_icmpv4flow(gchar *bin, gchar *mid, struct icmpv4flow *flow)
 	return ret;
 }
 
-gint oper_trace_tcpv6flow(gchar *bin, gchar *mid, struct tcpv6flow *flow)
-{
-	gint ret = 0;
-
-	gchar *src = ipv6_str(&flow->addrs.src);
-	gchar *dst = ipv6_str(&flow->addrs.dst);
-	uint16_t dport = ntohs(flow->base.dst);
-
-	ret |= oper_trace(ipv6bin, mid, "tcp", src, dst, dport);
-
-	g_free(src);
-	g_free(dst);
-
-	return ret;
-}
-
 // ----
 
 gint add_trace_tcpv4flow(struct tcpv4flow *flow)
 {
 	gint ret = 0;
 
+	// static rules mode: a set member instead of 2 rules
+
+	if (tracesets && (flow->base.folded & FOLDED_DST))
+		return add_ipset4(IPSET_TRACE4_HOSTS, &flow->addrs.src, &flow->addrs.dst, 0, 0);
+	if (tracesets)
+		return add_ipset4(IPSET_TRACE4, &flow->addrs.src, &flow->addrs.dst, IPPROTO_TCP, flow->base.dst);
+
 	ret |= oper_trace_tcpv4flow(ipv4bin, "-A OUTPUT", flow);
 	ret |= oper_trace_tcpv4flow(ipv4bin, "-A PREROUTING", flow);
 
@@ -285,6 +412,11 @@ gint add_trace_udpv4flow(struct udpv4flow *flow)
 {
 	gint ret = 0;
 
+	if (tracesets && (flow->base.folded & FOLDED_DST))
+		return add_ipset4(IPSET_TRACE4_HOSTS, &flow->addrs.src, &flow->addrs.dst, 0, 0);
+	if (tracesets)
+		return add_ipset4(IPSET_TRACE4, &flow->addrs.src, &flow->addrs.dst, IPPROTO_UDP, flow->base.dst);
+
 	ret |= oper_trace_udpv4flow(ipv4bin, "-A OUTPUT", flow);
 	ret |= oper_trace_udpv4flow(ipv4bin, "-A PREROUTING", flow);
 
@@ -295,28 +427,26 @@ gint add_trace_icmpv4flow(struct icmpv4flow *flow)
 {
 	gint ret = 0;
 
+	if (tracesets)
+		return add_ipset4(IPSET_TRACE4, &flow->addrs.src, &flow->addrs.dst, IPPROTO_ICMP, ICMP_PORT(flow->base));
+
 	ret |= oper_trace_icmpv4flow(ipv4bin, "-A OUTPUT", flow);
 	ret |= oper_trace_icmpv4flow(ipv4bin, "-A PREROUTING", flow);
 
 	return ret;
 }
 
-gint add_trace_tcpv6flow(struct tcpv6flow *flow)
-{
-	gint ret = 0;
-
-	ret |= oper_trace_tcpv6flow(ipv6bin, "-A OUTPUT", flow);
-	ret |= oper_trace_tcpv6flow(ipv6bin, "-A PREROUTING", flow);
-
-	return ret;
-}
-
 // ----
 
 gint del_trace_tcpv4flow(struct tcpv4flow *flow)
 {
 	gint ret = 0;
 
+	if (tracesets && (flow->base.folded & FOLDED_DST))
+		return del_ipset4(IPSET_TRACE4_HOSTS, &flow->addrs.src, &flow->addrs.dst, 0, 0);
+	if (tracesets)
+		return del_ipset4(IPSET_TRACE4, &flow->addrs.src, &flow->addrs.dst, IPPROTO_TCP, flow->base.dst);
+
 	ret |= oper_trace_tcpv4flow(ipv4bin, "-D OUTPUT", flow);
 	ret |= oper_trace_tcpv4flow(ipv4bin, "-D PREROUTING", flow);
 
@@ -327,6 +457,11 @@ gint del_trace_udpv4flow(struct udpv4flow *flow)
 {
 	gint ret = 0;
 
+	if (tracesets && (flow->base.folded & FOLDED_DST))
+		return del_ipset4(IPSET_TRACE4_HOSTS, &flow->addrs.src, &flow->addrs.dst, 0, 0);
+	if (tracesets)
+		return del_ipset4(IPSET_TRACE4, &flow->addrs.src, &flow->addrs.dst, IPPROTO_UDP, flow->base.dst);
+
 	ret |= oper_trace_udpv4flow(ipv4bin, "-D OUTPUT", flow);
 	ret |= oper_trace_udpv4flow(ipv4bin, "-D PREROUTING", flow);
 
@@ -337,62 +472,353 @@ gint del_trace_icmpv4flow(struct icmpv4flow *flow)
 {
 	gint ret = 0;
 
+	if (tracesets)
+		return del_ipset4(IPSET_TRACE4, &flow->addrs.src, &flow->addrs.dst, IPPROTO_ICMP, ICMP_PORT(flow->base));
+
 	ret |= oper_trace_icmpv4flow(ipv4bin, "-D OUTPUT", flow);
 	ret |= oper_trace_icmpv4flow(ipv4bin, "-D PREROUTING", flow);
 
 	return ret;
 }
 
+// ----
+
+gint add_trace_tcpv6flow(struct tcpv6flow *flow)
+{
+	// folded (client side) ports can't be matched
+
+	if ((flow->base.folded & FOLDED_DST))
+		return add_ipset6(IPSET_TRACE6_HOSTS, &flow->addrs.src, &flow->addrs.dst, 0, 0);
+
+	return add_ipset6(IPSET_TRACE6, &flow->addrs.src, &flow->addrs.dst, IPPROTO_TCP, flow->base.dst);
+}
+
+gint add_trace_udpv6flow(struct udpv6flow *flow)
+{
+	if ((flow->base.folded & FOLDED_DST))
+		return add_ipset6(IPSET_TRACE6_HOSTS, &flow->addrs.src, &flow->addrs.dst, 0, 0);
+
+	return add_ipset6(IPSET_TRACE6, &flow->addrs.src, &flow->addrs.dst, IPPROTO_UDP, flow->base.dst);
+}
+
+gint add_trace_icmpv6flow(struct icmpv6flow *flow)
+{
+	// ipset keeps ICMPv6 type and code as the port
+
+	return add_ipset6(IPSET_TRACE6, &flow->addrs.src, &flow->addrs.dst, IPPROTO_ICMPV6, ICMP_PORT(flow->base));
+}
+
+// ----
+
 gint del_trace_tcpv6flow(struct tcpv6flow *flow)
 {
-	gint ret = 0;
+	if ((flow->base.folded & FOLDED_DST))
+		return del_ipset6(IPSET_TRACE6_HOSTS, &flow->addrs.src, &flow->addrs.dst, 0, 0);
 
-	ret |= oper_trace_tcpv6flow(ipv6bin, "-D OUTPUT", flow);
-	ret |= oper_trace_tcpv6flow(ipv6bin, "-D PREROUTING", flow);
+	return del_ipset6(IPSET_TRACE6, &flow->addrs.src, &flow->addrs.dst, IPPROTO_TCP, flow->base.dst);
+}
 
-	return ret;
+gint del_trace_udpv6flow(struct udpv6flow *flow)
+{
+	if ((flow->base.folded & FOLDED_DST))
+		return del_ipset6(IPSET_TRACE6_HOSTS, &flow->addrs.src, &flow->addrs.dst, 0, 0);
+
+	return del_ipset6(IPSET_TRACE6, &flow->addrs.src, &flow->addrs.dst, IPPROTO_UDP, flow->base.dst);
+}
+
+gint del_trace_icmpv6flow(struct icmpv6flow *flow)
+{
+	return del_ipset6(IPSET_TRACE6, &flow->addrs.src, &flow->addrs.dst, IPPROTO_ICMPV6, ICMP_PORT(flow->base));
 }
 
 // ----
 
-gint del_trace_tcpv4flow_wrap(gpointer ptr)
+gint del_trace_tcpv4flow_wrap(gpointer flow)
+{
+	return del_trace_tcpv4flow(flow);
+}
+
+gint del_trace_udpv4flow_wrap(gpointer flow)
+{
+	return del_trace_udpv4flow(flow);
+}
+
+gint del_trace_icmpv4flow_wrap(gpointer flow)
 {
-	struct tcpv4flow *flow = ptr;
+	return del_trace_icmpv4flow(flow);
+}
 
-	del_trace_tcpv4flow(flow);
+gint del_trace_tcpv6flow_wrap(gpointer flow)
+{
+	return del_trace_tcpv6flow(flow);
+}
+
+gint del_trace_udpv6flow_wrap(gpointer flow)
+{
+	return del_trace_udpv6flow(flow);
+}
+
+gint del_trace_icmpv6flow_wrap(gpointer flow)
+{
+	return del_trace_icmpv6flow(flow);
+}
+
+// ----
+
+/*
+ * Trace windows: the trace rules (IPv4) or set members (IPv6) of a flow are
+ * removed as soon as one of these happens:
+ *
+ * - footprints were recorded, the flow is confirmed and no new footprint
+ *   showed up for the last -Q msecs (the path is fully observed)
+ * - -L trace messages (NFLOG deliveries) were received for the flow
+ * - TRACE_WINDOW secs went by (upper bound, the only one by default)
+ *
+ * Note: trace rules match the original direction of a flow only, the reply
+ * direction is known to be observed through conntrack (flow got confirmed).
+ *
+ * Removal happens in the namespace the flow belongs to.
+ */
+
+#define TRACE_WINDOW 30
+
+guint tracequiet;
+guint tracelimit;
+
+struct nstrace {
+	struct netns *ns;
+	gpointer flow;
+	struct footprints *foots;
+	gint (*del)(gpointer);
+	uint8_t expires;	// removed by the kernel at the upper bound (set timeout)
+	guint packets;		// trace messages received
+	guint newfps;		// new footprints recorded
+	gint64 start;
+	gint64 lastfp;
+	guint timeoutid;
+	guint quietid;
+};
+
+struct tracestats {
+	uint64_t quiet;
+	uint64_t limit;
+	uint64_t timeout;
+	gint64 usecs;
+} tracestats;
+
+gint set_tracequiet(char *optarg)
+{
+	gchar *end;
+
+	tracequiet = (guint) strtoul(optarg, &end, 10);
+
+	if (tracequiet == 0 || *end != '\0')
+		return ERROR;
+
+	return SUCCESS;
+}
+
+gint set_tracelimit(char *optarg)
+{
+	gchar *end;
+
+	tracelimit = (guint) strtoul(optarg, &end, 10);
+
+	if (tracelimit == 0 || *end != '\0')
+		return ERROR;
+
+	return SUCCESS;
+}
+
+static void trace_stop(struct nstrace *trace, gboolean timedout)
+{
+	struct netns *prev = netns_current();
+
+	if (trace->timeoutid != 0)
+		ev_remove(trace->timeoutid);
+	if (trace->quietid != 0)
+		ev_remove(trace->quietid);
+
+	if (!timedout || !trace->expires) {
+		netns_enter(trace->ns);
+		trace->del(trace->flow);
+		netns_enter(prev);
+	}
+
+	tracestats.usecs += g_get_monotonic_time() - trace->start;
+
+	trace->foots->trace = NULL;
+	g_free(trace);
+
+	sched_done();
+}
+
+static gboolean trace_timeout(gpointer data)
+{
+	struct nstrace *trace = data;
 
 	// one time exec: disable future timeout callbacks
 
+	trace->timeoutid = 0;
+	tracestats.timeout++;
+
+	trace_stop(trace, TRUE);
+
 	return FALSE;
 }
 
-gint del_trace_udpv4flow_wrap(gpointer ptr)
+static gboolean trace_quiet(gpointer data)
 {
-	struct udpv4flow *flow = ptr;
+	struct nstrace *trace = data;
+	gint64 quiet = g_get_monotonic_time() - trace->lastfp;
 
-	del_trace_udpv4flow(flow);
+	if (trace->newfps == 0 || trace->foots->reply == 0 || quiet < (gint64) tracequiet * 1000)
+		return TRUE;
+
+	trace->quietid = 0;
+	tracestats.quiet++;
+
+	trace_stop(trace, FALSE);
 
 	return FALSE;
 }
 
-gint del_trace_icmpv4flow_wrap(gpointer ptr)
+void trace_observed(struct footprints *foots, gboolean newfp)
 {
-	struct icmpv4flow *flow = ptr;
+	struct nstrace *trace = foots->trace;
 
-	del_trace_icmpv4flow(flow);
+	if (trace == NULL)
+		return;
 
-	return FALSE;
+	trace->packets++;
+
+	if (newfp) {
+		trace->newfps++;
+		trace->lastfp = g_get_monotonic_time();
+	}
+
+	if (tracelimit != 0 && trace->packets >= tracelimit) {
+		tracestats.limit++;
+		trace_stop(trace, FALSE);
+	}
 }
 
-gint del_trace_tcpv6flow_wrap(gpointer ptr)
+static gboolean trace_expired(gpointer data)
 {
-	struct tcpv6flow *flow = ptr;
+	// a set member without a window expired: give its scheduler slot back
 
-	del_trace_tcpv6flow(flow);
+	sched_done();
 
 	return FALSE;
 }
 
+static void trace_window(gpointer flow, struct footprints *foots, gint (*del)(gpointer), uint8_t expires)
+{
+	struct nstrace *trace;
+
+	// set members expire by themselves: a window only if something needs it
+
+	if (expires && schedcap == 0 && tracequiet == 0 && tracelimit == 0) {
+		if (schedrate != 0)
+			ev_add_seconds(TRACE_WINDOW, trace_expired, NULL);
+		return;
+	}
+
+	trace = g_malloc0(sizeof(struct nstrace));
+
+	trace->ns = netns_current();
+	trace->flow = flow;
+	trace->foots = foots;
+	trace->del = del;
+	trace->expires = expires;
+	trace->start = trace->lastfp = g_get_monotonic_time();
+
+	foots->trace = trace;
+
+	trace->timeoutid = ev_add_seconds(TRACE_WINDOW, trace_timeout, trace);
+
+	if (tracequiet != 0)
+		trace->quietid = ev_add_timeout(tracequiet, trace_quiet, trace);
+}
+
+void out_traces(void)
+{
+	uint64_t total = tracestats.quiet + tracestats.limit + tracestats.timeout;
+
+	if (total == 0)
+		return;
+
+	syslogwrap("Trace windows: %" PRIu64 " ended quiet, %" PRIu64 " at the limit, %" PRIu64
+		   " timed out, avg duration: %" PRId64 " ms",
+		   tracestats.quiet, tracestats.limit, tracestats.timeout,
+		   tracestats.usecs / (gint64) total / 1000);
+}
+
+// ----
+
+/* traces started by the trace scheduler (right away or once dequeued) */
+
+static void start_trace_tcpv4flow(gpointer flow)
+{
+	struct tcpv4flow *ptr = flow;
+
+	add_trace_tcpv4flow(ptr);
+
+	/* Assuming that the netfilter won't change during the execution of
+	 * this tool, there is no need to renew the tracing, thus no need to
+	 * keep the trace rules forever. Open a window for the rule removal.
+	 *
+	 * The ulog netfilter code will only work while the trace is enabled.
+	 */
+
+	trace_window(ptr, &ptr->foots, del_trace_tcpv4flow_wrap, tracesets);
+}
+
+static void start_trace_udpv4flow(gpointer flow)
+{
+	struct udpv4flow *ptr = flow;
+
+	add_trace_udpv4flow(ptr);
+
+	trace_window(ptr, &ptr->foots, del_trace_udpv4flow_wrap, tracesets);
+}
+
+static void start_trace_icmpv4flow(gpointer flow)
+{
+	struct icmpv4flow *ptr = flow;
+
+	add_trace_icmpv4flow(ptr);
+
+	trace_window(ptr, &ptr->foots, del_trace_icmpv4flow_wrap, tracesets);
+}
+
+static void start_trace_tcpv6flow(gpointer flow)
+{
+	struct tcpv6flow *ptr = flow;
+
+	add_trace_tcpv6flow(ptr);
+
+	trace_window(ptr, &ptr->foots, del_trace_tcpv6flow_wrap, 1);
+}
+
+static void start_trace_udpv6flow(gpointer flow)
+{
+	struct udpv6flow *ptr = flow;
+
+	add_trace_udpv6flow(ptr);
+
+	trace_window(ptr, &ptr->foots, del_trace_udpv6flow_wrap, 1);
+}
+
+static void start_trace_icmpv6flow(gpointer flow)
+{
+	struct icmpv6flow *ptr = flow;
+
+	add_trace_icmpv6flow(ptr);
+
+	trace_window(ptr, &ptr->foots, del_trace_icmpv6flow_wrap, 1);
+}
+
 // ----
 
 gint add_tcpv4traces(struct tcpv4flow *flow)
@@ -400,14 +826,8 @@ gint add_tcpv4traces(struct tcpv4flow *flow)
 	struct tcpv4flow *ptr;
 	GSequenceIter *found, *found2;
 
-	gchar *src, *dst;
-	uint16_t sport, dport;
-
 	found = g_sequence_lookup(tcpv4flows, flow, cmp_tcpv4flows, NULL);
 
-	src = ipv4_str(&flow->addrs.src);
-	dst = ipv4_str(&flow->addrs.dst);
-
 	if (found == NULL) {
 
 		switch (flow->foots.reply) {
@@ -445,24 +865,22 @@ gint add_tcpv4traces(struct tcpv4flow *flow)
 	if (ptr->foots.traced == 1)
 		return SUCCESS;
 
-
 	ptr->foots.traced = 1;
 
-	/* Here we add the netfilter trace rules that will allow ulog netfilter
-	 * to receive tracing data from the kernel, telling us all the rules that
-	 * affected this flow
-	 */
+	// sampling and inheritance: flows of a class already traced inherit its footprints
 
-	add_trace_tcpv4flow(ptr);
+	ptr->foots.sibling = sample_trace(AF_INET, IPPROTO_TCP, &ptr->addrs.dst, ptr->base.dst, &ptr->foots);
+	if (ptr->foots.sibling == NULL)
+		ptr->foots.sibling = inherit_trace(AF_INET, IPPROTO_TCP, &ptr->addrs.src, &ptr->addrs.dst, ptr->base.dst, &ptr->foots);
+	if (ptr->foots.sibling != NULL)
+		return SUCCESS;
 
-	/* Assuming that the netfilter won't change during the execution of
-	 * this tool, there is no need to renew the tracing, thus no need to
-	 * keep the trace rules forever. Add a timeout for the rule removal.
-	 *
-	 * The ulog netfilter code will only work while the trace is enabled.
+	/* Here we add the netfilter trace rules that will allow ulog netfilter
+	 * to receive tracing data from the kernel, telling us all the rules that
+	 * affected this flow (as soon as the trace scheduler allows it)
 	 */
 
-	g_timeout_add_seconds(30, del_trace_tcpv4flow_wrap, ptr);
+	sched_trace(start_trace_tcpv4flow, ptr, IPPROTO_TCP, ptr->base.dst, ptr->foots.reply, tracesets ? 1 : 2);
 
 	return SUCCESS;
 }
@@ -472,14 +890,8 @@ gint add_udpv4traces(struct udpv4flow *flow)
 	struct udpv4flow *ptr;
 	GSequenceIter *found, *found2;
 
-	gchar *src, *dst;
-	uint16_t sport, dport;
-
 	found = g_sequence_lookup(udpv4flows, flow, cmp_udpv4flows, NULL);
 
-	src = ipv4_str(&flow->addrs.src);
-	dst = ipv4_str(&flow->addrs.dst);
-
 	if (found == NULL) {
 
 		switch (flow->foots.reply) {
@@ -510,9 +922,15 @@ gint add_udpv4traces(struct udpv4flow *flow)
 
 	ptr->foots.traced = 1;
 
-	add_trace_udpv4flow(ptr);
+	// sampling and inheritance: flows of a class already traced inherit its footprints
+
+	ptr->foots.sibling = sample_trace(AF_INET, IPPROTO_UDP, &ptr->addrs.dst, ptr->base.dst, &ptr->foots);
+	if (ptr->foots.sibling == NULL)
+		ptr->foots.sibling = inherit_trace(AF_INET, IPPROTO_UDP, &ptr->addrs.src, &ptr->addrs.dst, ptr->base.dst, &ptr->foots);
+	if (ptr->foots.sibling != NULL)
+		return SUCCESS;
 
-	g_timeout_add_seconds(30, del_trace_udpv4flow_wrap, ptr);
+	sched_trace(start_trace_udpv4flow, ptr, IPPROTO_UDP, ptr->base.dst, ptr->foots.reply, tracesets ? 1 : 2);
 
 	return SUCCESS;
 }
@@ -522,14 +940,8 @@ gint add_icmpv4traces(struct icmpv4flow *flow)
 	struct icmpv4flow *ptr;
 	GSequenceIter *found, *found2;
 
-	gchar *src, *dst;
-	uint16_t sport, dport;
-
 	found = g_sequence_lookup(icmpv4flows, flow, cmp_icmpv4flows, NULL);
 
-	src = ipv4_str(&flow->addrs.src);
-	dst = ipv4_str(&flow->addrs.dst);
-
 	if (found == NULL) {
 
 		switch (flow->foots.reply) {
@@ -560,9 +972,15 @@ gint add_icmpv4traces(struct icmpv4flow *flow)
 
 	ptr->foots.traced = 1;
 
-	add_trace_icmpv4flow(ptr);
+	// sampling and inheritance: flows of a class already traced inherit its footprints
 
-	g_timeout_add_seconds(30, del_trace_icmpv4flow_wrap, ptr);
+	ptr->foots.sibling = sample_trace(AF_INET, IPPROTO_ICMP, &ptr->addrs.dst, ICMP_PORT(ptr->base), &ptr->foots);
+	if (ptr->foots.sibling == NULL)
+		ptr->foots.sibling = inherit_trace(AF_INET, IPPROTO_ICMP, &ptr->addrs.src, &ptr->addrs.dst, ICMP_PORT(ptr->base), &ptr->foots);
+	if (ptr->foots.sibling != NULL)
+		return SUCCESS;
+
+	sched_trace(start_trace_icmpv4flow, ptr, IPPROTO_ICMP, ICMP_PORT(ptr->base), ptr->foots.reply, tracesets ? 1 : 2);
 
 	return SUCCESS;
 }
@@ -572,20 +990,8 @@ gint add_tcpv6traces(struct tcpv6flow *flow)
 	struct tcpv6flow *ptr;
 	GSequenceIter *found, *found2;
 
-	gchar *src, *dst;
-	uint16_t sport, dport;
-
 	found = g_sequence_lookup(tcpv6flows, flow, cmp_tcpv6flows, NULL);
 
-	src = ipv6_str(&flow->addrs.src);
-	dst = ipv6_str(&flow->addrs.dst);
-
-	/*
-	printf("DEBUG: TCPv6 src = %s (port=%u) to dst = %s (port=%u)%s\n",
-			src, ntohs(flow->base.src), dst, ntohs(flow->base.dst),
-			flow->foots.reply ? " (confirmed)" : "");
-	*/
-
 	if (found == NULL) {
 
 		switch (flow->foots.reply) {
@@ -614,28 +1020,137 @@ gint add_tcpv6traces(struct tcpv6flow *flow)
 	if (ptr->foots.traced == 1)
 		return SUCCESS;
 
+	ptr->foots.traced = 1;
+
+	// sampling and inheritance: flows of a class already traced inherit its footprints
+
+	ptr->foots.sibling = sample_trace(AF_INET6, IPPROTO_TCP, &ptr->addrs.dst, ptr->base.dst, &ptr->foots);
+	if (ptr->foots.sibling == NULL)
+		ptr->foots.sibling = inherit_trace(AF_INET6, IPPROTO_TCP, &ptr->addrs.src, &ptr->addrs.dst, ptr->base.dst, &ptr->foots);
+	if (ptr->foots.sibling != NULL)
+		return SUCCESS;
+
+	// set members expire by themselves (removed sooner if the window ends early)
+
+	sched_trace(start_trace_tcpv6flow, ptr, IPPROTO_TCP, ptr->base.dst, ptr->foots.reply, 1);
+
+	return SUCCESS;
+}
+
+gint add_udpv6traces(struct udpv6flow *flow)
+{
+	struct udpv6flow *ptr;
+	GSequenceIter *found, *found2;
+
+	found = g_sequence_lookup(udpv6flows, flow, cmp_udpv6flows, NULL);
+
+	if (found == NULL) {
+
+		switch (flow->foots.reply) {
+		case 0:
+			flow->foots.reply = 1;
+			found2 = g_sequence_lookup(udpv6flows, flow, cmp_udpv6flows, NULL);
+			flow->foots.reply = 0;
+			break;
+		case 1:
+			flow->foots.reply = 0;
+			found2 = g_sequence_lookup(udpv6flows, flow, cmp_udpv6flows, NULL);
+			flow->foots.reply = 1;
+			break;
+		}
+
+		if (found2 == NULL) {
+			perror("BUG: add_udpv6traces");
+			exit(ERROR);
+		}
+
+		found = found2;
+	}
+
+	ptr = g_sequence_get(found);
+
+	if (ptr->foots.traced == 1)
+		return SUCCESS;
+
+	ptr->foots.traced = 1;
+
+	// sampling and inheritance: flows of a class already traced inherit its footprints
+
+	ptr->foots.sibling = sample_trace(AF_INET6, IPPROTO_UDP, &ptr->addrs.dst, ptr->base.dst, &ptr->foots);
+	if (ptr->foots.sibling == NULL)
+		ptr->foots.sibling = inherit_trace(AF_INET6, IPPROTO_UDP, &ptr->addrs.src, &ptr->addrs.dst, ptr->base.dst, &ptr->foots);
+	if (ptr->foots.sibling != NULL)
+		return SUCCESS;
+
+	sched_trace(start_trace_udpv6flow, ptr, IPPROTO_UDP, ptr->base.dst, ptr->foots.reply, 1);
+
+	return SUCCESS;
+}
+
+gint add_icmpv6traces(struct icmpv6flow *flow)
+{
+	struct icmpv6flow *ptr;
+	GSequenceIter *found, *found2;
+
+	found = g_sequence_lookup(icmpv6flows, flow, cmp_icmpv6flows, NULL);
+
+	if (found == NULL) {
+
+		switch (flow->foots.reply) {
+		case 0:
+			flow->foots.reply = 1;
+			found2 = g_sequence_lookup(icmpv6flows, flow, cmp_icmpv6flows, NULL);
+			flow->foots.reply = 0;
+			break;
+		case 1:
+			flow->foots.reply = 0;
+			found2 = g_sequence_lookup(icmpv6flows, flow, cmp_icmpv6flows, NULL);
+			flow->foots.reply = 1;
+			break;
+		}
+
+		if (found2 == NULL) {
+			perror("BUG: add_icmpv6traces");
+			exit(ERROR);
+		}
+
+		found = found2;
+	}
+
+	ptr = g_sequence_get(found);
+
+	if (ptr->foots.traced == 1)
+		return SUCCESS;
 
 	ptr->foots.traced = 1;
 
-	add_trace_tcpv6flow(ptr);
+	// sampling and inheritance: flows of a class already traced inherit its footprints
 
-	g_timeout_add_seconds(30, del_trace_tcpv6flow_wrap, ptr);
+	ptr->foots.sibling = sample_trace(AF_INET6, IPPROTO_ICMPV6, &ptr->addrs.dst, ICMP_PORT(ptr->base), &ptr->foots);
+	if (ptr->foots.sibling == NULL)
+		ptr->foots.sibling = inherit_trace(AF_INET6, IPPROTO_ICMPV6, &ptr->addrs.src, &ptr->addrs.dst, ICMP_PORT(ptr->base), &ptr->foots);
+	if (ptr->foots.sibling != NULL)
+		return SUCCESS;
+
+	sched_trace(start_trace_icmpv6flow, ptr, IPPROTO_ICMPV6, ICMP_PORT(ptr->base), ptr->foots.reply, 1);
 
 	return SUCCESS;
 }
 
 // ----
 
-gint add_tcpv4trace(struct in_addr s, struct in_addr d, uint16_t ps, uint16_t pd, uint8_t r)
+gint add_tcpv4trace(struct in_addr s, struct in_addr d, uint16_t ps, uint16_t pd, uint8_t f, uint8_t r, struct natbase *nat)
 {
 	struct tcpv4flow flow;
 
-	memset(&flow, '0', sizeof(struct tcpv4flow));
+	memset(&flow, 0, sizeof(struct tcpv4flow));
 
 	flow.addrs.src = s;
 	flow.addrs.dst = d;
 	flow.base.src = ps;
 	flow.base.dst = pd;
+	flow.base.folded = f;
+	flow.nat = *nat;
 	flow.foots.reply = r;
 
 	add_tcpv4traces(&flow);
@@ -643,17 +1158,19 @@ gint add_tcpv4trace(struct in_addr s, struct in_addr d, uint16_t ps, uint16_t pd
 	return SUCCESS;
 }
 
-gint add_udpv4trace(struct in_addr s, struct in_addr d, uint16_t ps, uint16_t pd, uint8_t r)
+gint add_udpv4trace(struct in_addr s, struct in_addr d, uint16_t ps, uint16_t pd, uint8_t f, uint8_t r, struct natbase *nat)
 {
 
 	struct udpv4flow flow;
 
-	memset(&flow, '0', sizeof(struct udpv4flow));
+	memset(&flow, 0, sizeof(struct udpv4flow));
 
 	flow.addrs.src = s;
 	flow.addrs.dst = d;
 	flow.base.src = ps;
 	flow.base.dst = pd;
+	flow.base.folded = f;
+	flow.nat = *nat;
 	flow.foots.reply = r;
 
 	add_udpv4traces(&flow);
@@ -661,17 +1178,18 @@ gint add_udpv4trace(struct in_addr s, struct in_addr d, uint16_t ps, uint16_t pd
 	return SUCCESS;
 }
 
-gint add_icmpv4trace(struct in_addr s, struct in_addr d, uint8_t ty, uint8_t co, uint8_t r)
+gint add_icmpv4trace(struct in_addr s, struct in_addr d, uint8_t ty, uint8_t co, uint8_t r, struct natbase *nat)
 {
 
 	struct icmpv4flow flow;
 
-	memset(&flow, '0', sizeof(struct icmpv4flow));
+	memset(&flow, 0, sizeof(struct icmpv4flow));
 
 	flow.addrs.src = s;
 	flow.addrs.dst = d;
 	flow.base.type = ty;
 	flow.base.code = co;
+	flow.nat = *nat;
 	flow.foots.reply = r;
 
 	add_icmpv4traces(&flow);
@@ -679,19 +1197,58 @@ gint add_icmpv4trace(struct in_addr s, struct in_addr d, uint8_t ty, uint8_t co,
 	return SUCCESS;
 }
 
-gint add_tcpv6trace(struct in6_addr s, struct in6_addr d, uint16_t ps, uint16_t pd, uint8_t r)
+gint add_tcpv6trace(struct in6_addr s, struct in6_addr d, uint16_t ps, uint16_t pd, uint8_t f, uint8_t r, struct natbase *nat)
 {
 	struct tcpv6flow flow;
 
-	memset(&flow, '0', sizeof(struct tcpv6flow));
+	memset(&flow, 0, sizeof(struct tcpv6flow));
 
 	flow.addrs.src = s;
 	flow.addrs.dst = d;
 	flow.base.src = ps;
 	flow.base.dst = pd;
+	flow.base.folded = f;
+	flow.nat = *nat;
 	flow.foots.reply = r;
 
 	add_tcpv6traces(&flow);
 
 	return SUCCESS;
 }
+
+gint add_udpv6trace(struct in6_addr s, struct in6_addr d, uint16_t ps, uint16_t pd, uint8_t f, uint8_t r, struct natbase *nat)
+{
+	struct udpv6flow flow;
+
+	memset(&flow, 0, sizeof(struct udpv6flow));
+
+	flow.addrs.src = s;
+	flow.addrs.dst = d;
+	flow.base.src = ps;
+	flow.base.dst = pd;
+	flow.base.folded = f;
+	flow.nat = *nat;
+	flow.foots.reply = r;
+
+	add_udpv6traces(&flow);
+
+	return SUCCESS;
+}
+
+gint add_icmpv6trace(struct in6_addr s, struct in6_addr d, uint8_t ty, uint8_t co, uint8_t r, struct natbase *nat)
+{
+	struct icmpv6flow flow;
+
+	memset(&flow, 0, sizeof(struct icmpv6flow));
+
+	flow.addrs.src = s;
+	flow.addrs.dst = d;
+	flow.base.type = ty;
+	flow.base.code = co;
+	flow.nat = *nat;
+	flow.foots.reply = r;
+
+	add_icmpv6traces(&flow);
+
+	return SUCCESS;
+}
@@ -7,6 +7,7 @@
 #define IPTABLES_H_
 
 #include "general.h"
+#include "footprint.h"
 
 #include <linux/netfilter.h>
 #include <linux/netfilter/nfnetlink.h>
@@ -16,13 +17,31 @@
 #include <libnftnl/rule.h>
 #include <libnftnl/expr.h>
 
+/* comment of conntracker's own TRACE rules: rule attribution ignores them */
+
+#define TRACE_COMMENT "conntracker"
+
 gint add_conntrack(void);
+gint add_trace_ipv6(void);
+gint del_trace_ipv6(void);
 gint del_conntrack(void);
 
-gint add_tcpv4trace(struct in_addr, struct in_addr, uint16_t, uint16_t, uint8_t);
-gint add_udpv4trace(struct in_addr, struct in_addr, uint16_t, uint16_t, uint8_t);
-gint add_icmpv4trace(struct in_addr, struct in_addr, uint8_t, uint8_t, uint8_t);
-gint add_tcpv6trace(struct in6_addr, struct in6_addr, uint16_t, uint16_t, uint8_t);
+gint add_tcpv4trace(struct in_addr, struct in_addr, uint16_t, uint16_t, uint8_t, uint8_t, struct natbase *);
+gint add_udpv4trace(struct in_addr, struct in_addr, uint16_t, uint16_t, uint8_t, uint8_t, struct natbase *);
+gint add_icmpv4trace(struct in_addr, struct in_addr, uint8_t, uint8_t, uint8_t, struct natbase *);
+gint add_tcpv6trace(struct in6_addr, struct in6_addr, uint16_t, uint16_t, uint8_t, uint8_t, struct natbase *);
+gint add_udpv6trace(struct in6_addr, struct in6_addr, uint16_t, uint16_t, uint8_t, uint8_t, struct natbase *);
+gint add_icmpv6trace(struct in6_addr, struct in6_addr, uint8_t, uint8_t, uint8_t, struct natbase *);
+
+extern gboolean tracesets;
+extern guint tracequiet;
+extern guint tracelimit;
+
+gint set_tracequiet(char *);
+gint set_tracelimit(char *);
+
+void trace_observed(struct footprints *, gboolean);
+void out_traces(void);
 
 gint iptables_cleanup(void);
 
@@ -0,0 +1,222 @@
+/*
+ * (C) 2021 by Rafael David Tinoco <rafael.tinoco@ibm.com>
+ * (C) 2021 by Rafael David Tinoco <rafaeldtinoco@ubuntu.com>
+ */
+
+#include "nat.h"
+#include "ctevent.h"
+
+extern int logfd;
+
+/*
+ * NAT-aware flows (-X): flows are kept by their original tuple, the one the
+ * first packet had, so translated connections only show the pre-NAT side and
+ * connections to a balanced address (DNAT to several backends) all collapse
+ * into one flow. With -X, the reply tuple of translated connections (status
+ * IPS_SRC_NAT or IPS_DST_NAT) gives their post-NAT endpoints:
+ *
+ * - post-SNAT source: the reply tuple destination
+ * - post-DNAT destination: the reply tuple source
+ *
+ * and the post-NAT endpoints become part of the flow: each backend is a flow
+ * of its own, shown with both its pre- and post-NAT endpoints.
+ *
+ * Translated addresses (a few gateway addresses and backends, usually) are
+ * interned in an address dictionary and flows keep 32 bit indexes instead
+ * (12 bytes per flow, IPv4 or IPv6, nothing else for untranslated flows).
+ * Translated ports are folded like the original ones they replace.
+ *
+ * Note: trace messages carry the conntrack of the packet, translated or not
+ * yet (before the nat table), footprints go to the flow with the same post-NAT
+ * endpoints or, if there is none, to a flow of the same original tuple, the
+ * one with an open trace window first (lookup_natflow). Trace messages only
+ * create a flow when none of those exists.
+ */
+
+struct nataddr {
+	uint8_t family;
+	uint8_t pad[3];
+	union ctaddr addr;
+};
+
+gboolean natflows;
+
+GPtrArray *natdict;			// index - 1 -> address
+GHashTable *natindex;			// address -> index
+
+// ----
+
+static guint hash_nataddr(gconstpointer data)
+{
+	return hash_bytes(data, sizeof(struct nataddr));
+}
+
+static gboolean equal_nataddr(gconstpointer one, gconstpointer two)
+{
+	return memcmp(one, two, sizeof(struct nataddr)) == 0;
+}
+
+static uint32_t nat_intern(uint8_t family, union ctaddr *addr)
+{
+	guint index;
+	struct nataddr key, *temp;
+
+	memset(&key, 0, sizeof(struct nataddr));
+
+	key.family = family;
+
+	if (family == AF_INET)
+		key.addr.ipv4 = addr->ipv4;
+	else
+		key.addr.ipv6 = addr->ipv6;
+
+	index = GPOINTER_TO_UINT(g_hash_table_lookup(natindex, &key));
+
+	if (index != 0)
+		return index;
+
+	temp = g_new0(struct nataddr, 1);
+	*temp = key;
+
+	g_ptr_array_add(natdict, temp);
+	index = natdict->len;
+
+	g_hash_table_insert(natindex, temp, GUINT_TO_POINTER(index));
+
+	return index;
+}
+
+static struct nataddr *nat_addr(uint32_t index)
+{
+	return g_ptr_array_index(natdict, index - 1);
+}
+
+// ----
+
+gint cmp_natbase(struct natbase one, struct natbase two)
+{
+	if (one.dst < two.dst)
+		return LESS;
+	if (one.dst > two.dst)
+		return MORE;
+
+	if (one.dport < two.dport)
+		return LESS;
+	if (one.dport > two.dport)
+		return MORE;
+
+	if (one.src < two.src)
+		return LESS;
+	if (one.src > two.src)
+		return MORE;
+
+	if (one.sport < two.sport)
+		return LESS;
+	if (one.sport > two.sport)
+		return MORE;
+
+	return EQUAL;
+}
+
+void nat_fold(struct ctevent *ev, uint16_t sport, uint16_t dport, uint16_t *nsport, uint16_t *ndport)
+{
+	// translated ports folded when the original ones were (client side)
+
+	*nsport = 0;
+	*ndport = 0;
+
+	if (ev->nat & NAT_SRC)
+		*nsport = (sport != ev->sport) ? sport : ev->nsport;
+	if (ev->nat & NAT_DST)
+		*ndport = (dport != ev->dport) ? dport : ev->ndport;
+}
+
+void nat_base(struct ctevent *ev, uint16_t sport, uint16_t dport, struct natbase *nat)
+{
+	memset(nat, 0, sizeof(struct natbase));
+
+	if (!natflows || ev->nat == 0)
+		return;
+
+	nat_fold(ev, sport, dport, &nat->sport, &nat->dport);
+
+	if (ev->nat & NAT_SRC)
+		nat->src = nat_intern(ev->family, &ev->nsrc);
+	if (ev->nat & NAT_DST)
+		nat->dst = nat_intern(ev->family, &ev->ndst);
+}
+
+// ----
+
+void out_nat(struct natbase *nat, uint8_t family, uint8_t proto, const void *src, const void *dst,
+	     uint16_t sport, uint16_t dport)
+{
+	const gchar *kind;
+	gchar strsrc[INET6_ADDRSTRLEN], strdst[INET6_ADDRSTRLEN];
+
+	if (!natflows || (nat->src == 0 && nat->dst == 0))
+		return;
+
+	// untranslated side: the original endpoint
+
+	if (nat->src != 0) {
+		src = &nat_addr(nat->src)->addr;
+		sport = nat->sport;
+	}
+	if (nat->dst != 0) {
+		dst = &nat_addr(nat->dst)->addr;
+		dport = nat->dport;
+	}
+
+	inet_ntop(family, src, strsrc, sizeof(strsrc));
+	inet_ntop(family, dst, strdst, sizeof(strdst));
+
+	if (nat->src != 0 && nat->dst != 0)
+		kind = "SNAT+DNAT";
+	else if (nat->src != 0)
+		kind = "SNAT";
+	else
+		kind = "DNAT";
+
+	switch (proto) {
+	case IPPROTO_TCP:
+	case IPPROTO_UDP:
+		dprintf(logfd, "\t\t\t\tpost-NAT (%s): src = %s (port=%u) to dst = %s (port=%u)\n",
+				kind, strsrc, ntohs(sport), strdst, ntohs(dport));
+		break;
+	default:
+		dprintf(logfd, "\t\t\t\tpost-NAT (%s): src = %s to dst = %s\n", kind, strsrc, strdst);
+		break;
+	}
+}
+
+// ----
+
+void alloc_nat(void)
+{
+	if (!natflows)
+		return;
+
+	natdict = g_ptr_array_new_with_free_func(g_free);
+	natindex = g_hash_table_new(hash_nataddr, equal_nataddr);
+}
+
+void free_nat(void)
+{
+	if (!natflows)
+		return;
+
+	g_hash_table_destroy(natindex);
+	g_ptr_array_free(natdict, TRUE);
+
+	natindex = NULL;
+	natdict = NULL;
+}
+
+void out_natdict(void)
+{
+	if (!natflows)
+		return;
+
+	syslogwrap("NAT: %u translated addresses in the dictionary", natdict->len);
+}
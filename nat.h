@@ -0,0 +1,44 @@
+/*
+ * (C) 2021 by Rafael David Tinoco <rafael.tinoco@ibm.com>
+ * (C) 2021 by Rafael David Tinoco <rafaeldtinoco@ubuntu.com>
+ */
+
+#ifndef NAT_H_
+#define NAT_H_
+
+#include "general.h"
+
+struct ctevent;
+
+/* translations seen in the conntrack status (IPS_SRC_NAT, IPS_DST_NAT) */
+
+#define NAT_SRC 0x1
+#define NAT_DST 0x2
+
+/*
+ * post-NAT endpoints of a flow: addresses are indexes into the address
+ * dictionary (0: not translated, the original endpoint), ports are folded
+ * like the original ones (network order)
+ */
+
+struct natbase {
+	uint32_t src;			// SNAT: translated source
+	uint32_t dst;			// DNAT: translated destination
+	uint16_t sport;
+	uint16_t dport;
+};
+
+extern gboolean natflows;
+
+gint cmp_natbase(struct natbase, struct natbase);
+
+void nat_fold(struct ctevent *, uint16_t, uint16_t, uint16_t *, uint16_t *);
+void nat_base(struct ctevent *, uint16_t, uint16_t, struct natbase *);
+
+void out_nat(struct natbase *, uint8_t, uint8_t, const void *, const void *, uint16_t, uint16_t);
+
+void alloc_nat(void);
+void free_nat(void);
+void out_natdict(void);
+
+#endif /* NAT_H_ */
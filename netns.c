@@ -0,0 +1,317 @@
+/*
+ * (C) 2021 by Rafael David Tinoco <rafael.tinoco@ibm.com>
+ * (C) 2021 by Rafael David Tinoco <rafaeldtinoco@ubuntu.com>
+ */
+
+#define _GNU_SOURCE
+
+#include "netns.h"
+#include "ports.h"
+#include "ipset.h"
+#include "event.h"
+
+/*
+ * Network namespaces: a single conntracker process tracks the flows of many
+ * network namespaces (-n all: the ones in /run/netns, as created by "ip netns",
+ * or -n ns1,ns2,...) besides the one it was started in.
+ *
+ * Each namespace has a context with its own flows tables and its own
+ * conntrack, ulog and ipset netlink sockets (created inside the namespace with
+ * setns(), all multiplexed in the same main loop). Whenever an event from a
+ * namespace is handled, its context is entered: the global flows tables point
+ * to the namespace ones and firewall commands (netns_system) are executed
+ * inside the namespace. The context is left right after, so everything else
+ * (timers, queries, ruleset) always sees the initial namespace.
+ *
+ * An idle namespace costs its sockets and a few KB of memory (context, empty
+ * tables, netlink handles). With "-n all" /run/netns is scanned again every
+ * NETNS_RESCAN seconds: new namespaces are tracked and the removed ones have
+ * their sockets closed (their flows are kept for the final report).
+ */
+
+gchar *netnsopt;
+
+GPtrArray *namespaces;
+struct netns *initial;
+struct netns *current;
+
+netns_fn nsstart;
+netns_fn nsstop;
+
+// ----
+
+void netns_enter(struct netns *ns)
+{
+	if (ns == current)
+		return;
+
+	current = ns;
+
+	load_flows(&ns->flows);
+	ipset_use(ns->ipsetnl);
+
+	// listeners and local addresses are only known for the initial one
+
+	localview = (ns == initial);
+}
+
+void netns_leave(void)
+{
+	netns_enter(initial);
+}
+
+struct netns *netns_current(void)
+{
+	return current;
+}
+
+gint netns_setns(struct netns *ns)
+{
+	if (ns == NULL)
+		ns = initial;
+
+	if (ns->fd < 0)
+		return ERROR;
+
+	return setns(ns->fd, CLONE_NEWNET) < 0 ? ERROR : SUCCESS;
+}
+
+gint netns_system(const char *cmd)
+{
+	gint ret;
+
+	// forked commands inherit the namespace of the calling thread
+
+	if (current == NULL || current == initial)
+		return system(cmd);
+
+	if (netns_setns(current) == ERROR)
+		return ERROR;
+
+	ret = system(cmd);
+
+	if (netns_setns(initial) == ERROR)
+		debug("could not go back to initial namespace");
+
+	return ret;
+}
+
+// ----
+
+static struct netns *netns_new(gchar *name, int fd)
+{
+	struct netns *ns = g_new0(struct netns, 1);
+
+	ns->name = g_strdup(name);
+	ns->fd = fd;
+
+	// alloc_flows() works on the global tables: save them into the context
+
+	alloc_flows();
+	save_flows(&ns->flows);
+
+	if (current != NULL)
+		load_flows(&current->flows);
+
+	g_ptr_array_add(namespaces, ns);
+
+	return ns;
+}
+
+static void netns_gone(struct netns *ns)
+{
+	netns_enter(ns);
+	nsstop(ns);
+	netns_leave();
+
+	close(ns->fd);
+	ns->fd = -1;
+}
+
+static struct netns *netns_lookup(const gchar *name)
+{
+	guint i;
+	struct netns *ns;
+
+	for (i = 1; i < namespaces->len; i++) {
+		ns = g_ptr_array_index(namespaces, i);
+		if (ns->fd >= 0 && g_strcmp0(ns->name, name) == 0)
+			return ns;
+	}
+
+	return NULL;
+}
+
+static void netns_add(const gchar *name)
+{
+	int fd;
+	gint ret;
+	gchar *path;
+	struct netns *ns;
+
+	path = g_strdup_printf("%s/%s", NETNS_RUN, name);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	g_free(path);
+
+	if (fd < 0) {
+		syslogwrap("Could not open namespace: %s", name);
+		return;
+	}
+
+	ns = netns_new((gchar *) name, fd);
+
+	netns_enter(ns);
+	ret = nsstart(ns);
+	netns_leave();
+
+	if (ret == ERROR) {
+		syslogwrap("Could not track namespace: %s", name);
+		netns_gone(ns);
+		return;
+	}
+
+	syslogwrap("Tracking namespace: %s", name);
+}
+
+static gchar **netns_names(void)
+{
+	GDir *dir;
+	GPtrArray *names;
+	const gchar *name;
+
+	if (g_strcmp0(netnsopt, "all") != 0)
+		return g_strsplit(netnsopt, ",", -1);
+
+	names = g_ptr_array_new();
+
+	dir = g_dir_open(NETNS_RUN, 0, NULL);
+
+	if (dir != NULL) {
+		while ((name = g_dir_read_name(dir)) != NULL)
+			g_ptr_array_add(names, g_strdup(name));
+		g_dir_close(dir);
+	}
+
+	g_ptr_array_add(names, NULL);
+
+	return (gchar **) g_ptr_array_free(names, FALSE);
+}
+
+static void netns_scan(void)
+{
+	guint i;
+	gchar **names;
+	struct netns *ns;
+
+	names = netns_names();
+
+	for (i = 0; names[i] != NULL; i++) {
+		if (*names[i] != '\0' && netns_lookup(names[i]) == NULL)
+			netns_add(names[i]);
+	}
+
+	// namespaces that were removed
+
+	for (i = 1; i < namespaces->len; i++) {
+		ns = g_ptr_array_index(namespaces, i);
+		if (ns->fd >= 0 && !g_strv_contains((const gchar * const *) names, ns->name)) {
+			syslogwrap("Namespace is gone: %s", ns->name);
+			netns_gone(ns);
+		}
+	}
+
+	g_strfreev(names);
+}
+
+static gint netns_scan_wrap(gpointer data)
+{
+	netns_scan();
+
+	// keep the timeout callback
+
+	return TRUE;
+}
+
+// ----
+
+gint netns_init(netns_fn start, netns_fn stop)
+{
+	int fd;
+	gint ret;
+
+	nsstart = start;
+	nsstop = stop;
+
+	namespaces = g_ptr_array_new();
+
+	fd = open(NETNS_SELF, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return ERROR;
+
+	initial = netns_new(NULL, fd);
+
+	netns_enter(initial);
+
+	ret = nsstart(initial);
+
+	if (ret == ERROR || netnsopt == NULL)
+		return ret;
+
+	netns_scan();
+
+	if (g_strcmp0(netnsopt, "all") == 0)
+		ev_add_seconds(NETNS_RESCAN, netns_scan_wrap, NULL);
+
+	return SUCCESS;
+}
+
+void netns_free(void)
+{
+	guint i;
+	struct netns *ns;
+
+	if (namespaces == NULL)
+		return;
+
+	for (i = 0; i < namespaces->len; i++) {
+		ns = g_ptr_array_index(namespaces, i);
+		netns_enter(ns);
+		if (ns->fd >= 0)
+			nsstop(ns);
+		free_flows();
+	}
+
+	netns_leave();
+
+	for (i = 0; i < namespaces->len; i++) {
+		ns = g_ptr_array_index(namespaces, i);
+		if (ns->fd >= 0)
+			close(ns->fd);
+		g_free(ns->name);
+		g_free(ns);
+	}
+
+	g_ptr_array_free(namespaces, TRUE);
+	namespaces = NULL;
+}
+
+// ----
+
+void out_netns(void)
+{
+	guint i;
+	struct netns *ns;
+
+	if (namespaces == NULL)
+		return;
+
+	for (i = 0; i < namespaces->len; i++) {
+		ns = g_ptr_array_index(namespaces, i);
+		if (namespaces->len > 1)
+			dprintf(logfd, "Namespace: %s\n", ns->name ? ns->name : "(initial)");
+		netns_enter(ns);
+		out_all();
+	}
+
+	netns_leave();
+}
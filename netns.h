@@ -0,0 +1,50 @@
+/*
+ * (C) 2021 by Rafael David Tinoco <rafael.tinoco@ibm.com>
+ * (C) 2021 by Rafael David Tinoco <rafaeldtinoco@ubuntu.com>
+ */
+
+#ifndef NETNS_H_
+#define NETNS_H_
+
+#include "general.h"
+#include "flows.h"
+#include "nlbuf.h"
+
+#include <sched.h>
+#include <libmnl/libmnl.h>
+
+#define NETNS_RUN "/run/netns"
+#define NETNS_SELF "/proc/self/ns/net"
+#define NETNS_RESCAN 60
+
+struct netns {
+	gchar *name;			// NULL: namespace conntracker started in
+	int fd;				// -1: namespace is gone
+	struct flowtables flows;
+	struct nfct_handle *nfcth;
+	struct mnl_socket *ulognl;
+	struct mnl_socket *ipsetnl;
+	struct nlbuf *ctbuf;
+	struct nlbuf *ulogbuf;
+	guint conntrackioid;
+	guint ulognlctioid;
+	guint pollid;
+};
+
+typedef gint (*netns_fn)(struct netns *);
+
+extern gchar *netnsopt;
+
+gint netns_init(netns_fn, netns_fn);
+void netns_free(void);
+
+void netns_enter(struct netns *);
+void netns_leave(void);
+struct netns *netns_current(void);
+
+gint netns_setns(struct netns *);
+gint netns_system(const char *);
+
+void out_netns(void);
+
+#endif /* NETNS_H_ */
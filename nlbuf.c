@@ -0,0 +1,164 @@
+/*
+ * (C) 2021 by Rafael David Tinoco <rafael.tinoco@ibm.com>
+ * (C) 2021 by Rafael David Tinoco <rafaeldtinoco@ubuntu.com>
+ */
+
+#include "nlbuf.h"
+#include "event.h"
+
+/*
+ * Netlink receive buffers (conntrack events and trace messages):
+ *
+ * - sized at start (-b, default NLBUF_DEFAULT) with SO_RCVBUFFORCE
+ * - doubled (up to NLBUF_MAX) whenever the kernel couldn't deliver messages:
+ *   ENOBUFS from recv() or, as NETLINK_NO_ENOBUFS hides those, an increase
+ *   of the socket drops counter (SO_MEMINFO), checked every NLBUF_SAMPLE secs
+ * - occupancy (memory queued / buffer size) sampled at the same time and its
+ *   peak reported when finishing, together with overruns and resizes
+ *
+ * Policy for lost messages (-N):
+ *
+ * - reliable (default): ENOBUFS is reported and the conntrack table is dumped
+ *   again (at most every NLBUF_RESYNC secs) to recover lost events
+ * - best effort: NETLINK_NO_ENOBUFS, lost messages are simply gone
+ */
+
+#define NLBUF_SAMPLE 1
+#define NLBUF_RESYNC 5
+
+int nlbufpolicy = NLBUF_RELIABLE;
+int nlbufsize = NLBUF_DEFAULT;
+
+GPtrArray *nlbufs;
+
+// ----
+
+static void nlbuf_resize(struct nlbuf *buf, int size)
+{
+	buf->size = size;
+
+	// FORCE ignores rmem_max (needs CAP_NET_ADMIN)
+
+	if (setsockopt(buf->fd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)) < 0)
+		setsockopt(buf->fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+}
+
+static void nlbuf_grow(struct nlbuf *buf)
+{
+	if (buf->size >= NLBUF_MAX)
+		return;
+
+	nlbuf_resize(buf, MIN(buf->size * 2, NLBUF_MAX));
+	buf->grows++;
+
+	syslogwrap("Receive buffer (%s) grown to %d bytes", buf->name, buf->size);
+}
+
+static void nlbuf_sample(gpointer data, gpointer user_data)
+{
+	guint occupancy;
+	struct nlbuf *buf = data;
+	uint32_t mem[SK_MEMINFO_VARS];
+	socklen_t len = sizeof(mem);
+
+	memset(mem, 0, sizeof(mem));
+
+	if (getsockopt(buf->fd, SOL_SOCKET, SO_MEMINFO, mem, &len) < 0)
+		return;
+
+	if (mem[SK_MEMINFO_RCVBUF] != 0) {
+		occupancy = (guint) ((uint64_t) mem[SK_MEMINFO_RMEM_ALLOC] * 100 / mem[SK_MEMINFO_RCVBUF]);
+		buf->peak = MAX(buf->peak, occupancy);
+	}
+
+	// drops counted by the kernel (the only sign of loss with NO_ENOBUFS)
+
+	if (len > SK_MEMINFO_DROPS * sizeof(uint32_t) && mem[SK_MEMINFO_DROPS] != buf->drops) {
+		buf->overruns += mem[SK_MEMINFO_DROPS] - buf->drops;
+		buf->drops = mem[SK_MEMINFO_DROPS];
+		nlbuf_grow(buf);
+	}
+}
+
+static gint nlbuf_sample_wrap(gpointer data)
+{
+	g_ptr_array_foreach(nlbufs, nlbuf_sample, NULL);
+
+	// keep the timeout callback
+
+	return TRUE;
+}
+
+// ----
+
+gboolean nlbuf_overrun(struct nlbuf *buf)
+{
+	gint64 now = g_get_monotonic_time();
+
+	buf->overruns++;
+	nlbuf_grow(buf);
+
+	if (nlbufpolicy == NLBUF_BESTEFFORT)
+		return FALSE;
+
+	// tell caller to resync (not too often, a storm might be going on)
+
+	if (now - buf->lastresync < NLBUF_RESYNC * G_USEC_PER_SEC)
+		return FALSE;
+
+	buf->lastresync = now;
+
+	return TRUE;
+}
+
+struct nlbuf *nlbuf_new(gchar *name, int fd)
+{
+	int one = 1;
+	struct nlbuf *buf = g_new0(struct nlbuf, 1);
+
+	if (nlbufs == NULL) {
+		nlbufs = g_ptr_array_new();
+		ev_add_seconds(NLBUF_SAMPLE, nlbuf_sample_wrap, NULL);
+	}
+
+	buf->name = g_strdup(name);
+	buf->fd = fd;
+
+	nlbuf_resize(buf, nlbufsize);
+
+	if (nlbufpolicy == NLBUF_BESTEFFORT)
+		setsockopt(fd, SOL_NETLINK, NETLINK_NO_ENOBUFS, &one, sizeof(one));
+
+	g_ptr_array_add(nlbufs, buf);
+
+	return buf;
+}
+
+void nlbuf_free(struct nlbuf *buf)
+{
+	if (buf == NULL)
+		return;
+
+	g_ptr_array_remove(nlbufs, buf);
+
+	g_free(buf->name);
+	g_free(buf);
+}
+
+// ----
+
+static void out_nlbuf(gpointer data, gpointer user_data)
+{
+	struct nlbuf *buf = data;
+
+	syslogwrap("Receive buffer (%s): %d bytes, peak occupancy: %u%%, overruns: %" PRIu64 ", grown: %u times",
+		   buf->name, buf->size, buf->peak, buf->overruns, buf->grows);
+}
+
+void out_nlbufs(void)
+{
+	if (nlbufs == NULL)
+		return;
+
+	g_ptr_array_foreach(nlbufs, out_nlbuf, NULL);
+}
@@ -0,0 +1,47 @@
+/*
+ * (C) 2021 by Rafael David Tinoco <rafael.tinoco@ibm.com>
+ * (C) 2021 by Rafael David Tinoco <rafaeldtinoco@ubuntu.com>
+ */
+
+#ifndef NLBUF_H_
+#define NLBUF_H_
+
+#include "general.h"
+
+#include <linux/netlink.h>
+#include <linux/sock_diag.h>
+
+#ifndef SOL_NETLINK
+#define SOL_NETLINK 270
+#endif
+
+#define NLBUF_DEFAULT (2 * 1024 * 1024)
+#define NLBUF_MAX (128 * 1024 * 1024)
+
+enum {
+	NLBUF_RELIABLE = 0,
+	NLBUF_BESTEFFORT = 1,
+};
+
+struct nlbuf {
+	gchar *name;
+	int fd;
+	int size;		// requested size (kernel doubles it)
+	uint32_t drops;		// last drops seen (SO_MEMINFO)
+	uint64_t overruns;	// ENOBUFS + drops
+	guint grows;
+	guint peak;		// occupancy (%)
+	gint64 lastresync;
+};
+
+extern int nlbufpolicy;
+extern int nlbufsize;
+
+struct nlbuf *nlbuf_new(gchar *, int);
+void nlbuf_free(struct nlbuf *);
+
+gboolean nlbuf_overrun(struct nlbuf *);
+
+void out_nlbufs(void);
+
+#endif /* NLBUF_H_ */
@@ -118,6 +118,8 @@ int nflog_nlmsg_parse(const struct nlmsghdr *nlh, struct nlattr **attr)
 struct mnl_socket *ulognlct_open(void)
 {
 	int ret;
+	guint i;
+	uint8_t families[] = { AF_INET, AF_INET6 };
 	struct mnl_socket *nl;
 	struct nlmsghdr *nlh;
 	char buf[MNL_SOCKET_BUFFER_SIZE];
@@ -130,21 +132,23 @@ struct mnl_socket *ulognlct_open(void)
 	if (mnl_socket_bind(nl, 0, MNL_SOCKET_AUTOPID) < 0)
 		return NULL;
 
-	/* unbind net family */
-	nlh = nflog_nlmsg_put_header(buf, NFULNL_MSG_CONFIG, AF_INET, 0);
-	if (nflog_attr_put_cfg_cmd(nlh, NFULNL_CFG_CMD_PF_UNBIND) < 0)
-		return NULL;
+	/* unbind and bind both net families (IPv4 and IPv6 traces) */
+	for (i = 0; i < G_N_ELEMENTS(families); i++) {
 
-	if (mnl_socket_sendto(nl, nlh, nlh->nlmsg_len) < 0)
-		return NULL;
+		nlh = nflog_nlmsg_put_header(buf, NFULNL_MSG_CONFIG, families[i], 0);
+		if (nflog_attr_put_cfg_cmd(nlh, NFULNL_CFG_CMD_PF_UNBIND) < 0)
+			return NULL;
 
-	/* bind net family */
-	nlh = nflog_nlmsg_put_header(buf, NFULNL_MSG_CONFIG, AF_INET, 0);
-	if (nflog_attr_put_cfg_cmd(nlh, NFULNL_CFG_CMD_PF_BIND) < 0)
-		return NULL;
+		if (mnl_socket_sendto(nl, nlh, nlh->nlmsg_len) < 0)
+			return NULL;
 
-	if (mnl_socket_sendto(nl, nlh, nlh->nlmsg_len) < 0)
-		return NULL;
+		nlh = nflog_nlmsg_put_header(buf, NFULNL_MSG_CONFIG, families[i], 0);
+		if (nflog_attr_put_cfg_cmd(nlh, NFULNL_CFG_CMD_PF_BIND) < 0)
+			return NULL;
+
+		if (mnl_socket_sendto(nl, nlh, nlh->nlmsg_len) < 0)
+			return NULL;
+	}
 
 	/* bind ulog queue */
 	nlh = nflog_nlmsg_put_header(buf, NFULNL_MSG_CONFIG, AF_INET, 0);
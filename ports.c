@@ -0,0 +1,347 @@
+/*
+ * (C) 2021 by Rafael David Tinoco <rafael.tinoco@ibm.com>
+ * (C) 2021 by Rafael David Tinoco <rafaeldtinoco@ubuntu.com>
+ */
+
+#include "ports.h"
+#include "event.h"
+
+/*
+ * Port classifier: decide, for each flow, which side is the service port
+ * and fold the other side (the client one) into FOLDED_PORT. This keeps a
+ * single flow record for all the connections made to the same service.
+ *
+ * It uses:
+ *
+ * - the local port range (/proc/sys/net/ipv4/ip_local_port_range): ports
+ *   the kernel hands out to clients, so not services
+ * - the local listening sockets (sock_diag netlink dump): TCP sockets in
+ *   LISTEN state and unconnected UDP sockets are services
+ * - the local addresses: a local destination port in the local port range
+ *   and not being listened to can't be a service
+ *
+ * Listeners and addresses are cached and refreshed every PORTS_REFRESH
+ * seconds. In between, a local destination port not known as a service (it
+ * might have started listening after the last refresh) is looked up alone:
+ * a sock_diag dump filtered (bytecode) on that source port, at most
+ * PORTS_EARLY_MAX of them per second. Without any of this information the
+ * classifier behaves as before: all source ports above 1024 are folded.
+ */
+
+#define PORTS_REFRESH 60
+#define PORTS_EARLY_MAX 16
+
+#define BITMAP_WORDS (65536 / 64)
+
+struct listeners {
+	uint64_t tcp[BITMAP_WORDS];
+	uint64_t udp[BITMAP_WORDS];
+};
+
+uint16_t ephemeral_low = 32768;
+uint16_t ephemeral_high = 60999;
+
+gboolean localview = TRUE;
+
+struct listeners *listening;
+GArray *localv4;
+GArray *localv6;
+gint64 earlysecond;
+guint earlyqueries;
+
+// ----
+
+static gboolean isset_port(uint64_t *bitmap, uint16_t port)
+{
+	return (bitmap[port / 64] >> (port % 64)) & 1;
+}
+
+static void set_port(uint64_t *bitmap, uint16_t port)
+{
+	bitmap[port / 64] |= (uint64_t) 1 << (port % 64);
+}
+
+static gboolean is_listening(uint8_t proto, uint16_t port)
+{
+	switch (proto) {
+	case IPPROTO_TCP:
+		return isset_port(listening->tcp, port);
+	case IPPROTO_UDP:
+		return isset_port(listening->udp, port);
+	}
+
+	return FALSE;
+}
+
+static gboolean is_ephemeral(uint16_t port)
+{
+	return port >= ephemeral_low && port <= ephemeral_high;
+}
+
+static gboolean is_local(uint8_t family, const void *addr)
+{
+	guint i;
+
+	switch (family) {
+	case AF_INET:
+		for (i = 0; i < localv4->len; i++)
+			if (memcmp(&g_array_index(localv4, struct in_addr, i), addr, sizeof(struct in_addr)) == 0)
+				return TRUE;
+		break;
+	case AF_INET6:
+		for (i = 0; i < localv6->len; i++)
+			if (memcmp(&g_array_index(localv6, struct in6_addr, i), addr, sizeof(struct in6_addr)) == 0)
+				return TRUE;
+		break;
+	}
+
+	return FALSE;
+}
+
+// ----
+
+static void read_portrange(void)
+{
+	gchar *contents = NULL;
+	unsigned int low, high;
+
+	if (!g_file_get_contents("/proc/sys/net/ipv4/ip_local_port_range", &contents, NULL, NULL))
+		return;
+
+	if (sscanf(contents, "%u %u", &low, &high) == 2 && low <= high && high < 65536) {
+		ephemeral_low = low;
+		ephemeral_high = high;
+	}
+
+	g_free(contents);
+}
+
+static void read_localaddrs(void)
+{
+	struct ifaddrs *ifaddr, *ifa;
+
+	g_array_set_size(localv4, 0);
+	g_array_set_size(localv6, 0);
+
+	if (getifaddrs(&ifaddr) == -1)
+		return;
+
+	for (ifa = ifaddr; ifa != NULL; ifa = ifa->ifa_next) {
+		if (ifa->ifa_addr == NULL)
+			continue;
+		switch (ifa->ifa_addr->sa_family) {
+		case AF_INET:
+			g_array_append_val(localv4, ((struct sockaddr_in *) ifa->ifa_addr)->sin_addr);
+			break;
+		case AF_INET6:
+			g_array_append_val(localv6, ((struct sockaddr_in6 *) ifa->ifa_addr)->sin6_addr);
+			break;
+		}
+	}
+
+	freeifaddrs(ifaddr);
+}
+
+static int listeners_cb(const struct nlmsghdr *nlh, void *data)
+{
+	uint64_t *bitmap = data;
+	struct inet_diag_msg *msg = mnl_nlmsg_get_payload(nlh);
+
+	set_port(bitmap, ntohs(msg->id.idiag_sport));
+
+	return MNL_CB_OK;
+}
+
+static gint dump_listeners(struct mnl_socket *nl, uint8_t family, uint8_t proto,
+			   uint32_t states, uint16_t port, uint64_t *bitmap)
+{
+	int ret;
+	uint32_t seq = time(NULL);
+	unsigned int portid = mnl_socket_get_portid(nl);
+	char buf[MNL_SOCKET_BUFFER_SIZE];
+	struct nlmsghdr *nlh;
+	struct inet_diag_req_v2 *req;
+
+	nlh = mnl_nlmsg_put_header(buf);
+	nlh->nlmsg_type = SOCK_DIAG_BY_FAMILY;
+	nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+	nlh->nlmsg_seq = seq;
+
+	req = mnl_nlmsg_put_extra_header(nlh, sizeof(struct inet_diag_req_v2));
+	req->sdiag_family = family;
+	req->sdiag_protocol = proto;
+	req->idiag_states = states;
+
+	// a single port: source port equal to it (or jump past the end: reject)
+
+	if (port != 0) {
+		struct inet_diag_bc_op ops[2] = {
+			{ INET_DIAG_BC_S_EQ, sizeof(ops), sizeof(ops) + 4 },
+			{ 0, 0, port },
+		};
+		mnl_attr_put(nlh, INET_DIAG_REQ_BYTECODE, sizeof(ops), ops);
+	}
+
+	if (mnl_socket_sendto(nl, nlh, nlh->nlmsg_len) < 0)
+		return ERROR;
+
+	while ((ret = mnl_socket_recvfrom(nl, buf, sizeof(buf))) > 0) {
+		ret = mnl_cb_run(buf, ret, seq, portid, listeners_cb, bitmap);
+		if (ret <= MNL_CB_STOP)
+			break;
+	}
+
+	return ret < 0 ? ERROR : SUCCESS;
+}
+
+static void read_listeners(void)
+{
+	gint ret = 0;
+	struct mnl_socket *nl;
+	struct listeners *new;
+
+	nl = mnl_socket_open(NETLINK_SOCK_DIAG);
+	if (nl == NULL)
+		return;
+
+	if (mnl_socket_bind(nl, 0, MNL_SOCKET_AUTOPID) < 0)
+		goto out;
+
+	new = g_malloc0(sizeof(struct listeners));
+
+	// TCP sockets listening and UDP sockets not connected
+
+	ret |= dump_listeners(nl, AF_INET, IPPROTO_TCP, 1 << TCP_LISTEN, 0, new->tcp);
+	ret |= dump_listeners(nl, AF_INET6, IPPROTO_TCP, 1 << TCP_LISTEN, 0, new->tcp);
+	ret |= dump_listeners(nl, AF_INET, IPPROTO_UDP, 1 << TCP_CLOSE, 0, new->udp);
+	ret |= dump_listeners(nl, AF_INET6, IPPROTO_UDP, 1 << TCP_CLOSE, 0, new->udp);
+
+	// keep the previous view if the dump failed
+
+	if (ret == SUCCESS) {
+		g_free(listening);
+		listening = new;
+	} else {
+		debug("could not dump listening sockets");
+		g_free(new);
+	}
+
+out:
+	mnl_socket_close(nl);
+}
+
+static void refresh_ports(void)
+{
+	read_portrange();
+	read_localaddrs();
+	read_listeners();
+}
+
+static gint refresh_ports_wrap(gpointer data)
+{
+	refresh_ports();
+
+	// keep the timeout callback
+
+	return TRUE;
+}
+
+static gboolean refresh_port(uint8_t proto, uint16_t port)
+{
+	gint ret = 0;
+	gint64 second = g_get_monotonic_time() / G_USEC_PER_SEC;
+	uint32_t states = (proto == IPPROTO_TCP) ? 1 << TCP_LISTEN : 1 << TCP_CLOSE;
+	uint64_t *bitmap = (proto == IPPROTO_TCP) ? listening->tcp : listening->udp;
+	struct mnl_socket *nl;
+
+	if (proto != IPPROTO_TCP && proto != IPPROTO_UDP)
+		return FALSE;
+
+	// only this port, and not too often (the full refresh catches up)
+
+	if (second != earlysecond) {
+		earlysecond = second;
+		earlyqueries = 0;
+	}
+
+	if (earlyqueries++ >= PORTS_EARLY_MAX)
+		return FALSE;
+
+	nl = mnl_socket_open(NETLINK_SOCK_DIAG);
+	if (nl == NULL)
+		return FALSE;
+
+	if (mnl_socket_bind(nl, 0, MNL_SOCKET_AUTOPID) == 0) {
+		ret |= dump_listeners(nl, AF_INET, proto, states, port, bitmap);
+		ret |= dump_listeners(nl, AF_INET6, proto, states, port, bitmap);
+	}
+
+	mnl_socket_close(nl);
+
+	return ret == SUCCESS && is_listening(proto, port);
+}
+
+// ----
+
+uint8_t fold_ports(uint8_t family, uint8_t proto, const void *src, const void *dst,
+		   uint16_t *psrc, uint16_t *pdst)
+{
+	uint16_t sport = ntohs(*psrc);
+	uint16_t dport = ntohs(*pdst);
+	gboolean foldsrc = (sport > FOLDED_PORT);
+	gboolean folddst = FALSE;
+
+	// no listeners or addresses known (another namespace): source only
+
+	if (!localview)
+		goto fold;
+
+	if (is_local(family, dst) && is_listening(proto, dport)) {
+		// local service: source is the client
+		goto fold;
+	}
+
+	if (is_local(family, src) && is_listening(proto, sport)) {
+		// reply side flow from a local service: destination is the client
+		foldsrc = FALSE;
+		folddst = (dport > FOLDED_PORT);
+		goto fold;
+	}
+
+	if (is_local(family, dst) && is_ephemeral(dport)) {
+		// nobody is listening: not a service, unless it just started
+		if (refresh_port(proto, dport))
+			goto fold;
+		folddst = TRUE;
+	}
+
+fold:
+	if (foldsrc)
+		*psrc = htons(FOLDED_PORT);
+	if (folddst)
+		*pdst = htons(FOLDED_PORT);
+
+	// a real service on FOLDED_PORT is not a folded one
+
+	return (foldsrc ? FOLDED_SRC : 0) | (folddst ? FOLDED_DST : 0);
+}
+
+// ----
+
+void alloc_ports(void)
+{
+	listening = g_malloc0(sizeof(struct listeners));
+	localv4 = g_array_new(FALSE, TRUE, sizeof(struct in_addr));
+	localv6 = g_array_new(FALSE, TRUE, sizeof(struct in6_addr));
+
+	refresh_ports();
+
+	ev_add_seconds(PORTS_REFRESH, refresh_ports_wrap, NULL);
+}
+
+void free_ports(void)
+{
+	g_free(listening);
+	g_array_free(localv4, TRUE);
+	g_array_free(localv6, TRUE);
+}
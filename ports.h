@@ -0,0 +1,33 @@
+/*
+ * (C) 2021 by Rafael David Tinoco <rafael.tinoco@ibm.com>
+ * (C) 2021 by Rafael David Tinoco <rafaeldtinoco@ubuntu.com>
+ */
+
+#ifndef PORTS_H_
+#define PORTS_H_
+
+#include "general.h"
+
+#include <ifaddrs.h>
+#include <linux/netlink.h>
+#include <linux/sock_diag.h>
+#include <linux/inet_diag.h>
+#include <libmnl/libmnl.h>
+
+/* all client (non service) ports are logged as this one */
+
+#define FOLDED_PORT 1024
+
+/* which ports were folded (flows keep it: FOLDED_PORT alone is ambiguous) */
+
+#define FOLDED_SRC 0x1
+#define FOLDED_DST 0x2
+
+extern gboolean localview;
+
+uint8_t fold_ports(uint8_t, uint8_t, const void *, const void *, uint16_t *, uint16_t *);
+
+void alloc_ports(void);
+void free_ports(void);
+
+#endif /* PORTS_H_ */
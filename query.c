@@ -0,0 +1,482 @@
+/*
+ * (C) 2021 by Rafael David Tinoco <rafael.tinoco@ibm.com>
+ * (C) 2021 by Rafael David Tinoco <rafaeldtinoco@ubuntu.com>
+ */
+
+#include "query.h"
+#include "flows.h"
+#include "event.h"
+#include "tracesched.h"
+#include "hitters.h"
+#include "seen.h"
+
+/* seqs stored in memory */
+
+extern GSequence *tcpv4flows;
+extern GSequence *udpv4flows;
+extern GSequence *icmpv4flows;
+extern GSequence *tcpv6flows;
+extern GSequence *udpv6flows;
+extern GSequence *icmpv6flows;
+
+/*
+ * Live query interface: a local unix socket accepting one query per
+ * connection (a single line), answered in the same format as the log file:
+ *
+ *   all                        all flows
+ *   port <port>                flows to a destination port
+ *   net <src/len> [dst[/len]]  flows from a source network (to a destination)
+ *   top [count]                destinations with more traffic (bytes, flows)
+ *   sched                      trace scheduler queue depth and wait times
+ *   hitters                    heavy hitters (-k): top destinations, services...
+ *   seen                       seen flows filter (-F) hit rate
+ *
+ *   $ echo "port 443" | sudo nc -U /tmp/conntracker.sock
+ *
+ * Each query is answered by a forked child: it gets a consistent copy-on-write
+ * snapshot of all flows, as they were when the query arrived, and the main
+ * loop goes back to the event ingestion right away (it is never blocked by,
+ * nor it has to lock anything for, a query). The answer is written straight
+ * into the socket while walking the flows, nothing is buffered.
+ */
+
+#define QUERY_TOP 10
+#define QUERY_REAP 10
+
+char *querypath;
+int queryfd = -1;
+
+extern int logfd;
+
+struct query {
+	enum {
+		QUERY_ALL = 0,
+		QUERY_PORT = 1,
+		QUERY_NET = 2,
+	} type;
+	uint8_t family;
+	uint16_t port;
+	struct in6_addr src;
+	struct in6_addr dst;
+	guint srclen;
+	guint dstlen;
+};
+
+struct topdst {
+	uint8_t family;
+	struct in6_addr addr;
+	uint64_t bytes;
+	uint64_t flows;
+};
+
+// ----
+
+static gint parse_prefix(gchar *str, uint8_t *family, struct in6_addr *addr, guint *len)
+{
+	gchar **vector = g_strsplit(str, "/", 2);
+	guint max;
+
+	memset(addr, 0, sizeof(struct in6_addr));
+
+	if (inet_pton(AF_INET, vector[0], addr) == 1) {
+		*family = AF_INET;
+		max = 32;
+	} else if (inet_pton(AF_INET6, vector[0], addr) == 1) {
+		*family = AF_INET6;
+		max = 128;
+	} else {
+		g_strfreev(vector);
+		return ERROR;
+	}
+
+	*len = vector[1] ? (guint) strtoul(vector[1], NULL, 10) : max;
+	*len = MIN(*len, max);
+
+	g_strfreev(vector);
+
+	return SUCCESS;
+}
+
+static gint parse_number(gchar *str, gulong max, gulong *value)
+{
+	gchar *end;
+
+	*value = strtoul(str, &end, 10);
+
+	if (end == str || *end != '\0' || *value > max)
+		return ERROR;
+
+	return SUCCESS;
+}
+
+static gboolean match_prefix(const void *addr, struct in6_addr *net, guint len)
+{
+	const uint8_t *one = addr, *two = net->s6_addr;
+	guint bytes = len / 8, bits = len % 8;
+
+	if (memcmp(one, two, bytes) != 0)
+		return FALSE;
+
+	if (bits == 0)
+		return TRUE;
+
+	return ((one[bytes] ^ two[bytes]) & (0xff << (8 - bits))) == 0;
+}
+
+static gboolean match_query(struct query *q, uint8_t family, const void *src,
+			    const void *dst, uint16_t dport)
+{
+	switch (q->type) {
+	case QUERY_PORT:
+		return dport == q->port;
+	case QUERY_NET:
+		if (family != q->family)
+			return FALSE;
+		if (!match_prefix(src, &q->src, q->srclen))
+			return FALSE;
+		return match_prefix(dst, &q->dst, q->dstlen);
+	default:
+		break;
+	}
+
+	return TRUE;
+}
+
+// ----
+
+void query_tcpv4flows(gpointer data, gpointer user_data)
+{
+	struct tcpv4flow *flow = data;
+
+	if (match_query(user_data, AF_INET, &flow->addrs.src, &flow->addrs.dst, ntohs(flow->base.dst)))
+		out_tcpv4flows(data, NULL);
+}
+
+void query_udpv4flows(gpointer data, gpointer user_data)
+{
+	struct udpv4flow *flow = data;
+
+	if (match_query(user_data, AF_INET, &flow->addrs.src, &flow->addrs.dst, ntohs(flow->base.dst)))
+		out_udpv4flows(data, NULL);
+}
+
+void query_icmpv4flows(gpointer data, gpointer user_data)
+{
+	struct icmpv4flow *flow = data;
+	struct query *q = user_data;
+
+	if (q->type != QUERY_PORT && match_query(q, AF_INET, &flow->addrs.src, &flow->addrs.dst, 0))
+		out_icmpv4flows(data, NULL);
+}
+
+void query_tcpv6flows(gpointer data, gpointer user_data)
+{
+	struct tcpv6flow *flow = data;
+
+	if (match_query(user_data, AF_INET6, &flow->addrs.src, &flow->addrs.dst, ntohs(flow->base.dst)))
+		out_tcpv6flows(data, NULL);
+}
+
+void query_udpv6flows(gpointer data, gpointer user_data)
+{
+	struct udpv6flow *flow = data;
+
+	if (match_query(user_data, AF_INET6, &flow->addrs.src, &flow->addrs.dst, ntohs(flow->base.dst)))
+		out_udpv6flows(data, NULL);
+}
+
+void query_icmpv6flows(gpointer data, gpointer user_data)
+{
+	struct icmpv6flow *flow = data;
+	struct query *q = user_data;
+
+	if (q->type != QUERY_PORT && match_query(q, AF_INET6, &flow->addrs.src, &flow->addrs.dst, 0))
+		out_icmpv6flows(data, NULL);
+}
+
+// ----
+
+static void add_topdst(GHashTable *dsts, uint8_t family, const void *addr, struct flowstats *st)
+{
+	gchar *key;
+	struct topdst *top;
+
+	key = family == AF_INET ? ipv4_str((struct in_addr *) addr) : ipv6_str((struct in6_addr *) addr);
+	top = g_hash_table_lookup(dsts, key);
+
+	if (top == NULL) {
+		top = g_malloc0(sizeof(struct topdst));
+		top->family = family;
+		memcpy(&top->addr, addr, family == AF_INET ? sizeof(struct in_addr) : sizeof(struct in6_addr));
+		g_hash_table_insert(dsts, key, top);
+	} else {
+		g_free(key);
+	}
+
+	top->bytes += st->bytes;
+	top->flows++;
+}
+
+void top_tcpv4flows(gpointer data, gpointer user_data)
+{
+	struct tcpv4flow *flow = data;
+	add_topdst(user_data, AF_INET, &flow->addrs.dst, &flow->stats);
+}
+
+void top_udpv4flows(gpointer data, gpointer user_data)
+{
+	struct udpv4flow *flow = data;
+	add_topdst(user_data, AF_INET, &flow->addrs.dst, &flow->stats);
+}
+
+void top_icmpv4flows(gpointer data, gpointer user_data)
+{
+	struct icmpv4flow *flow = data;
+	add_topdst(user_data, AF_INET, &flow->addrs.dst, &flow->stats);
+}
+
+void top_tcpv6flows(gpointer data, gpointer user_data)
+{
+	struct tcpv6flow *flow = data;
+	add_topdst(user_data, AF_INET6, &flow->addrs.dst, &flow->stats);
+}
+
+void top_udpv6flows(gpointer data, gpointer user_data)
+{
+	struct udpv6flow *flow = data;
+	add_topdst(user_data, AF_INET6, &flow->addrs.dst, &flow->stats);
+}
+
+void top_icmpv6flows(gpointer data, gpointer user_data)
+{
+	struct icmpv6flow *flow = data;
+	add_topdst(user_data, AF_INET6, &flow->addrs.dst, &flow->stats);
+}
+
+static gint cmp_topdst(gconstpointer ptr_one, gconstpointer ptr_two)
+{
+	const struct topdst *one = *(struct topdst **) ptr_one;
+	const struct topdst *two = *(struct topdst **) ptr_two;
+
+	if (one->bytes != two->bytes)
+		return one->bytes > two->bytes ? LESS : MORE;
+	if (one->flows != two->flows)
+		return one->flows > two->flows ? LESS : MORE;
+
+	return EQUAL;
+}
+
+static void out_topdst(guint count)
+{
+	guint i;
+	gchar *dst;
+	GList *values, *value;
+	GHashTable *dsts;
+	GPtrArray *sorted;
+	struct topdst *top;
+
+	dsts = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+
+	g_sequence_foreach(tcpv4flows, top_tcpv4flows, dsts);
+	g_sequence_foreach(udpv4flows, top_udpv4flows, dsts);
+	g_sequence_foreach(icmpv4flows, top_icmpv4flows, dsts);
+	g_sequence_foreach(tcpv6flows, top_tcpv6flows, dsts);
+	g_sequence_foreach(udpv6flows, top_udpv6flows, dsts);
+	g_sequence_foreach(icmpv6flows, top_icmpv6flows, dsts);
+
+	sorted = g_ptr_array_sized_new(g_hash_table_size(dsts));
+	values = g_hash_table_get_values(dsts);
+
+	for (value = values; value != NULL; value = value->next)
+		g_ptr_array_add(sorted, value->data);
+
+	g_list_free(values);
+	g_ptr_array_sort(sorted, cmp_topdst);
+
+	for (i = 0; i < sorted->len && i < count; i++) {
+		top = g_ptr_array_index(sorted, i);
+		dst = top->family == AF_INET ? ipv4_str((struct in_addr *) &top->addr) : ipv6_str(&top->addr);
+		dprintf(logfd, "%s: flows: %" PRIu64 ", bytes: %" PRIu64 "\n", dst, top->flows, top->bytes);
+		g_free(dst);
+	}
+
+	g_ptr_array_free(sorted, TRUE);
+	g_hash_table_destroy(dsts);
+}
+
+// ----
+
+static gint run_query(gchar *line)
+{
+	gint ret = SUCCESS;
+	uint8_t family;
+	gulong number = QUERY_TOP;
+	gchar **vector = g_strsplit_set(g_strstrip(line), " \t", -1);
+	guint words = g_strv_length(vector);
+	struct query q;
+
+	memset(&q, 0, sizeof(struct query));
+
+	if (words == 0 || g_ascii_strcasecmp("all", vector[0]) == 0) {
+		q.type = QUERY_ALL;
+	} else if (g_ascii_strcasecmp("port", vector[0]) == 0 && words == 2) {
+		q.type = QUERY_PORT;
+		ret = parse_number(vector[1], G_MAXUINT16, &number);
+		q.port = (uint16_t) number;
+	} else if (g_ascii_strcasecmp("net", vector[0]) == 0 && words >= 2) {
+		q.type = QUERY_NET;
+		ret |= parse_prefix(vector[1], &q.family, &q.src, &q.srclen);
+		if (words > 2) {
+			ret |= parse_prefix(vector[2], &family, &q.dst, &q.dstlen);
+			if (family != q.family)
+				ret = ERROR;
+		}
+	} else if (g_ascii_strcasecmp("top", vector[0]) == 0) {
+		if (words > 1)
+			ret = parse_number(vector[1], G_MAXUINT, &number);
+		if (ret == SUCCESS) {
+			out_topdst((guint) number);
+			goto end;
+		}
+	} else if (g_ascii_strcasecmp("sched", vector[0]) == 0) {
+		query_sched();
+		goto end;
+	} else if (g_ascii_strcasecmp("hitters", vector[0]) == 0) {
+		out_hitters();
+		goto end;
+	} else if (g_ascii_strcasecmp("seen", vector[0]) == 0) {
+		query_seen();
+		goto end;
+	} else {
+		ret = ERROR;
+	}
+
+	if (ret == ERROR) {
+		dprintf(logfd, "usage: all | port <port> | net <src/len> [dst[/len]] | top [count] | sched | hitters | seen\n");
+		goto end;
+	}
+
+	g_sequence_foreach(tcpv4flows, query_tcpv4flows, &q);
+	g_sequence_foreach(udpv4flows, query_udpv4flows, &q);
+	g_sequence_foreach(icmpv4flows, query_icmpv4flows, &q);
+	g_sequence_foreach(tcpv6flows, query_tcpv6flows, &q);
+	g_sequence_foreach(udpv6flows, query_udpv6flows, &q);
+	g_sequence_foreach(icmpv6flows, query_icmpv6flows, &q);
+
+end:
+	g_strfreev(vector);
+
+	return ret;
+}
+
+static void query_child(int client)
+{
+	FILE *in;
+	gchar line[256];
+
+	// the snapshot must not touch the firewall rules when finishing
+
+	signal(SIGINT, SIG_DFL);
+	signal(SIGTERM, SIG_DFL);
+
+	close(queryfd);
+
+	in = fdopen(client, "r");
+	if (in == NULL || fgets(line, sizeof(line), in) == NULL)
+		_exit(ERROR);
+
+	// all output functions write into logfd: point it to the client
+
+	logfd = client;
+
+	_exit(run_query(line) == SUCCESS ? SUCCESS : EXIT_FAILURE);
+}
+
+static void query_reap(void)
+{
+	// collect finished query children (system() reaps its own ones)
+
+	while (waitpid(-1, NULL, WNOHANG) > 0)
+		;
+}
+
+static gint query_reap_wrap(gpointer data)
+{
+	query_reap();
+
+	// keep the timeout callback
+
+	return TRUE;
+}
+
+gboolean querycb(GIOChannel *source, GIOCondition condition, gpointer data)
+{
+	int client;
+
+	query_reap();
+
+	client = accept(queryfd, NULL, NULL);
+	if (client < 0)
+		return TRUE;
+
+	switch (fork()) {
+	case -1:
+		debug("could not fork query snapshot");
+		break;
+	case 0:
+		query_child(client);
+		break;
+	default:
+		break;
+	}
+
+	close(client);
+
+	// return FALSE to stop event source, TRUE not to
+	return TRUE;
+}
+
+// ----
+
+gint query_open(void)
+{
+	struct sockaddr_un addr;
+
+	memset(&addr, 0, sizeof(struct sockaddr_un));
+	addr.sun_family = AF_UNIX;
+	g_strlcpy(addr.sun_path, querypath, sizeof(addr.sun_path));
+
+	queryfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (queryfd < 0)
+		return ERROR;
+
+	unlink(querypath);
+
+	if (bind(queryfd, (struct sockaddr *) &addr, sizeof(struct sockaddr_un)) < 0)
+		goto err;
+	if (listen(queryfd, 16) < 0)
+		goto err;
+
+	ev_add_io(queryfd, querycb, NULL);
+
+	ev_add_seconds(QUERY_REAP, query_reap_wrap, NULL);
+
+	syslogwrap("Answering queries at: %s", querypath);
+
+	return SUCCESS;
+
+err:
+	close(queryfd);
+	queryfd = -1;
+
+	return ERROR;
+}
+
+void query_close(void)
+{
+	if (queryfd < 0)
+		return;
+
+	close(queryfd);
+	unlink(querypath);
+}
@@ -0,0 +1,19 @@
+/*
+ * (C) 2021 by Rafael David Tinoco <rafael.tinoco@ibm.com>
+ * (C) 2021 by Rafael David Tinoco <rafaeldtinoco@ubuntu.com>
+ */
+
+#ifndef QUERY_H_
+#define QUERY_H_
+
+#include "general.h"
+
+#include <sys/un.h>
+#include <sys/wait.h>
+
+extern char *querypath;
+
+gint query_open(void);
+void query_close(void);
+
+#endif /* QUERY_H_ */
@@ -0,0 +1,521 @@
+/*
+ * (C) 2021 by Rafael David Tinoco <rafael.tinoco@ibm.com>
+ * (C) 2021 by Rafael David Tinoco <rafaeldtinoco@ubuntu.com>
+ */
+
+#include "ruleidx.h"
+#include "event.h"
+#include "netns.h"
+#include "iptables.h"
+
+#include <linux/netfilter/nf_tables.h>
+
+/*
+ * Rule attribution (-i): footprints say "filter, INPUT, rule, position 7",
+ * this index tells which rule that is.
+ *
+ * - the ruleset (iptables-save and ip6tables-save) is read once and indexed
+ *   by (family, table, chain, position), the same coordinates TRACE gives.
+ *   Policies (and the implicit return of user chains) sit right after the
+ *   last rule of their chain, as TRACE counts them
+ * - each load is a generation, stamped into the footprints observed under
+ *   it: positions shift as rules change, a footprint is resolved against the
+ *   ruleset it was observed with (the last RULEIDX_KEEP generations are kept)
+ * - a rule keeps the generation it appeared in (since) for as long as the
+ *   same text sits at the same coordinates, and footprints are stamped with
+ *   it (ruleidx_stamp): reloads don't turn an unchanged rule into a new
+ *   footprint, a changed one (or another rule shifted into its place) is
+ * - nf_tables change notifications (NFNLGRP_NFTABLES) drive the reloads:
+ *   nothing is read again unless a rule, chain or table changed, and all
+ *   changes within RULEIDX_SETTLE msecs become a single reload. Conntracker
+ *   adds and removes its own TRACE rules (raw table) all the time: those are
+ *   told apart by their comment (TRACE_COMMENT, kept in the rule userdata)
+ *   and ignored, any other change (raw table included) counts
+ *
+ * Note: iptables-legacy has no change notifications, its ruleset is only
+ * read when starting. Like rulesets, the index covers the initial namespace.
+ */
+
+gboolean ruleattr;
+
+#define RULEIDX_UDATA_COMMENT 0	// libnftnl rule userdata: comment (NUL ended)
+
+struct rulegen {
+	guint gen;
+	GHashTable *rules;		// "family table chain position" -> ruleentry
+};
+
+struct ruleentry {
+	gchar *text;
+	guint since;			// generation the same text got there
+};
+
+struct rulechain {
+	gchar *name;
+	gchar *policy;
+	guint rules;
+};
+
+GPtrArray *rulegens;			// oldest first
+volatile gint rulegen;			// current generation (read by workers)
+
+struct mnl_socket *rulenl;
+guint rulenlid;
+guint rulereloadid;
+gboolean rulechanged;
+
+struct rulestats {
+	guint rules;
+	uint64_t reloads;
+	uint64_t notifications;
+	uint64_t ignored;
+	uint32_t kernelgen;
+} rulestats;
+
+// ----
+
+static uint8_t table_id(const gchar *name)
+{
+	if (g_strcmp0(name, "raw") == 0)
+		return FOOTPRINT_TABLE_RAW;
+	if (g_strcmp0(name, "mangle") == 0)
+		return FOOTPRINT_TABLE_MANGLE;
+	if (g_strcmp0(name, "nat") == 0)
+		return FOOTPRINT_TABLE_NAT;
+	if (g_strcmp0(name, "filter") == 0)
+		return FOOTPRINT_TABLE_FILTER;
+
+	return FOOTPRINT_TABLE_UNKNOWN;
+}
+
+static gchar *rule_key(uint8_t family, uint8_t table, const gchar *chain, uint32_t position)
+{
+	gchar name[sizeof(((struct footprint *) NULL)->chain)];
+
+	// chain names are truncated in footprints: the keys too
+
+	g_strlcpy(name, chain, sizeof(name));
+
+	return g_strdup_printf("%u %u %s %u", family, table, name, position);
+}
+
+static struct ruleentry *new_ruleentry(gchar *text)
+{
+	struct ruleentry *entry = g_new0(struct ruleentry, 1);
+
+	entry->text = text;
+
+	return entry;
+}
+
+static void free_ruleentry(gpointer data)
+{
+	struct ruleentry *entry = data;
+
+	g_free(entry->text);
+	g_free(entry);
+}
+
+static void free_rulechain(gpointer data)
+{
+	struct rulechain *chain = data;
+
+	g_free(chain->name);
+	g_free(chain->policy);
+	g_free(chain);
+}
+
+static void rule_commit(GHashTable *rules, uint8_t family, uint8_t table, GPtrArray *chains)
+{
+	guint i;
+	gchar *text;
+	struct rulechain *chain;
+
+	// TRACE: the policy (or user chain return) comes after the last rule
+
+	for (i = 0; i < chains->len; i++) {
+		chain = g_ptr_array_index(chains, i);
+
+		if (g_strcmp0(chain->policy, "-") == 0)
+			text = g_strdup_printf("(end of %s, return)", chain->name);
+		else
+			text = g_strdup_printf(":%s %s (policy)", chain->name, chain->policy);
+
+		g_hash_table_replace(rules, rule_key(family, table, chain->name, chain->rules + 1),
+				     new_ruleentry(text));
+	}
+
+	g_ptr_array_set_size(chains, 0);
+}
+
+static gint rule_load(GHashTable *rules, uint8_t family, const gchar *cmd)
+{
+	FILE *in;
+	gchar line[4096], **words;
+	uint8_t table = FOOTPRINT_TABLE_UNKNOWN;
+	struct rulechain *chain;
+	GPtrArray *chains;
+	guint i;
+
+	in = popen(cmd, "r");
+
+	if (in == NULL)
+		return ERROR;
+
+	chains = g_ptr_array_new_with_free_func(free_rulechain);
+
+	while (fgets(line, sizeof(line), in) != NULL) {
+		g_strchomp(line);
+
+		switch (line[0]) {
+		case '*':
+			table = table_id(line + 1);
+			break;
+		case ':':
+			words = g_strsplit(line + 1, " ", 3);
+			if (g_strv_length(words) >= 2) {
+				chain = g_new0(struct rulechain, 1);
+				chain->name = g_strdup(words[0]);
+				chain->policy = g_strdup(words[1]);
+				g_ptr_array_add(chains, chain);
+			}
+			g_strfreev(words);
+			break;
+		case '-':
+			words = g_strsplit(line, " ", 3);
+			if (g_strv_length(words) >= 2 && g_strcmp0(words[0], "-A") == 0) {
+				for (i = 0; i < chains->len; i++) {
+					chain = g_ptr_array_index(chains, i);
+					if (g_strcmp0(chain->name, words[1]) != 0)
+						continue;
+					chain->rules++;
+					g_hash_table_replace(rules, rule_key(family, table, chain->name, chain->rules),
+							     new_ruleentry(g_strdup(line)));
+					break;
+				}
+			}
+			g_strfreev(words);
+			break;
+		default:
+			if (g_strcmp0(line, "COMMIT") == 0)
+				rule_commit(rules, family, table, chains);
+			break;
+		}
+	}
+
+	g_ptr_array_free(chains, TRUE);
+
+	if (pclose(in) != 0)
+		return ERROR;
+
+	return SUCCESS;
+}
+
+static void free_rulegen(gpointer data)
+{
+	struct rulegen *gen = data;
+
+	g_hash_table_destroy(gen->rules);
+	g_free(gen);
+}
+
+static void rule_since(struct rulegen *gen, struct rulegen *prev)
+{
+	gpointer key, value;
+	GHashTableIter iter;
+	struct ruleentry *entry, *old;
+
+	// unchanged rules (same text, same place) keep their generation
+
+	g_hash_table_iter_init(&iter, gen->rules);
+
+	while (g_hash_table_iter_next(&iter, &key, &value)) {
+		entry = value;
+		old = prev != NULL ? g_hash_table_lookup(prev->rules, key) : NULL;
+		entry->since = (old != NULL && g_strcmp0(old->text, entry->text) == 0) ? old->since : gen->gen;
+	}
+}
+
+static void ruleidx_load(void)
+{
+	gint ret = 0;
+	struct rulegen *gen = g_new0(struct rulegen, 1);
+
+	gen->rules = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, free_ruleentry);
+	gen->gen = (guint) g_atomic_int_get(&rulegen) + 1;
+
+	ret |= rule_load(gen->rules, AF_INET, "iptables-save 2>/dev/null");
+	ret |= rule_load(gen->rules, AF_INET6, "ip6tables-save 2>/dev/null");
+
+	if (ret == ERROR)
+		syslogwrap("Rule index: could not read the whole ruleset");
+
+	rule_since(gen, rulegens->len > 0 ? g_ptr_array_index(rulegens, rulegens->len - 1) : NULL);
+
+	g_ptr_array_add(rulegens, gen);
+
+	while (rulegens->len > RULEIDX_KEEP)
+		g_ptr_array_remove_index(rulegens, 0);
+
+	rulestats.rules = g_hash_table_size(gen->rules);
+	rulestats.reloads++;
+
+	// from now on footprints are stamped with this generation
+
+	g_atomic_int_set(&rulegen, (gint) gen->gen);
+}
+
+// ----
+
+static gboolean ruleidx_reload(gpointer data)
+{
+	rulereloadid = 0;
+
+	ruleidx_load();
+
+	// return FALSE to stop event source, TRUE not to
+	return FALSE;
+}
+
+static void ruleidx_changed(void)
+{
+	rulechanged = FALSE;
+
+	if (rulereloadid == 0)
+		rulereloadid = ev_add_timeout(RULEIDX_SETTLE, ruleidx_reload, NULL);
+}
+
+static int ruleidx_attr_cb(const struct nlattr *attr, void *data)
+{
+	const struct nlattr **attrs = data;
+
+	// gen id is the 1st attribute of gens, userdata only matters for rules
+
+	switch (mnl_attr_get_type(attr)) {
+	case NFTA_GEN_ID:
+		attrs[0] = attr;
+		break;
+	case NFTA_RULE_USERDATA:
+		attrs[1] = attr;
+		break;
+	}
+
+	return MNL_CB_OK;
+}
+
+static gboolean rule_own(const struct nlattr *udata)
+{
+	guint len;
+	const uint8_t *tlv;
+
+	if (udata == NULL)
+		return FALSE;
+
+	// userdata: type (1 byte), length (1 byte), value... (libnftnl)
+
+	tlv = mnl_attr_get_payload(udata);
+	len = mnl_attr_get_payload_len(udata);
+
+	while (len >= 2 && (guint) tlv[1] + 2 <= len) {
+		if (tlv[0] == RULEIDX_UDATA_COMMENT && tlv[1] == sizeof(TRACE_COMMENT) &&
+		    memcmp(tlv + 2, TRACE_COMMENT, sizeof(TRACE_COMMENT)) == 0)
+			return TRUE;
+		len -= tlv[1] + 2;
+		tlv += tlv[1] + 2;
+	}
+
+	return FALSE;
+}
+
+static int ruleidx_nlmsg_cb(const struct nlmsghdr *nlh, void *data)
+{
+	const struct nlattr *attrs[2] = { NULL, NULL };
+	const struct nlattr *attr;
+
+	if (NFNL_SUBSYS_ID(nlh->nlmsg_type) != NFNL_SUBSYS_NFTABLES)
+		return MNL_CB_OK;
+
+	if (mnl_attr_parse(nlh, sizeof(struct nfgenmsg), ruleidx_attr_cb, attrs) < 0)
+		return MNL_CB_OK;
+
+	attr = attrs[0];
+
+	rulestats.notifications++;
+
+	switch (NFNL_MSG_TYPE(nlh->nlmsg_type)) {
+	case NFT_MSG_NEWRULE:
+	case NFT_MSG_DELRULE:
+		// conntracker's own TRACE rules don't count
+		if (rule_own(attrs[1])) {
+			rulestats.ignored++;
+			break;
+		}
+		rulechanged = TRUE;
+		break;
+	case NFT_MSG_NEWTABLE:
+	case NFT_MSG_DELTABLE:
+	case NFT_MSG_NEWCHAIN:
+	case NFT_MSG_DELCHAIN:
+		rulechanged = TRUE;
+		break;
+	case NFT_MSG_NEWGEN:
+		// end of a transaction: NFTA_GEN_ID is the 1st attribute as well
+		if (attr != NULL && mnl_attr_validate(attr, MNL_TYPE_U32) >= 0)
+			rulestats.kernelgen = ntohl(mnl_attr_get_u32(attr));
+		if (rulechanged)
+			ruleidx_changed();
+		break;
+	default:
+		break;
+	}
+
+	return MNL_CB_OK;
+}
+
+static gboolean ruleidx_iocb(GIOChannel *source, GIOCondition condition, gpointer data)
+{
+	gint ret;
+	unsigned char buf[MNL_SOCKET_BUFFER_SIZE] __attribute__ ((aligned));
+
+	ret = mnl_socket_recvfrom(rulenl, buf, sizeof(buf));
+
+	if (ret < 0) {
+		// lost notifications: whatever they were, read the ruleset again
+		if (errno == ENOBUFS) {
+			ruleidx_changed();
+			return TRUE;
+		}
+		return errno == EINTR;
+	}
+
+	mnl_cb_run(buf, ret, 0, 0, ruleidx_nlmsg_cb, NULL);
+
+	// return FALSE to stop event source, TRUE not to
+	return TRUE;
+}
+
+// ----
+
+guint ruleidx_generation(void)
+{
+	return (guint) g_atomic_int_get(&rulegen);
+}
+
+void ruleidx_stamp(uint8_t family, struct footprint *fp)
+{
+	guint i;
+	gchar *key;
+	struct rulegen *gen;
+	struct ruleentry *entry;
+	struct netns *ns = netns_current();
+
+	if (rulegens == NULL || fp->gen == 0)
+		return;
+	if (ns != NULL && ns->name != NULL)
+		return;
+
+	// observed under fp->gen: the generation its rule has been there since
+
+	for (i = rulegens->len; i > 0; i--) {
+		gen = g_ptr_array_index(rulegens, i - 1);
+		if (gen->gen != fp->gen)
+			continue;
+
+		key = rule_key(family, fp->table, fp->chain, fp->position);
+		entry = g_hash_table_lookup(gen->rules, key);
+		g_free(key);
+
+		if (entry != NULL)
+			fp->gen = entry->since;
+		break;
+	}
+}
+
+const gchar *ruleidx_lookup(uint8_t family, struct footprint *fp, gboolean *current)
+{
+	guint i;
+	gchar *key;
+	const gchar *text = NULL;
+	struct rulegen *gen;
+	struct ruleentry *entry;
+	struct netns *ns = netns_current();
+
+	if (rulegens == NULL || fp->gen == 0)
+		return NULL;
+	if (ns != NULL && ns->name != NULL)
+		return NULL;
+
+	key = rule_key(family, fp->table, fp->chain, fp->position);
+
+	// newest generation still holding the same rule (stamped with its since)
+
+	for (i = rulegens->len; i > 0; i--) {
+		gen = g_ptr_array_index(rulegens, i - 1);
+		entry = g_hash_table_lookup(gen->rules, key);
+
+		if (entry == NULL || entry->since != fp->gen)
+			continue;
+
+		text = entry->text;
+		*current = (i == rulegens->len);
+		break;
+	}
+
+	g_free(key);
+
+	return text;
+}
+
+gint alloc_ruleidx(void)
+{
+	if (!ruleattr)
+		return SUCCESS;
+
+	rulegens = g_ptr_array_new_with_free_func(free_rulegen);
+
+	ruleidx_load();
+
+	// nf_tables change notifications (iptables-nft and nft)
+
+	rulenl = mnl_socket_open(NETLINK_NETFILTER);
+
+	if (rulenl == NULL)
+		return ERROR;
+
+	if (mnl_socket_bind(rulenl, 1 << (NFNLGRP_NFTABLES - 1), MNL_SOCKET_AUTOPID) < 0) {
+		mnl_socket_close(rulenl);
+		rulenl = NULL;
+		return ERROR;
+	}
+
+	rulenlid = ev_add_io(mnl_socket_get_fd(rulenl), ruleidx_iocb, NULL);
+
+	return SUCCESS;
+}
+
+void free_ruleidx(void)
+{
+	if (rulereloadid != 0)
+		ev_remove(rulereloadid);
+	if (rulenlid != 0)
+		ev_remove(rulenlid);
+	if (rulenl != NULL)
+		mnl_socket_close(rulenl);
+	if (rulegens != NULL)
+		g_ptr_array_free(rulegens, TRUE);
+
+	rulereloadid = 0;
+	rulenlid = 0;
+	rulenl = NULL;
+	rulegens = NULL;
+}
+
+void out_ruleidx(void)
+{
+	if (!ruleattr)
+		return;
+
+	syslogwrap("Rule index: generation %u (%u rules), %" PRIu64 " reloads, %" PRIu64 " notifications "
+		   "(%" PRIu64 " ignored), nf_tables generation %u", ruleidx_generation(), rulestats.rules,
+		   rulestats.reloads, rulestats.notifications, rulestats.ignored, rulestats.kernelgen);
+}
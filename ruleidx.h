@@ -0,0 +1,27 @@
+/*
+ * (C) 2021 by Rafael David Tinoco <rafael.tinoco@ibm.com>
+ * (C) 2021 by Rafael David Tinoco <rafaeldtinoco@ubuntu.com>
+ */
+
+#ifndef RULEIDX_H_
+#define RULEIDX_H_
+
+#include "general.h"
+#include "footprint.h"
+
+#include <libmnl/libmnl.h>
+
+#define RULEIDX_KEEP 8			// ruleset generations kept
+#define RULEIDX_SETTLE 1000		// msecs: changes coalesced into a reload
+
+extern gboolean ruleattr;
+
+guint ruleidx_generation(void);
+void ruleidx_stamp(uint8_t, struct footprint *);
+const gchar *ruleidx_lookup(uint8_t, struct footprint *, gboolean *);
+
+gint alloc_ruleidx(void);
+void free_ruleidx(void);
+void out_ruleidx(void);
+
+#endif /* RULEIDX_H_ */
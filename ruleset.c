@@ -0,0 +1,534 @@
+/*
+ * (C) 2021 by Rafael David Tinoco <rafael.tinoco@ibm.com>
+ * (C) 2021 by Rafael David Tinoco <rafaeldtinoco@ubuntu.com>
+ */
+
+#include "ruleset.h"
+#include "flows.h"
+#include "ports.h"
+
+/* seqs stored in memory */
+
+extern GSequence *tcpv4flows;
+extern GSequence *udpv4flows;
+extern GSequence *icmpv4flows;
+extern GSequence *tcpv6flows;
+extern GSequence *udpv6flows;
+extern GSequence *icmpv6flows;
+
+/*
+ * Ruleset generator: compile the observed flows into a loadable ruleset.
+ *
+ * Flows are grouped by (family, protocol, destination port or icmp type).
+ * Each group becomes a set of (source, destination) address pairs, with
+ * duplicates removed, and groups are ordered by observed traffic (bytes,
+ * then packets, then number of flows) so the most hit ones come first.
+ *
+ * nftables: a single "flows" chain has one verdict map per family and
+ * protocol, keyed by destination port (or icmp type), jumping to a chain
+ * per group that looks the address pair up in the group set. No matter how
+ * many flows were observed, a packet costs 2 lookups. Folded (client side)
+ * destination ports are a range, overlapping the service ports of the map,
+ * so that group gets a rule of its own, after the map.
+ *
+ * Only confirmed flows (a reply was seen) become rules.
+ *
+ *   $ sudo nft -f <file>
+ *   $ sudo nft add rule inet conntracker <hook chain> jump flows
+ *
+ * iptables: one rule per group in a CONNTRACKER chain, matching the group
+ * ipset (hash:ip,ip). Rules for IPv4 go to <file>, IPv6 to <file>.v6 and
+ * the ipsets to <file>.ipset:
+ *
+ *   $ sudo ipset restore < <file>.ipset
+ *   $ sudo iptables-restore -n < <file>
+ *   $ sudo ip6tables-restore -n < <file>.v6
+ */
+
+char *rulesfile;
+int rulesformat;
+
+struct rulegroup {
+	uint8_t family;
+	uint8_t proto;
+	uint16_t port;
+	uint8_t folded;			// client side ports: any unprivileged one
+	uint64_t packets;
+	uint64_t bytes;
+	GHashTable *pairs;
+};
+
+gint set_rulesformat(char *format)
+{
+	if (g_ascii_strcasecmp("nft", format) == 0)
+		rulesformat = RULESET_NFT;
+	else if (g_ascii_strcasecmp("iptables", format) == 0)
+		rulesformat = RULESET_IPTABLES;
+	else
+		return ERROR;
+
+	return SUCCESS;
+}
+
+// ----
+
+static gchar *proto_str(uint8_t proto)
+{
+	switch (proto) {
+	case IPPROTO_TCP:
+		return "tcp";
+	case IPPROTO_UDP:
+		return "udp";
+	case IPPROTO_ICMP:
+		return "icmp";
+	case IPPROTO_ICMPV6:
+		return "icmpv6";
+	}
+
+	return "unknown";
+}
+
+static gchar *group_name(struct rulegroup *group)
+{
+	if (group->folded)
+		return g_strdup_printf("%s%c_folded", proto_str(group->proto),
+				group->family == AF_INET ? '4' : '6');
+
+	return g_strdup_printf("%s%c_%u", proto_str(group->proto),
+			group->family == AF_INET ? '4' : '6', group->port);
+}
+
+static gboolean has_ports(struct rulegroup *group)
+{
+	return group->proto == IPPROTO_TCP || group->proto == IPPROTO_UDP;
+}
+
+static void free_rulegroup(gpointer data)
+{
+	struct rulegroup *group = data;
+
+	g_hash_table_destroy(group->pairs);
+	g_free(group);
+}
+
+static void add_rulegroup(GHashTable *groups, uint8_t family, uint8_t proto, uint16_t port,
+			  uint8_t folded, const void *src, const void *dst, struct flowstats *st)
+{
+	gchar *strsrc, *strdst, *pair;
+	struct rulegroup *group;
+	guint key = (folded ? 1U << 31 : 0) | (family << 24) | (proto << 16) | port;
+
+	group = g_hash_table_lookup(groups, GUINT_TO_POINTER(key));
+
+	if (group == NULL) {
+		group = g_malloc0(sizeof(struct rulegroup));
+		group->family = family;
+		group->proto = proto;
+		group->port = port;
+		group->folded = folded;
+		group->pairs = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+		g_hash_table_insert(groups, GUINT_TO_POINTER(key), group);
+	}
+
+	group->packets += st->packets;
+	group->bytes += st->bytes;
+
+	// deduplicate address pairs (flows differing only by source port)
+
+	if (family == AF_INET) {
+		strsrc = ipv4_str((struct in_addr *) src);
+		strdst = ipv4_str((struct in_addr *) dst);
+	} else {
+		strsrc = ipv6_str((struct in6_addr *) src);
+		strdst = ipv6_str((struct in6_addr *) dst);
+	}
+
+	pair = g_strdup_printf("%s %s", strsrc, strdst);
+
+	if (g_hash_table_contains(group->pairs, pair))
+		g_free(pair);
+	else
+		g_hash_table_insert(group->pairs, pair, NULL);
+
+	g_free(strsrc);
+	g_free(strdst);
+}
+
+// ----
+
+void rule_tcpv4flows(gpointer data, gpointer user_data)
+{
+	struct tcpv4flow *flow = data;
+
+	// unconfirmed flows (no reply seen) are not allowed traffic
+
+	if (!flow->foots.reply)
+		return;
+
+	add_rulegroup(user_data, AF_INET, IPPROTO_TCP, ntohs(flow->base.dst),
+			flow->base.folded & FOLDED_DST, &flow->addrs.src, &flow->addrs.dst, &flow->stats);
+}
+
+void rule_udpv4flows(gpointer data, gpointer user_data)
+{
+	struct udpv4flow *flow = data;
+
+	// unconfirmed flows (no reply seen) are not allowed traffic
+
+	if (!flow->foots.reply)
+		return;
+
+	add_rulegroup(user_data, AF_INET, IPPROTO_UDP, ntohs(flow->base.dst),
+			flow->base.folded & FOLDED_DST, &flow->addrs.src, &flow->addrs.dst, &flow->stats);
+}
+
+void rule_icmpv4flows(gpointer data, gpointer user_data)
+{
+	struct icmpv4flow *flow = data;
+
+	// unconfirmed flows (no reply seen) are not allowed traffic
+
+	if (!flow->foots.reply)
+		return;
+
+	add_rulegroup(user_data, AF_INET, IPPROTO_ICMP, flow->base.type,
+			FALSE, &flow->addrs.src, &flow->addrs.dst, &flow->stats);
+}
+
+void rule_tcpv6flows(gpointer data, gpointer user_data)
+{
+	struct tcpv6flow *flow = data;
+
+	// unconfirmed flows (no reply seen) are not allowed traffic
+
+	if (!flow->foots.reply)
+		return;
+
+	add_rulegroup(user_data, AF_INET6, IPPROTO_TCP, ntohs(flow->base.dst),
+			flow->base.folded & FOLDED_DST, &flow->addrs.src, &flow->addrs.dst, &flow->stats);
+}
+
+void rule_udpv6flows(gpointer data, gpointer user_data)
+{
+	struct udpv6flow *flow = data;
+
+	// unconfirmed flows (no reply seen) are not allowed traffic
+
+	if (!flow->foots.reply)
+		return;
+
+	add_rulegroup(user_data, AF_INET6, IPPROTO_UDP, ntohs(flow->base.dst),
+			flow->base.folded & FOLDED_DST, &flow->addrs.src, &flow->addrs.dst, &flow->stats);
+}
+
+void rule_icmpv6flows(gpointer data, gpointer user_data)
+{
+	struct icmpv6flow *flow = data;
+
+	// unconfirmed flows (no reply seen) are not allowed traffic
+
+	if (!flow->foots.reply)
+		return;
+
+	add_rulegroup(user_data, AF_INET6, IPPROTO_ICMPV6, flow->base.type,
+			FALSE, &flow->addrs.src, &flow->addrs.dst, &flow->stats);
+}
+
+// ----
+
+static gint cmp_rulegroup(gconstpointer ptr_one, gconstpointer ptr_two)
+{
+	const struct rulegroup *one = *(struct rulegroup **) ptr_one;
+	const struct rulegroup *two = *(struct rulegroup **) ptr_two;
+	guint onesize = g_hash_table_size(one->pairs);
+	guint twosize = g_hash_table_size(two->pairs);
+
+	// most hit groups first
+
+	if (one->bytes != two->bytes)
+		return one->bytes > two->bytes ? LESS : MORE;
+	if (one->packets != two->packets)
+		return one->packets > two->packets ? LESS : MORE;
+	if (onesize != twosize)
+		return onesize > twosize ? LESS : MORE;
+
+	// and a stable order for the rest
+
+	if (one->family != two->family)
+		return one->family < two->family ? LESS : MORE;
+	if (one->proto != two->proto)
+		return one->proto < two->proto ? LESS : MORE;
+	if (one->port != two->port)
+		return one->port < two->port ? LESS : MORE;
+	if (one->folded != two->folded)
+		return one->folded < two->folded ? LESS : MORE;
+
+	return EQUAL;
+}
+
+static GList *sorted_pairs(struct rulegroup *group)
+{
+	GList *pairs = g_hash_table_get_keys(group->pairs);
+
+	return g_list_sort(pairs, (GCompareFunc) g_strcmp0);
+}
+
+// ----
+
+static void out_nft_group(FILE *out, struct rulegroup *group)
+{
+	GList *pairs, *pair;
+	gchar **vector, *name = group_name(group);
+	gchar *addr = group->family == AF_INET ? "ipv4_addr" : "ipv6_addr";
+	gchar *l3 = group->family == AF_INET ? "ip" : "ip6";
+
+	fprintf(out, "\n\t# %s: flows: %u, packets: %" PRIu64 ", bytes: %" PRIu64 "\n",
+			name, g_hash_table_size(group->pairs), group->packets, group->bytes);
+
+	fprintf(out, "\tset %s {\n\t\ttype %s . %s\n\t\telements = {", name, addr, addr);
+
+	pairs = sorted_pairs(group);
+
+	for (pair = pairs; pair != NULL; pair = pair->next) {
+		vector = g_strsplit(pair->data, " ", 2);
+		fprintf(out, "%s\n\t\t\t%s . %s", pair == pairs ? "" : ",", vector[0], vector[1]);
+		g_strfreev(vector);
+	}
+
+	g_list_free(pairs);
+
+	fprintf(out, "\n\t\t}\n\t}\n");
+	fprintf(out, "\tchain %s {\n\t\t%s saddr . %s daddr @%s accept\n\t}\n", name, l3, l3, name);
+
+	g_free(name);
+}
+
+static void out_nft_vmap(FILE *out, GPtrArray *groups, struct rulegroup *first)
+{
+	guint i;
+	gint count = 0;
+	gchar *name;
+	gchar *l3 = first->family == AF_INET ? "ipv4" : "ipv6";
+	gchar *l4 = has_ports(first) ? "dport" : "type";
+	struct rulegroup *group;
+
+	// groups are already sorted: most hit elements first
+
+	for (i = 0; i < groups->len; i++) {
+		group = g_ptr_array_index(groups, i);
+		if (group->family != first->family || group->proto != first->proto || group->folded)
+			continue;
+		if (count++ == 0)
+			fprintf(out, "\t\tmeta nfproto %s %s %s vmap {", l3, proto_str(first->proto), l4);
+		name = group_name(group);
+		fprintf(out, "%s %u : jump %s", count > 1 ? "," : "", group->port, name);
+		g_free(name);
+	}
+
+	if (count != 0)
+		fprintf(out, " }\n");
+
+	// folded (client side) ports mean any unprivileged port: a range of its own
+
+	for (i = 0; i < groups->len; i++) {
+		group = g_ptr_array_index(groups, i);
+		if (group->family != first->family || group->proto != first->proto || !group->folded)
+			continue;
+		name = group_name(group);
+		fprintf(out, "\t\tmeta nfproto %s %s dport %u-65535 jump %s\n", l3,
+				proto_str(group->proto), FOLDED_PORT, name);
+		g_free(name);
+	}
+}
+
+static gint out_nft(GPtrArray *groups)
+{
+	guint i, j;
+	FILE *out;
+	struct rulegroup *group, *prev;
+
+	out = fopen(rulesfile, "w");
+	if (out == NULL)
+		return ERROR;
+
+	fprintf(out, "#!/usr/sbin/nft -f\n# generated by conntracker\n\n");
+	fprintf(out, "table inet conntracker\ndelete table inet conntracker\n\n");
+	fprintf(out, "table inet conntracker {\n");
+
+	for (i = 0; i < groups->len; i++)
+		out_nft_group(out, g_ptr_array_index(groups, i));
+
+	// one verdict map per family/protocol, in order of their most hit group
+
+	fprintf(out, "\n\tchain flows {\n");
+
+	for (i = 0; i < groups->len; i++) {
+		group = g_ptr_array_index(groups, i);
+		for (j = 0; j < i; j++) {
+			prev = g_ptr_array_index(groups, j);
+			if (prev->family == group->family && prev->proto == group->proto)
+				break;
+		}
+		if (j == i)
+			out_nft_vmap(out, groups, group);
+	}
+
+	fprintf(out, "\t}\n}\n");
+
+	fclose(out);
+
+	return SUCCESS;
+}
+
+// ----
+
+static void out_iptables_rule(FILE *out, struct rulegroup *group)
+{
+	gchar *name = group_name(group);
+
+	fprintf(out, "# flows: %u, packets: %" PRIu64 ", bytes: %" PRIu64 "\n",
+			g_hash_table_size(group->pairs), group->packets, group->bytes);
+
+	fprintf(out, "-A CONNTRACKER ");
+
+	switch (group->proto) {
+	case IPPROTO_TCP:
+	case IPPROTO_UDP:
+		if (group->folded)
+			fprintf(out, "-p %s -m %s --dport %u:65535 ", proto_str(group->proto),
+					proto_str(group->proto), FOLDED_PORT);
+		else
+			fprintf(out, "-p %s -m %s --dport %u ", proto_str(group->proto),
+					proto_str(group->proto), group->port);
+		break;
+	case IPPROTO_ICMP:
+		fprintf(out, "-p icmp -m icmp --icmp-type %u ", group->port);
+		break;
+	case IPPROTO_ICMPV6:
+		fprintf(out, "-p ipv6-icmp -m icmp6 --icmpv6-type %u ", group->port);
+		break;
+	}
+
+	fprintf(out, "-m set --match-set conntracker_%s src,dst -j ACCEPT\n", name);
+
+	g_free(name);
+}
+
+static void out_ipset_group(FILE *out, struct rulegroup *group)
+{
+	GList *pairs, *pair;
+	gchar **vector, *name = group_name(group);
+
+	fprintf(out, "create conntracker_%s hash:ip,ip family %s -exist\n", name,
+			group->family == AF_INET ? "inet" : "inet6");
+
+	pairs = sorted_pairs(group);
+
+	for (pair = pairs; pair != NULL; pair = pair->next) {
+		vector = g_strsplit(pair->data, " ", 2);
+		fprintf(out, "add conntracker_%s %s,%s -exist\n", name, vector[0], vector[1]);
+		g_strfreev(vector);
+	}
+
+	g_list_free(pairs);
+	g_free(name);
+}
+
+static gint out_iptables(GPtrArray *groups)
+{
+	guint i;
+	gint family;
+	FILE *out[2], *sets;
+	gchar *v6file, *setsfile;
+	struct rulegroup *group;
+
+	v6file = g_strdup_printf("%s.v6", rulesfile);
+	setsfile = g_strdup_printf("%s.ipset", rulesfile);
+
+	out[0] = fopen(rulesfile, "w");
+	out[1] = fopen(v6file, "w");
+	sets = fopen(setsfile, "w");
+
+	g_free(v6file);
+	g_free(setsfile);
+
+	if (out[0] == NULL || out[1] == NULL || sets == NULL) {
+		if (out[0])
+			fclose(out[0]);
+		if (out[1])
+			fclose(out[1]);
+		if (sets)
+			fclose(sets);
+		return ERROR;
+	}
+
+	for (family = 0; family < 2; family++)
+		fprintf(out[family], "# generated by conntracker\n*filter\n:CONNTRACKER - [0:0]\n");
+
+	// groups are already sorted: most hit rules first
+
+	for (i = 0; i < groups->len; i++) {
+		group = g_ptr_array_index(groups, i);
+		out_iptables_rule(out[group->family == AF_INET ? 0 : 1], group);
+		out_ipset_group(sets, group);
+	}
+
+	for (family = 0; family < 2; family++) {
+		fprintf(out[family], "COMMIT\n");
+		fclose(out[family]);
+	}
+
+	fclose(sets);
+
+	return SUCCESS;
+}
+
+// ----
+
+gint out_ruleset(void)
+{
+	gint ret;
+	GList *values, *value;
+	GHashTable *groups;
+	GPtrArray *sorted;
+
+	groups = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, free_rulegroup);
+
+	// walk the aggregated flows, grouping them into rules
+
+	g_sequence_foreach(tcpv4flows, rule_tcpv4flows, groups);
+	g_sequence_foreach(udpv4flows, rule_udpv4flows, groups);
+	g_sequence_foreach(icmpv4flows, rule_icmpv4flows, groups);
+	g_sequence_foreach(tcpv6flows, rule_tcpv6flows, groups);
+	g_sequence_foreach(udpv6flows, rule_udpv6flows, groups);
+	g_sequence_foreach(icmpv6flows, rule_icmpv6flows, groups);
+
+	sorted = g_ptr_array_sized_new(g_hash_table_size(groups));
+	values = g_hash_table_get_values(groups);
+
+	for (value = values; value != NULL; value = value->next)
+		g_ptr_array_add(sorted, value->data);
+
+	g_list_free(values);
+	g_ptr_array_sort(sorted, cmp_rulegroup);
+
+	switch (rulesformat) {
+	case RULESET_IPTABLES:
+		ret = out_iptables(sorted);
+		break;
+	default:
+		ret = out_nft(sorted);
+		break;
+	}
+
+	if (ret == SUCCESS) {
+		syslogwrap("Ruleset (%u rules) written into: %s", sorted->len, rulesfile);
+	} else {
+		syslogwrap("Could not write ruleset into: %s", rulesfile);
+	}
+
+	g_ptr_array_free(sorted, TRUE);
+	g_hash_table_destroy(groups);
+
+	return ret;
+}
@@ -0,0 +1,23 @@
+/*
+ * (C) 2021 by Rafael David Tinoco <rafael.tinoco@ibm.com>
+ * (C) 2021 by Rafael David Tinoco <rafaeldtinoco@ubuntu.com>
+ */
+
+#ifndef RULESET_H_
+#define RULESET_H_
+
+#include "general.h"
+
+enum {
+	RULESET_NFT = 0,
+	RULESET_IPTABLES = 1,
+};
+
+extern char *rulesfile;
+extern int rulesformat;
+
+gint set_rulesformat(char *);
+
+gint out_ruleset(void);
+
+#endif /* RULESET_H_ */
@@ -0,0 +1,254 @@
+/*
+ * (C) 2021 by Rafael David Tinoco <rafael.tinoco@ibm.com>
+ * (C) 2021 by Rafael David Tinoco <rafaeldtinoco@ubuntu.com>
+ */
+
+#include "sample.h"
+#include "netns.h"
+
+/*
+ * Stratified sampling of traced flows (-S rate[/prefix4[,prefix6]]): new flows
+ * are grouped in classes of (protocol, destination, destination port or icmp
+ * type/code), destinations optionally masked to a prefix. The first flow of a
+ * class is always traced, and then 1 of each "rate" flows of the same class.
+ *
+ * Flows that are not traced point to the footprints of the first traced flow
+ * of their class (their sibling) and inherit them in the report. A port scan
+ * then costs one trace per scanned port, not per scanned connection.
+ *
+ * Trace inheritance (-I secs[/prefix4[,prefix6]]): source ports are folded and
+ * trace rules only match (src, dst, dport), so flows from the same source
+ * network to the same destination and port traverse the same rules. Classes
+ * also include the source (masked to a prefix, /24 and /64 by default) and a
+ * new flow adopts the footprints of the last traced flow of its class, unless
+ * that trace is older than "secs": then it is traced again (path revalidated)
+ * and becomes the one to inherit from.
+ *
+ * Note: the input interface can't be part of the class, conntrack events don't
+ * carry it (it is only known once the flow is traced).
+ */
+
+struct sampleclass {
+	gpointer ns;
+	uint8_t family;
+	uint8_t proto;
+	uint16_t dport;
+	struct in6_addr src;	// inheritance classes only
+	struct in6_addr dst;
+};
+
+struct samplestate {
+	uint64_t seen;
+	struct footprints *traced;
+	gint64 tracedat;
+};
+
+guint samplerate;
+guint sampleprefix4 = 32;
+guint sampleprefix6 = 128;
+
+GHashTable *sampleclasses;
+uint64_t sampletraced;
+uint64_t sampleinherited;
+
+guint inheritrefresh;
+guint inheritprefix4 = 24;
+guint inheritprefix6 = 64;
+
+GHashTable *inheritclasses;
+uint64_t inherittraced;
+uint64_t inheritadopted;
+
+// ----
+
+gint set_sampling(char *optarg)
+{
+	gchar *prefix;
+
+	samplerate = (guint) strtoul(optarg, &prefix, 10);
+
+	if (samplerate == 0)
+		return ERROR;
+
+	if (*prefix == '/') {
+		sampleprefix4 = (guint) strtoul(prefix + 1, &prefix, 10);
+		if (*prefix == ',')
+			sampleprefix6 = (guint) strtoul(prefix + 1, &prefix, 10);
+	}
+
+	if (*prefix != '\0' || sampleprefix4 > 32 || sampleprefix6 > 128)
+		return ERROR;
+
+	return SUCCESS;
+}
+
+gint set_inherit(char *optarg)
+{
+	gchar *prefix;
+
+	inheritrefresh = (guint) strtoul(optarg, &prefix, 10);
+
+	if (inheritrefresh == 0)
+		return ERROR;
+
+	if (*prefix == '/') {
+		inheritprefix4 = (guint) strtoul(prefix + 1, &prefix, 10);
+		if (*prefix == ',')
+			inheritprefix6 = (guint) strtoul(prefix + 1, &prefix, 10);
+	}
+
+	if (*prefix != '\0' || inheritprefix4 > 32 || inheritprefix6 > 128)
+		return ERROR;
+
+	return SUCCESS;
+}
+
+static guint hash_sampleclass(gconstpointer data)
+{
+	return hash_bytes(data, sizeof(struct sampleclass));
+}
+
+static gboolean equal_sampleclass(gconstpointer one, gconstpointer two)
+{
+	return memcmp(one, two, sizeof(struct sampleclass)) == 0;
+}
+
+// ----
+
+static struct samplestate *lookup_class(GHashTable *classes, struct sampleclass *class)
+{
+	gpointer key;
+	struct samplestate *state = g_hash_table_lookup(classes, class);
+
+	if (state == NULL) {
+		state = g_new0(struct samplestate, 1);
+		key = g_malloc(sizeof(struct sampleclass));
+		memcpy(key, class, sizeof(struct sampleclass));
+		g_hash_table_insert(classes, key, state);
+	}
+
+	return state;
+}
+
+// ----
+
+struct footprints *sample_trace(uint8_t family, uint8_t proto, const void *dst, uint16_t dport,
+				struct footprints *foots)
+{
+	struct sampleclass class;
+	struct samplestate *state;
+
+	if (samplerate == 0)
+		return NULL;
+
+	memset(&class, 0, sizeof(struct sampleclass));
+
+	class.ns = netns_current();
+	class.family = family;
+	class.proto = proto;
+	class.dport = dport;
+
+	switch (family) {
+	case AF_INET:
+		memcpy(&class.dst, dst, sizeof(struct in_addr));
+		mask_prefix((uint8_t *) &class.dst, sizeof(struct in_addr), sampleprefix4);
+		break;
+	case AF_INET6:
+		memcpy(&class.dst, dst, sizeof(struct in6_addr));
+		mask_prefix((uint8_t *) &class.dst, sizeof(struct in6_addr), sampleprefix6);
+		break;
+	}
+
+	state = lookup_class(sampleclasses, &class);
+
+	// first of the class and then 1 of each samplerate flows are traced
+
+	if (state->seen++ % samplerate == 0) {
+		if (state->traced == NULL)
+			state->traced = foots;
+		sampletraced++;
+		return NULL;
+	}
+
+	sampleinherited++;
+
+	return state->traced;
+}
+
+struct footprints *inherit_trace(uint8_t family, uint8_t proto, const void *src, const void *dst,
+				 uint16_t dport, struct footprints *foots)
+{
+	struct sampleclass class;
+	struct samplestate *state;
+	gint64 now;
+
+	if (inheritrefresh == 0)
+		return NULL;
+
+	memset(&class, 0, sizeof(struct sampleclass));
+
+	class.ns = netns_current();
+	class.family = family;
+	class.proto = proto;
+	class.dport = dport;
+
+	switch (family) {
+	case AF_INET:
+		memcpy(&class.src, src, sizeof(struct in_addr));
+		memcpy(&class.dst, dst, sizeof(struct in_addr));
+		mask_prefix((uint8_t *) &class.src, sizeof(struct in_addr), inheritprefix4);
+		break;
+	case AF_INET6:
+		memcpy(&class.src, src, sizeof(struct in6_addr));
+		memcpy(&class.dst, dst, sizeof(struct in6_addr));
+		mask_prefix((uint8_t *) &class.src, sizeof(struct in6_addr), inheritprefix6);
+		break;
+	}
+
+	state = lookup_class(inheritclasses, &class);
+
+	// recently traced equivalent flow: adopt its footprints
+
+	now = g_get_monotonic_time();
+
+	if (state->traced != NULL && now - state->tracedat < (gint64) inheritrefresh * G_USEC_PER_SEC) {
+		inheritadopted++;
+		foots->inherited = 1;
+		return state->traced;
+	}
+
+	// none yet, or too old: trace this one (revalidate) and inherit from it
+
+	state->traced = foots;
+	state->tracedat = now;
+	inherittraced++;
+
+	return NULL;
+}
+
+// ----
+
+void alloc_sample(void)
+{
+	sampleclasses = g_hash_table_new_full(hash_sampleclass, equal_sampleclass, g_free, g_free);
+	inheritclasses = g_hash_table_new_full(hash_sampleclass, equal_sampleclass, g_free, g_free);
+}
+
+void free_sample(void)
+{
+	g_hash_table_destroy(sampleclasses);
+	g_hash_table_destroy(inheritclasses);
+}
+
+void out_sampling(void)
+{
+	if (samplerate != 0) {
+		syslogwrap("Sampling: %u classes, %" PRIu64 " flows traced, %" PRIu64 " inherited footprints",
+			   g_hash_table_size(sampleclasses), sampletraced, sampleinherited);
+	}
+
+	if (inheritrefresh != 0) {
+		syslogwrap("Inheritance: %u classes, %" PRIu64 " flows traced, %" PRIu64 " adopted footprints",
+			   g_hash_table_size(inheritclasses), inherittraced, inheritadopted);
+	}
+}
@@ -0,0 +1,25 @@
+/*
+ * (C) 2021 by Rafael David Tinoco <rafael.tinoco@ibm.com>
+ * (C) 2021 by Rafael David Tinoco <rafaeldtinoco@ubuntu.com>
+ */
+
+#ifndef SAMPLE_H_
+#define SAMPLE_H_
+
+#include "general.h"
+#include "footprint.h"
+
+extern guint samplerate;
+extern guint inheritrefresh;
+
+gint set_sampling(char *);
+gint set_inherit(char *);
+
+struct footprints *sample_trace(uint8_t, uint8_t, const void *, uint16_t, struct footprints *);
+struct footprints *inherit_trace(uint8_t, uint8_t, const void *, const void *, uint16_t, struct footprints *);
+
+void alloc_sample(void);
+void free_sample(void);
+void out_sampling(void);
+
+#endif /* SAMPLE_H_ */
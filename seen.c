@@ -0,0 +1,220 @@
+/*
+ * (C) 2021 by Rafael David Tinoco <rafael.tinoco@ibm.com>
+ * (C) 2021 by Rafael David Tinoco <rafaeldtinoco@ubuntu.com>
+ */
+
+#include "seen.h"
+#include "netns.h"
+#include "nat.h"
+#include "activity.h"
+
+/*
+ * Seen flows filter (-F kbytes): most conntrack events are updates of flows
+ * already known, confirmed and traced (settled), and there is nothing to learn
+ * from them. A blocked Bloom filter, keyed on the folded flow (the same key
+ * the flows tables use) and its confirmed state, is checked before anything
+ * else and short-circuits those events.
+ *
+ * - each key maps to one cache line sized block (512 bits) and sets SEEN_BITS
+ *   bits inside it: a lookup touches a single cache line
+ * - only UPDATE events are filtered: NEW and DESTROY ones (lifecycle) are
+ *   never skipped. Filtered updates carrying counters (accounting, polling),
+ *   or any of them with activity history (-H), still refresh the flow stats:
+ *   only the trace lookup is skipped
+ * - a false positive skips an update that mattered, so the filter is cleared
+ *   once it holds as many keys as it can keep at ~1% false positives
+ *
+ * Note: skipped updates don't refresh the flow "last seen" time (when there is
+ * no accounting, that is the only thing they would change).
+ */
+
+#define SEEN_BLOCK 8			// uint64_t words per block (64 bytes)
+#define SEEN_BITS 6			// bits set per key (9 hash bits each)
+#define SEEN_KEYS_PER_BLOCK 48		// 512 bits / ~10.7 bits per key
+
+struct seenkey {
+	gpointer ns;
+	uint8_t family;
+	uint8_t proto;
+	uint8_t reply;
+	uint16_t sport;
+	uint16_t dport;
+	union ctaddr src;
+	union ctaddr dst;
+	uint8_t nat;			// post-NAT endpoints (-X): part of the flow
+	uint16_t nsport;
+	uint16_t ndport;
+	union ctaddr nsrc;
+	union ctaddr ndst;
+};
+
+extern int logfd;
+
+guint seenkbytes;
+
+uint64_t *seenblocks;
+guint seennblocks;
+guint seenkeys;
+
+struct seenstats {
+	uint64_t lookups;
+	uint64_t hits;
+	uint64_t refreshes;		// hits with counters (or -H): stats still merged
+	uint64_t resets;
+} seenstats;
+
+// ----
+
+gint set_seenfilter(char *optarg)
+{
+	gchar *end;
+
+	seenkbytes = (guint) strtoul(optarg, &end, 10);
+
+	if (seenkbytes == 0 || *end != '\0')
+		return ERROR;
+
+	return SUCCESS;
+}
+
+static uint64_t hash_seenkey(struct seenkey *key)
+{
+	// the block index and bits come from the same 64 bit hash
+
+	return hash_bytes64(key, sizeof(struct seenkey));
+}
+
+static uint64_t *seen_block(uint64_t hash)
+{
+	return &seenblocks[(hash % seennblocks) * SEEN_BLOCK];
+}
+
+// ----
+
+gboolean seen_lookup(struct ctevent *ev, uint16_t sport, uint16_t dport, uint64_t *hash)
+{
+	guint i, bit;
+	uint64_t *block;
+	struct seenkey key;
+
+	if (seenkbytes == 0)
+		return FALSE;
+
+	memset(&key, 0, sizeof(struct seenkey));
+
+	key.ns = netns_current();
+	key.family = ev->family;
+	key.proto = ev->proto;
+	key.reply = ev->reply;
+	key.src = ev->src;
+	key.dst = ev->dst;
+
+	switch (ev->proto) {
+	case IPPROTO_TCP:
+	case IPPROTO_UDP:
+		key.sport = sport;
+		key.dport = dport;
+		nat_fold(ev, key.sport, key.dport, &key.nsport, &key.ndport);
+		break;
+	default:
+		key.sport = ev->itype;
+		key.dport = ev->icode;
+		break;
+	}
+
+	key.nat = ev->nat;
+	if (ev->nat & NAT_SRC)
+		key.nsrc = ev->nsrc;
+	if (ev->nat & NAT_DST)
+		key.ndst = ev->ndst;
+
+	*hash = hash_seenkey(&key);
+
+	if (ev->type != NFCT_T_UPDATE)
+		return FALSE;
+
+	seenstats.lookups++;
+
+	block = seen_block(*hash);
+
+	for (i = 0; i < SEEN_BITS; i++) {
+		bit = (*hash >> (i * 9 + 10)) & 511;
+		if ((block[bit / 64] & (1ULL << (bit % 64))) == 0)
+			return FALSE;
+	}
+
+	seenstats.hits++;
+
+	if (ev->hascounters || activitysecs != 0)
+		seenstats.refreshes++;
+
+	return TRUE;
+}
+
+void seen_add(uint64_t hash)
+{
+	guint i, bit;
+	uint64_t *block;
+
+	if (seenkbytes == 0)
+		return;
+
+	// full: start over (keeps false positives around 1%)
+
+	if (seenkeys >= seennblocks * SEEN_KEYS_PER_BLOCK) {
+		memset(seenblocks, 0, seennblocks * SEEN_BLOCK * sizeof(uint64_t));
+		seenkeys = 0;
+		seenstats.resets++;
+	}
+
+	block = seen_block(hash);
+
+	for (i = 0; i < SEEN_BITS; i++) {
+		bit = (hash >> (i * 9 + 10)) & 511;
+		block[bit / 64] |= 1ULL << (bit % 64);
+	}
+
+	seenkeys++;
+}
+
+// ----
+
+void alloc_seen(void)
+{
+	if (seenkbytes == 0)
+		return;
+
+	seennblocks = MAX(seenkbytes * 1024 / (SEEN_BLOCK * sizeof(uint64_t)), 1);
+	seenblocks = g_malloc0(seennblocks * SEEN_BLOCK * sizeof(uint64_t));
+}
+
+void free_seen(void)
+{
+	g_free(seenblocks);
+}
+
+void out_seen(void)
+{
+	if (seenkbytes == 0)
+		return;
+
+	syslogwrap("Seen flows filter: %u blocks, %" PRIu64 " lookups, %" PRIu64 " hits (%.1f%%), "
+		   "%" PRIu64 " refreshed, %" PRIu64 " resets",
+		   seennblocks, seenstats.lookups, seenstats.hits,
+		   seenstats.lookups ? 100.0 * seenstats.hits / seenstats.lookups : 0.0,
+		   seenstats.refreshes, seenstats.resets);
+}
+
+void query_seen(void)
+{
+	if (seenkbytes == 0) {
+		dprintf(logfd, "seen flows filter disabled (-F)\n");
+		return;
+	}
+
+	dprintf(logfd, "lookups: %" PRIu64 ", hits: %" PRIu64 " (%.1f%%), refreshed: %" PRIu64
+		", keys: %u (max: %u), resets: %" PRIu64 "\n",
+		seenstats.lookups, seenstats.hits,
+		seenstats.lookups ? 100.0 * seenstats.hits / seenstats.lookups : 0.0,
+		seenstats.refreshes, seenkeys, seennblocks * SEEN_KEYS_PER_BLOCK, seenstats.resets);
+}
@@ -0,0 +1,24 @@
+/*
+ * (C) 2021 by Rafael David Tinoco <rafael.tinoco@ibm.com>
+ * (C) 2021 by Rafael David Tinoco <rafaeldtinoco@ubuntu.com>
+ */
+
+#ifndef SEEN_H_
+#define SEEN_H_
+
+#include "general.h"
+#include "ctevent.h"
+
+extern guint seenkbytes;
+
+gint set_seenfilter(char *);
+
+gboolean seen_lookup(struct ctevent *, uint16_t, uint16_t, uint64_t *);
+void seen_add(uint64_t);
+
+void alloc_seen(void);
+void free_seen(void);
+void out_seen(void);
+void query_seen(void);
+
+#endif /* SEEN_H_ */
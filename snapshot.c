@@ -0,0 +1,206 @@
+/*
+ * (C) 2021 by Rafael David Tinoco <rafael.tinoco@ibm.com>
+ * (C) 2021 by Rafael David Tinoco <rafaeldtinoco@ubuntu.com>
+ */
+
+#include "snapshot.h"
+
+/*
+ * Flow snapshot format (baseline.c writes and compares them, ctmerge merges
+ * them): one fixed size record per flow, followed by its footprints.
+ *
+ * - records are sorted by a 64 bit hash of the flow tuple (then the tuple
+ *   itself), an order that doesn't depend on the host: 2 snapshots are
+ *   compared (or N merged) walking them side by side, in linear time
+ * - the footprints of a flow are summarized by another 64 bit hash, so
+ *   telling if a flow went through different rules is a single comparison
+ * - integers are kept in host byte order (snapshots are compared and merged
+ *   on the architecture that produced them)
+ * - each record ends with the bitmap of the hosts that have the flow, so a
+ *   merged snapshot keeps where its flows came from (and can be merged again)
+ */
+
+void snap_tuple(struct snaprec *rec, uint8_t family, uint8_t proto, void *src, void *dst,
+		uint16_t sport, uint16_t dport)
+{
+	gsize len = family == AF_INET ? sizeof(struct in_addr) : sizeof(struct in6_addr);
+
+	memset(&rec->tuple, 0, sizeof(struct snaptuple));
+
+	rec->tuple.family = family;
+	rec->tuple.proto = proto;
+	rec->tuple.sport = sport;
+	rec->tuple.dport = dport;
+
+	memcpy(&rec->tuple.src, src, len);
+	memcpy(&rec->tuple.dst, dst, len);
+
+	rec->key = hash_bytes64(&rec->tuple, sizeof(struct snaptuple));
+}
+
+uint64_t snap_pathkey(struct snapfp *fps, guint nfps)
+{
+	if (nfps == 0)
+		return 0;
+
+	// footprints come sorted (fppath.c), the same set gives the same key
+
+	return hash_bytes64(fps, nfps * sizeof(struct snapfp));
+}
+
+gint cmp_snaprec(gconstpointer ptr_one, gconstpointer ptr_two)
+{
+	gint res;
+	const struct snaprec *one = ptr_one, *two = ptr_two;
+
+	if (one->key < two->key)
+		return LESS;
+	if (one->key > two->key)
+		return MORE;
+
+	// hash collisions: the tuple decides
+
+	res = memcmp(&one->tuple, &two->tuple, sizeof(struct snaptuple));
+
+	if (res < 0)
+		return LESS;
+	if (res > 0)
+		return MORE;
+
+	return EQUAL;
+}
+
+gint cmp_snapfp(gconstpointer ptr_one, gconstpointer ptr_two)
+{
+	const struct snapfp *one = ptr_one, *two = ptr_two;
+	gint res;
+
+	if (one->table != two->table)
+		return one->table < two->table ? LESS : MORE;
+
+	res = g_strcmp0(one->chain, two->chain);
+
+	if (res != 0)
+		return res < 0 ? LESS : MORE;
+	if (one->type != two->type)
+		return one->type < two->type ? LESS : MORE;
+	if (one->position != two->position)
+		return one->position < two->position ? LESS : MORE;
+
+	return EQUAL;
+}
+
+guint snap_uniqfps(GArray *array)
+{
+	guint i, len = 0;
+	struct snapfp *fps = (struct snapfp *) array->data;
+
+	// sorted, duplicates removed: the same set gives the same pathkey
+
+	g_array_sort(array, cmp_snapfp);
+
+	for (i = 0; i < array->len; i++)
+		if (len == 0 || cmp_snapfp(&fps[len - 1], &fps[i]) != EQUAL)
+			fps[len++] = fps[i];
+
+	g_array_set_size(array, len);
+
+	return len;
+}
+
+gchar *snap_str(struct snaptuple *tuple)
+{
+	gchar *str, src[INET6_ADDRSTRLEN], dst[INET6_ADDRSTRLEN];
+	const gchar *name;
+
+	inet_ntop(tuple->family, &tuple->src, src, sizeof(src));
+	inet_ntop(tuple->family, &tuple->dst, dst, sizeof(dst));
+
+	switch (tuple->proto) {
+	case IPPROTO_TCP:
+		name = tuple->family == AF_INET ? "TCPv4" : "TCPv6";
+		break;
+	case IPPROTO_UDP:
+		name = tuple->family == AF_INET ? "UDPv4" : "UDPv6";
+		break;
+	default:
+		name = tuple->family == AF_INET ? "ICMPv4" : "ICMPv6";
+		str = g_strdup_printf("%s src = %s to dst = %s (type=%u | code=%u)", name,
+				      src, dst, tuple->sport, tuple->dport);
+		return str;
+	}
+
+	str = g_strdup_printf("%s src = %s (port=%u) to dst = %s (port=%u)", name,
+			      src, ntohs(tuple->sport), dst, ntohs(tuple->dport));
+
+	return str;
+}
+
+// ----
+
+gint snap_write_header(FILE *out, uint64_t count, uint32_t hosts)
+{
+	struct snaphdr hdr;
+
+	memset(&hdr, 0, sizeof(struct snaphdr));
+	memcpy(hdr.magic, SNAP_MAGIC, sizeof(SNAP_MAGIC));
+	hdr.count = count;
+	hdr.hosts = hosts;
+
+	if (fwrite(&hdr, sizeof(struct snaphdr), 1, out) != 1)
+		return ERROR;
+
+	return SUCCESS;
+}
+
+gint snap_write_rec(FILE *out, struct snaprec *rec, struct snapfp *fps, uint8_t *hostmap, uint32_t hosts)
+{
+	if (fwrite(rec, sizeof(struct snaprec), 1, out) != 1)
+		return ERROR;
+
+	if (rec->nfps && fwrite(fps, sizeof(struct snapfp), rec->nfps, out) != rec->nfps)
+		return ERROR;
+
+	if (fwrite(hostmap, SNAP_HOSTBYTES(hosts), 1, out) != 1)
+		return ERROR;
+
+	return SUCCESS;
+}
+
+gint snap_read_header(FILE *in, uint64_t *count, uint32_t *hosts)
+{
+	struct snaphdr hdr;
+
+	if (fread(&hdr, sizeof(struct snaphdr), 1, in) != 1)
+		return ERROR;
+
+	if (memcmp(hdr.magic, SNAP_MAGIC, sizeof(SNAP_MAGIC)) != 0)
+		return ERROR;
+
+	if (hdr.hosts == 0 || hdr.hosts > SNAP_MAXHOSTS)
+		return ERROR;
+
+	*count = hdr.count;
+	*hosts = hdr.hosts;
+
+	return SUCCESS;
+}
+
+gint snap_read_rec(FILE *in, struct snaprec *rec, GArray *fps, uint8_t *hostmap, uint32_t hosts)
+{
+	if (fread(rec, sizeof(struct snaprec), 1, in) != 1)
+		return ERROR;
+
+	if (rec->nfps > SNAP_MAXFPS)
+		return ERROR;
+
+	g_array_set_size(fps, rec->nfps);
+
+	if (rec->nfps && fread(fps->data, sizeof(struct snapfp), rec->nfps, in) != rec->nfps)
+		return ERROR;
+
+	if (fread(hostmap, SNAP_HOSTBYTES(hosts), 1, in) != 1)
+		return ERROR;
+
+	return SUCCESS;
+}
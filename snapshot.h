@@ -0,0 +1,77 @@
+/*
+ * (C) 2021 by Rafael David Tinoco <rafael.tinoco@ibm.com>
+ * (C) 2021 by Rafael David Tinoco <rafaeldtinoco@ubuntu.com>
+ */
+
+#ifndef SNAPSHOT_H_
+#define SNAPSHOT_H_
+
+#include "general.h"
+
+/*
+ * flow snapshots: binary files with the flows, sorted by their key (so they
+ * can be compared and merged in a single pass), host byte order:
+ *
+ *   header | record [footprint ...] hosts | record [footprint ...] hosts | ...
+ *
+ * hosts: bitmap of the hosts that have the flow, SNAP_HOSTBYTES(header hosts)
+ * bytes (a single host, bit 0, unless the snapshot comes from ctmerge)
+ */
+
+#define SNAP_MAGIC "CTSNAP2"
+#define SNAP_MAXFPS 4096
+#define SNAP_MAXHOSTS 65536
+
+#define SNAP_HOSTBYTES(hosts) (((hosts) + 7) / 8)
+
+struct snaphdr {
+	char magic[8];
+	uint64_t count;
+	uint32_t hosts;			// hosts merged into the snapshot
+	uint32_t pad;
+};
+
+struct snaptuple {
+	uint8_t family;
+	uint8_t proto;
+	uint16_t sport;			// network order (ICMP: type)
+	uint16_t dport;			// network order (ICMP: code)
+	uint16_t pad;
+	struct in6_addr src;		// IPv4: first 4 bytes
+	struct in6_addr dst;
+};
+
+struct snaprec {
+	uint64_t key;			// hash of the tuple (sort order)
+	uint64_t pathkey;		// hash of the footprints (0: none)
+	struct snaptuple tuple;
+	uint64_t packets;
+	uint64_t bytes;
+	uint32_t first;
+	uint32_t last;
+	uint8_t reply;
+	uint8_t pad[3];
+	uint32_t nfps;			// footprints following the record
+};
+
+struct snapfp {
+	uint8_t table;
+	uint8_t type;
+	uint16_t pad;
+	uint32_t position;
+	char chain[20];
+};
+
+void snap_tuple(struct snaprec *, uint8_t, uint8_t, void *, void *, uint16_t, uint16_t);
+uint64_t snap_pathkey(struct snapfp *, guint);
+gint cmp_snaprec(gconstpointer, gconstpointer);
+gint cmp_snapfp(gconstpointer, gconstpointer);
+guint snap_uniqfps(GArray *);
+gchar *snap_str(struct snaptuple *);
+
+gint snap_write_header(FILE *, uint64_t, uint32_t);
+gint snap_write_rec(FILE *, struct snaprec *, struct snapfp *, uint8_t *, uint32_t);
+gint snap_read_header(FILE *, uint64_t *, uint32_t *);
+gint snap_read_rec(FILE *, struct snaprec *, GArray *, uint8_t *, uint32_t);
+
+#endif /* SNAPSHOT_H_ */
@@ -0,0 +1,285 @@
+/*
+ * (C) 2021 by Rafael David Tinoco <rafael.tinoco@ibm.com>
+ * (C) 2021 by Rafael David Tinoco <rafaeldtinoco@ubuntu.com>
+ */
+
+#include "tracesched.h"
+#include "netns.h"
+#include "event.h"
+
+/*
+ * Trace scheduler: sits between add_*traces() and the trace rules programming
+ * so bursts of new flows don't turn into bursts of netfilter rules churn.
+ *
+ * - budget (-t rules/sec): a token bucket refilled every SCHED_TICK msecs, each
+ *   trace costs the rules it adds (2 for IPv4, 1 set member for IPv6 or -m)
+ * - cap (-T flows): maximum number of flows being traced at the same time,
+ *   a slot is given back when the trace rules are removed (or expire)
+ *
+ * Traces that can't start right away are queued, ordered by priority:
+ *
+ *   0. flows to a destination port (protocol) never traced before, confirmed
+ *   1. flows to a destination port (protocol) never traced before
+ *   2. confirmed flows
+ *   3. everything else
+ *
+ * and, within the same priority, by arrival. Queue depth and time spent in the
+ * queue are reported when finishing (and by the "sched" live query).
+ */
+
+#define SCHED_MAXCOST 2
+
+extern int logfd;
+
+struct schedentry {
+	struct netns *ns;
+	sched_fn fn;
+	gpointer flow;
+	guint cost;
+	guint prio;
+	uint64_t seq;
+	gint64 queued;
+};
+
+guint schedrate;
+guint schedcap;
+
+GSequence *schedqueue;
+GHashTable *schedports;
+guint schedioid;
+guint schedactive;
+gdouble schedtokens;
+gint64 schedrefill;
+uint64_t schedseq;
+
+struct schedstats {
+	uint64_t started;
+	uint64_t queued;
+	uint64_t dropped;
+	guint maxdepth;
+	guint maxactive;
+	gint64 waitusecs;
+	gint64 maxwait;
+} schedstats;
+
+// ----
+
+gint set_schedrate(char *optarg)
+{
+	gchar *end;
+
+	schedrate = (guint) strtoul(optarg, &end, 10);
+
+	if (schedrate == 0 || *end != '\0')
+		return ERROR;
+
+	return SUCCESS;
+}
+
+gint set_schedcap(char *optarg)
+{
+	gchar *end;
+
+	schedcap = (guint) strtoul(optarg, &end, 10);
+
+	if (schedcap == 0 || *end != '\0')
+		return ERROR;
+
+	return SUCCESS;
+}
+
+static gint cmp_schedentry(gconstpointer a, gconstpointer b, gpointer data)
+{
+	const struct schedentry *one = a, *two = b;
+
+	if (one->prio != two->prio)
+		return one->prio < two->prio ? -1 : 1;
+
+	if (one->seq != two->seq)
+		return one->seq < two->seq ? -1 : 1;
+
+	return 0;
+}
+
+// ----
+
+static void sched_refill(void)
+{
+	gint64 now = g_get_monotonic_time();
+
+	if (schedrate == 0)
+		return;
+
+	schedtokens += (gdouble) (now - schedrefill) * schedrate / G_USEC_PER_SEC;
+	schedtokens = MIN(schedtokens, (gdouble) MAX(schedrate, SCHED_MAXCOST));
+
+	schedrefill = now;
+}
+
+static gboolean sched_allowed(guint cost)
+{
+	if (schedcap != 0 && schedactive >= schedcap)
+		return FALSE;
+
+	if (schedrate != 0 && schedtokens < cost)
+		return FALSE;
+
+	return TRUE;
+}
+
+static void sched_start(struct netns *ns, sched_fn fn, gpointer flow, guint cost)
+{
+	struct netns *prev = netns_current();
+
+	// namespace gone while the trace was queued: nothing to trace
+
+	if (ns->fd < 0) {
+		schedstats.dropped++;
+		return;
+	}
+
+	if (schedrate != 0)
+		schedtokens -= cost;
+
+	schedactive++;
+	schedstats.started++;
+	schedstats.maxactive = MAX(schedstats.maxactive, schedactive);
+
+	netns_enter(ns);
+	fn(flow);
+	netns_enter(prev);
+}
+
+static gboolean sched_dispatch(gpointer data)
+{
+	GSequenceIter *iter;
+	struct schedentry *entry;
+	gint64 wait;
+
+	sched_refill();
+
+	while (g_sequence_get_length(schedqueue) > 0) {
+
+		iter = g_sequence_get_begin_iter(schedqueue);
+		entry = g_sequence_get(iter);
+
+		if (!sched_allowed(entry->cost))
+			return TRUE;
+
+		wait = g_get_monotonic_time() - entry->queued;
+		schedstats.waitusecs += wait;
+		schedstats.maxwait = MAX(schedstats.maxwait, wait);
+
+		sched_start(entry->ns, entry->fn, entry->flow, entry->cost);
+
+		g_sequence_remove(iter);
+	}
+
+	// queue is empty: stop ticking until something is queued again
+
+	schedioid = 0;
+
+	return FALSE;
+}
+
+// ----
+
+void sched_trace(sched_fn fn, gpointer flow, uint8_t proto, uint16_t dport, uint8_t reply, guint cost)
+{
+	guint depth;
+	gboolean newport;
+	struct schedentry *entry;
+	gpointer key = GUINT_TO_POINTER((guint) proto << 16 | dport);
+
+	// no budget and no cap: trace right away (as always)
+
+	if (schedrate == 0 && schedcap == 0) {
+		fn(flow);
+		return;
+	}
+
+	newport = !g_hash_table_contains(schedports, key);
+	if (newport)
+		g_hash_table_add(schedports, key);
+
+	sched_refill();
+
+	// nothing waiting in front of it: no need to queue
+
+	if (g_sequence_get_length(schedqueue) == 0 && sched_allowed(cost)) {
+		sched_start(netns_current(), fn, flow, cost);
+		return;
+	}
+
+	entry = g_malloc(sizeof(struct schedentry));
+
+	entry->ns = netns_current();
+	entry->fn = fn;
+	entry->flow = flow;
+	entry->cost = cost;
+	entry->prio = (newport ? 0 : 2) + (reply ? 0 : 1);
+	entry->seq = schedseq++;
+	entry->queued = g_get_monotonic_time();
+
+	g_sequence_insert_sorted(schedqueue, entry, cmp_schedentry, NULL);
+
+	depth = g_sequence_get_length(schedqueue);
+
+	schedstats.queued++;
+	schedstats.maxdepth = MAX(schedstats.maxdepth, depth);
+
+	if (schedioid == 0)
+		schedioid = ev_add_timeout(SCHED_TICK, sched_dispatch, NULL);
+}
+
+void sched_done(void)
+{
+	if (schedactive > 0)
+		schedactive--;
+}
+
+// ----
+
+void alloc_sched(void)
+{
+	schedqueue = g_sequence_new(g_free);
+	schedports = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+	schedtokens = MAX(schedrate, SCHED_MAXCOST);
+	schedrefill = g_get_monotonic_time();
+}
+
+void free_sched(void)
+{
+	if (schedioid != 0)
+		ev_remove(schedioid);
+
+	g_sequence_free(schedqueue);
+	g_hash_table_destroy(schedports);
+}
+
+void out_sched(void)
+{
+	if (schedrate == 0 && schedcap == 0)
+		return;
+
+	syslogwrap("Trace scheduler: %" PRIu64 " started, %" PRIu64 " queued (max depth: %u, left: %d), "
+		   "%" PRIu64 " dropped, max active: %u, avg wait: %" PRId64 " ms, max wait: %" PRId64 " ms",
+		   schedstats.started, schedstats.queued, schedstats.maxdepth,
+		   g_sequence_get_length(schedqueue), schedstats.dropped, schedstats.maxactive,
+		   schedstats.queued ? schedstats.waitusecs / (gint64) schedstats.queued / 1000 : 0,
+		   schedstats.maxwait / 1000);
+}
+
+void query_sched(void)
+{
+	dprintf(logfd, "queue depth: %d (max: %u), active traces: %u (max: %u), tokens: %.1f\n",
+		g_sequence_get_length(schedqueue), schedstats.maxdepth,
+		schedactive, schedstats.maxactive, schedtokens);
+
+	dprintf(logfd, "started: %" PRIu64 ", queued: %" PRIu64 ", dropped: %" PRIu64
+		", avg wait: %" PRId64 " ms, max wait: %" PRId64 " ms\n",
+		schedstats.started, schedstats.queued, schedstats.dropped,
+		schedstats.queued ? schedstats.waitusecs / (gint64) schedstats.queued / 1000 : 0,
+		schedstats.maxwait / 1000);
+}
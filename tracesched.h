@@ -0,0 +1,29 @@
+/*
+ * (C) 2021 by Rafael David Tinoco <rafael.tinoco@ibm.com>
+ * (C) 2021 by Rafael David Tinoco <rafaeldtinoco@ubuntu.com>
+ */
+
+#ifndef TRACESCHED_H_
+#define TRACESCHED_H_
+
+#include "general.h"
+
+#define SCHED_TICK 100
+
+typedef void (*sched_fn)(gpointer);
+
+extern guint schedrate;
+extern guint schedcap;
+
+gint set_schedrate(char *);
+gint set_schedcap(char *);
+
+void sched_trace(sched_fn, gpointer, uint8_t, uint16_t, uint8_t, guint);
+void sched_done(void);
+
+void alloc_sched(void);
+void free_sched(void);
+void out_sched(void);
+void query_sched(void);
+
+#endif /* TRACESCHED_H_ */
@@ -0,0 +1,238 @@
+/*
+ * (C) 2021 by Rafael David Tinoco <rafael.tinoco@ibm.com>
+ * (C) 2021 by Rafael David Tinoco <rafaeldtinoco@ubuntu.com>
+ */
+
+#include "workers.h"
+#include "event.h"
+
+/*
+ * Trace messages (NFLOG) decoding fanned out across worker threads:
+ *
+ * - a receiver thread only reads the NFLOG socket, hashes the original tuple
+ *   of each message and queues a copy of the message to the worker owning
+ *   that hash (messages of a flow always go to the same worker, in order)
+ * - each worker decodes its messages (ctevent_from_nflog: the NFLOG and the
+ *   conntrack attributes walked in place with libmnl, no nfct objects, and
+ *   the TRACE prefix split) into ctevents and queues them back, waking the
+ *   main loop
+ * - the main loop drains all worker queues and merges the ctevents into the
+ *   flows tables: it is the only one touching them, no locks needed
+ * - lost messages (ENOBUFS) seen by the receiver are only counted (atomic)
+ *   and the main loop woken: the receive buffer accounting and growth are
+ *   done by the main loop, as for any other socket
+ *
+ * NOTE: the TRACE target always logs through NFLOG group 0 (there is no way
+ * to choose the group for a traced flow), so there is a single socket to read
+ * from. What is spread over the workers is the decoding: with the in place
+ * walk it is not expensive by itself (the receiver walks the same attributes
+ * to hash the tuple), the prefix split and the ctevent allocation are most of
+ * it. The gain is a receiver doing as little as possible per message, so the
+ * socket is drained faster during trace bursts (less ENOBUFS).
+ */
+
+struct worker {
+	GThread *thread;
+	GAsyncQueue *in;	// raw netlink msgs (from receiver)
+	GAsyncQueue *out;	// decoded ctevents (to main loop)
+};
+
+guint nworkers;
+
+struct worker *workers;
+struct mnl_socket *workersnl;
+struct nlbuf *workersbuf;
+GThread *receiver;
+ctevent_fn workersfn;
+int workersfd = -1;
+guint workersoverruns;		// ENOBUFS seen by the receiver (atomic)
+
+static gchar stopmsg;
+
+gint set_workers(char *optarg)
+{
+	gchar *end;
+
+	nworkers = (guint) strtoul(optarg, &end, 10);
+
+	if (end == optarg || *end != '\0' || nworkers > WORKERS_MAX)
+		return ERROR;
+
+	return SUCCESS;
+}
+
+// ----
+
+static guint hash_tuple(const struct nlmsghdr *nlh)
+{
+	const struct nlattr *attr, *ct = NULL;
+
+	// only the NFULA_CT attribute matters: walk attrs without validating them
+
+	mnl_attr_for_each(attr, nlh, sizeof(struct nfgenmsg)) {
+		if (mnl_attr_get_type(attr) == NFULA_CT) {
+			ct = attr;
+			break;
+		}
+	}
+
+	if (ct == NULL)
+		return 0;
+
+	mnl_attr_for_each_nested(attr, ct) {
+		if (mnl_attr_get_type(attr) == CTA_TUPLE_ORIG)
+			return hash_bytes(mnl_attr_get_payload(attr), mnl_attr_get_payload_len(attr));
+	}
+
+	return 0;
+}
+
+static gpointer receiver_thread(gpointer data)
+{
+	gint len;
+	uint64_t one = 1;
+	gpointer copy;
+	struct nlmsghdr *nlh;
+	unsigned char buf[MNL_SOCKET_BUFFER_SIZE] __attribute__ ((aligned));
+
+	while (TRUE) {
+		len = mnl_socket_recvfrom(workersnl, buf, sizeof(buf));
+
+		if (len < 0) {
+			// lost messages (ENOBUFS) are not fatal: tell main loop, keep reading
+			if (errno == ENOBUFS) {
+				g_atomic_int_inc(&workersoverruns);
+				if (write(workersfd, &one, sizeof(one)) < 0)
+					debug("could not wake up main loop");
+			}
+			if (errno == ENOBUFS || errno == EINTR)
+				continue;
+			break;
+		}
+
+		for (nlh = (struct nlmsghdr *) buf; mnl_nlmsg_ok(nlh, len); nlh = mnl_nlmsg_next(nlh, &len)) {
+			if (nlh->nlmsg_type < NLMSG_MIN_TYPE)
+				continue;
+			copy = g_malloc(nlh->nlmsg_len);
+			memcpy(copy, nlh, nlh->nlmsg_len);
+			g_async_queue_push(workers[hash_tuple(nlh) % nworkers].in, copy);
+		}
+	}
+
+	return NULL;
+}
+
+static gpointer worker_thread(gpointer data)
+{
+	uint64_t one = 1;
+	struct nlmsghdr *nlh;
+	struct ctevent *ev;
+	struct worker *worker = data;
+
+	while ((nlh = g_async_queue_pop(worker->in)) != (gpointer) &stopmsg) {
+
+		ev = g_malloc(sizeof(struct ctevent));
+
+		if (ctevent_from_nflog(nlh, ev) == SUCCESS) {
+			g_async_queue_push(worker->out, ev);
+			if (write(workersfd, &one, sizeof(one)) < 0)
+				debug("could not wake up main loop");
+		} else {
+			g_free(ev);
+		}
+
+		g_free(nlh);
+	}
+
+	return NULL;
+}
+
+static void workers_drain(void)
+{
+	guint i;
+	struct ctevent *ev;
+
+	for (i = 0; i < nworkers; i++) {
+		while ((ev = g_async_queue_try_pop(workers[i].out)) != NULL) {
+			workersfn(ev);
+			g_free(ev);
+		}
+	}
+}
+
+gboolean workerscb(GIOChannel *source, GIOCondition condition, gpointer data)
+{
+	uint64_t count;
+	guint overruns;
+
+	if (read(workersfd, &count, sizeof(count)) < 0)
+		return TRUE;
+
+	overruns = g_atomic_int_and(&workersoverruns, 0);
+
+	while (overruns-- > 0)
+		nlbuf_overrun(workersbuf);
+
+	workers_drain();
+
+	// return FALSE to stop event source, TRUE not to
+	return TRUE;
+}
+
+// ----
+
+gint workers_start(struct mnl_socket *nl, struct nlbuf *buf, ctevent_fn fn)
+{
+	guint i;
+	gchar *name;
+
+	workersnl = nl;
+	workersbuf = buf;
+	workersfn = fn;
+
+	workersfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (workersfd < 0)
+		return ERROR;
+
+	workers = g_new0(struct worker, nworkers);
+
+	for (i = 0; i < nworkers; i++) {
+		workers[i].in = g_async_queue_new();
+		workers[i].out = g_async_queue_new();
+		name = g_strdup_printf("nflog-worker%u", i);
+		workers[i].thread = g_thread_new(name, worker_thread, &workers[i]);
+		g_free(name);
+	}
+
+	receiver = g_thread_new("nflog-receiver", receiver_thread, NULL);
+
+	ev_add_io(workersfd, workerscb, NULL);
+
+	syslogwrap("Decoding traces with %u worker threads", nworkers);
+
+	return SUCCESS;
+}
+
+void workers_stop(void)
+{
+	guint i;
+
+	if (workers == NULL)
+		return;
+
+	/*
+	 * the receiver is blocked reading the socket and only touches the
+	 * input queues: leave it, it finishes with the process
+	 */
+
+	for (i = 0; i < nworkers; i++) {
+		g_async_queue_push(workers[i].in, &stopmsg);
+		g_thread_join(workers[i].thread);
+	}
+
+	// workers decoded everything queued before the stop: merge it before the report
+
+	workers_drain();
+
+	close(workersfd);
+}
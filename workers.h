@@ -0,0 +1,27 @@
+/*
+ * (C) 2021 by Rafael David Tinoco <rafael.tinoco@ibm.com>
+ * (C) 2021 by Rafael David Tinoco <rafaeldtinoco@ubuntu.com>
+ */
+
+#ifndef WORKERS_H_
+#define WORKERS_H_
+
+#include "general.h"
+#include "ctevent.h"
+#include "nlbuf.h"
+
+#include <sys/eventfd.h>
+#include <linux/netfilter/nfnetlink_conntrack.h>
+
+#define WORKERS_MAX 64
+
+typedef void (*ctevent_fn)(struct ctevent *);
+
+extern guint nworkers;
+
+gint set_workers(char *);
+
+gint workers_start(struct mnl_socket *, struct nlbuf *, ctevent_fn);
+void workers_stop(void);
+
+#endif /* WORKERS_H_ */